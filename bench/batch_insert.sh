@@ -0,0 +1,31 @@
+#!/bin/sh
+# Insert throughput of shuffled rows sent as multi-row inserts of
+# different batch sizes.
+#
+# usage: bench/batch_insert.sh [rows] [batch sizes...]
+# Run from the repository root after `make`.
+
+ROWS=${1:-100000}
+shift 2>/dev/null
+BATCHES=${*:-1 100 1000 10000}
+DIR=${TMPDIR:-/tmp}
+DB=$DIR/bench_batch_insert.db
+DATA=$DIR/bench_batch_insert.txt
+
+for batch in $BATCHES; do
+	seq 1 "$ROWS" | awk 'BEGIN { srand(1) } { printf "%.8f %d\n", rand(), $1 }' |
+		sort -k1,1 | awk -v batch="$batch" '{
+			printf "%s(%d, user%d, user%d@example.com)", n++ ? ", " : "insert ", $2, $2, $2
+			if(n == batch){ printf "\n"; n = 0 }
+		}
+		END { if(n) printf "\n"; print ".exit" }' > "$DATA"
+
+	rm -f "$DB" "$DB-wal"
+	start=$(date +%s.%N)
+	./db --frames 8192 "$DB" < "$DATA" > /dev/null
+	end=$(date +%s.%N)
+	echo "$start $end" | awk -v rows="$ROWS" -v batch="$batch" \
+		'{ printf "batch %5d: %10.0f inserts/sec\n", batch, rows / ($2 - $1) }'
+done
+
+rm -f "$DB" "$DB-wal" "$DATA"
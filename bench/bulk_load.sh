@@ -0,0 +1,35 @@
+#!/bin/sh
+# Ingest of the same shuffled rows through row-at-a-time inserts and
+# through .load, which sorts them and builds the tree bottom-up.
+#
+# usage: bench/bulk_load.sh [rows] [group commit]
+# Run from the repository root after `make`.
+
+ROWS=${1:-1000000}
+GROUP=${2:-1000}
+DIR=${TMPDIR:-/tmp}
+DB=$DIR/bench_bulk_load.db
+DATA=$DIR/bench_bulk_load.txt
+
+seq 1 "$ROWS" | awk 'BEGIN { srand(1) } { printf "%.8f %d\n", rand(), $1 }' |
+	sort -k1,1 | awk '{ printf "%d user%d user%d@example.com\n", $2, $2, $2 }' > "$DATA"
+
+rate(){
+	echo "$1 $2" | awk -v rows="$ROWS" -v name="$3" \
+		'{ printf "%-24s %8.2f s %12.0f rows/sec\n", name, $2 - $1, rows / ($2 - $1) }'
+}
+
+rm -f "$DB" "$DB-wal"
+start=$(date +%s.%N)
+{ awk '{ print "insert", $0 }' "$DATA"; echo ".exit"; } |
+	./db --group-commit "$GROUP" "$DB" > /dev/null
+end=$(date +%s.%N)
+rate "$start" "$end" "insert (group $GROUP)"
+
+rm -f "$DB" "$DB-wal"
+start=$(date +%s.%N)
+printf ".load %s\n.exit\n" "$DATA" | ./db "$DB" > /dev/null
+end=$(date +%s.%N)
+rate "$start" "$end" ".load"
+
+rm -f "$DB" "$DB-wal" "$DATA"
@@ -0,0 +1,130 @@
+/*
+ * Point lookups per second from 1 to N reader threads, each run while a
+ * writer thread inserts new keys into the same table.
+ *
+ * usage: cc -O2 -std=c99 -pthread bench/concurrency.c -o concurrency
+ *        ./concurrency [rows] [max readers] [seconds per run] [mmap]
+ * The table is bulk loaded with every KEY_SPACING-th key, at 70% fill, and
+ * the writer fills in random keys between them, so it splits leaves all
+ * over the tree. The pool holds the
+ * whole table and the log is off, so what is measured is the latching and
+ * not the I/O. Readers pin pages with an atomic add on the frame's pin
+ * count and no lock; with "mmap" they touch no shared state that a reader
+ * writes.
+ * Every lookup must find its row; misses are reported.
+ */
+#define main db_main
+#include "../main.c"
+#undef main
+#include <time.h>
+
+#define KEY_SPACING 16
+
+typedef struct {
+	Table *table;
+	uint32_t rows;
+	uint64_t seed;
+	uint64_t operations;
+	uint64_t misses;
+} Worker;
+
+bool stop;
+
+uint32_t next_random(uint64_t *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return (uint32_t)*state;
+}
+
+void *reader_thread(void *arg){
+	Worker *worker = arg;
+	Row row;
+
+	while(!__atomic_load_n(&stop, __ATOMIC_RELAXED)){
+		uint32_t key = KEY_SPACING * (next_random(&worker->seed) % worker->rows + 1);
+		if(!table_get(worker->table, key, &row) || row.id != key){
+			worker->misses++;
+		}
+		worker->operations++;
+	}
+	return NULL;
+}
+
+void *writer_thread(void *arg){
+	Worker *worker = arg;
+	Row row = {0};
+
+	while(!__atomic_load_n(&stop, __ATOMIC_RELAXED)){
+		row.id = next_random(&worker->seed) % (KEY_SPACING * worker->rows);
+		if(row.id % KEY_SPACING == 0){
+			continue;
+		}
+		snprintf(row.username, sizeof(row.username), "writer%d", row.id);
+		if(table_insert(worker->table, &row) == EXECUTE_SUCCESS){
+			worker->operations++;
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]){
+	uint32_t rows = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	uint32_t max_readers = argc > 2 ? strtoul(argv[2], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t seconds = argc > 3 ? strtoul(argv[3], NULL, 10) : 2;
+	const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	char filename[PATH_MAX];
+	DbOptions options = {
+		.pool_frames = rows / 20 + 1024,
+		.use_mmap = argc > 4 && strcmp(argv[4], "mmap") == 0,
+		.use_wal = false,
+		.group_commit = WAL_DEFAULT_GROUP_COMMIT
+	};
+
+	snprintf(filename, sizeof(filename), "%s/bench_concurrency.db", dir);
+	unlink(filename);
+
+	Table *table = db_open(filename, &options);
+	BulkLoader *loader = bulk_load_begin(table, 70);
+	Row row = {0};
+	uint32_t duplicates;
+	for(uint32_t i = 1; i <= rows; i++){
+		row.id = KEY_SPACING * i;
+		snprintf(row.username, sizeof(row.username), "user%d", row.id);
+		bulk_load_add(loader, &row);
+	}
+	bulk_load_finish(loader, &duplicates);
+
+	for(uint32_t readers = 1; ; readers = readers * 2 < max_readers ? readers * 2 : max_readers){
+		pthread_t threads[readers + 1];
+		Worker workers[readers + 1];
+
+		__atomic_store_n(&stop, false, __ATOMIC_RELAXED);
+		for(uint32_t i = 0; i <= readers; i++){
+			workers[i] = (Worker){ .table = table, .rows = rows,
+				.seed = 0x9e3779b97f4a7c15ULL * (readers * 64 + i + 1) };
+			pthread_create(&threads[i], NULL, i == 0 ? writer_thread : reader_thread, &workers[i]);
+		}
+		sleep(seconds);
+		__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+		uint64_t lookups = 0, misses = 0;
+		for(uint32_t i = 0; i <= readers; i++){
+			pthread_join(threads[i], NULL);
+			if(i > 0){
+				lookups += workers[i].operations;
+				misses += workers[i].misses;
+			}
+		}
+		printf("%3d readers  %12.0f lookups/sec  %10.0f inserts/sec  %lu misses\n",
+				readers, (double)lookups / seconds, (double)workers[0].operations / seconds,
+				(unsigned long)misses);
+		if(readers >= max_readers){
+			break;
+		}
+	}
+
+	db_close(table);
+	unlink(filename);
+	return 0;
+}
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Insert throughput with one fdatasync() per statement versus group commit.
+#
+# usage: bench/group_commit.sh [rows] [batch sizes...]
+# Run from the repository root after `make`.
+
+ROWS=${1:-10000}
+[ $# -gt 0 ] && shift
+BATCHES=${*:-1 8 64 512}
+DB=${TMPDIR:-/tmp}/bench_group_commit.db
+
+for batch in $BATCHES; do
+	rm -f "$DB" "$DB-wal"
+	start=$(date +%s.%N)
+	if ! seq 1 "$ROWS" | awk '{ printf "insert %d user%d user%d@example.com\n", $1, $1, $1 }
+			END { print ".exit" }' | ./db --group-commit "$batch" "$DB" > /dev/null; then
+		echo "db failed inserting $ROWS rows" >&2
+		exit 1
+	fi
+	end=$(date +%s.%N)
+	echo "$start $end" | awk -v rows="$ROWS" -v batch="$batch" \
+		'{ printf "group commit %4d: %10.0f inserts/sec\n", batch, rows / ($2 - $1) }'
+done
+
+rm -f "$DB" "$DB-wal"
@@ -0,0 +1,144 @@
+/*
+ * Checkpoint time and cold full-table scans for each I/O backend, with
+ * and without O_DIRECT.
+ *
+ * usage: cc -O2 -std=c99 -pthread bench/io.c -o io
+ *        ./io [rows] [scans]
+ * The table is bulk loaded once. For the checkpoint every page is made
+ * dirty in a pool that holds them all, then pager_checkpoint() is timed:
+ * with --no-wal that writes the pages to the db file, with the log it
+ * commits them to the log and copies them over. For the scans the file is
+ * dropped from the page cache (POSIX_FADV_DONTNEED) and reopened with
+ * the default pool, so every leaf is read from disk; the last scan is
+ * through --mmap. "sync" sends the same requests one at a time from the
+ * calling thread.
+ */
+#define main db_main
+#include "../main.c"
+#undef main
+
+#include <time.h>
+
+#define SCAN_FRAMES PAGER_DEFAULT_FRAMES
+
+double now(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void drop_cache(const char *filename){
+	int fd = open(filename, O_RDONLY);
+
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+double time_checkpoint(const char *filename, DbOptions *options){
+	Table *table = db_open(filename, options);
+	Pager *pager = table->pager;
+
+	for(uint32_t page_num = 0; page_num < pager->num_pages; page_num++){
+		get_page(pager, page_num);
+		mark_page_dirty(pager, page_num);
+		unpin_page(pager, page_num);
+	}
+	double start = now();
+	pager_checkpoint(pager);
+	double elapsed = now() - start;
+
+	db_close(table);
+	return elapsed;
+}
+
+double time_cold_scan(const char *filename, DbOptions *options, uint32_t rows){
+	drop_cache(filename);
+
+	Table *table = db_open(filename, options);
+	double start = now();
+	Scan *scan = scan_open(table, 0, UINT32_MAX);
+	uint64_t count = 0;
+
+	while(scan_next(scan)){
+		count += scan->num_keys;
+	}
+	scan_close(scan);
+	double elapsed = now() - start;
+
+	if(count != rows){
+		printf("scan found %lu rows, expected %d\n", (unsigned long)count, rows);
+	}
+	db_close(table);
+	return elapsed;
+}
+
+int main(int argc, char *argv[]){
+	uint32_t rows = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	uint32_t scans = argc > 2 ? strtoul(argv[2], NULL, 10) : 3;
+	const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	char filename[PATH_MAX];
+	IoBackend backends[] = { IO_SYNC, IO_THREADS, IO_URING };
+	DbOptions options = {
+		.pool_frames = PAGER_DEFAULT_FRAMES,
+		.use_mmap = false,
+		.use_wal = false,
+		.group_commit = WAL_DEFAULT_GROUP_COMMIT
+	};
+
+	snprintf(filename, sizeof(filename), "%s/bench_io.db", dir);
+	unlink(filename);
+
+	Table *table = db_open(filename, &options);
+	BulkLoader *loader = bulk_load_begin(table, 100);
+	Row row = {0};
+	uint32_t duplicates;
+	for(uint32_t i = 1; i <= rows; i++){
+		row.id = i;
+		snprintf(row.username, sizeof(row.username), "user%d", i);
+		snprintf(row.email, sizeof(row.email), "user%d@example.com", i);
+		bulk_load_add(loader, &row);
+	}
+	bulk_load_finish(loader, &duplicates);
+	uint32_t pages = table->pager->num_pages;
+	db_close(table);
+	printf("%d rows in %d pages\n", rows, pages);
+
+	for(uint32_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++){
+		for(int direct = 0; direct <= 1; direct++){
+			options.io_backend = backends[i];
+			options.use_direct = direct;
+
+			options.pool_frames = pages + 16;
+			options.use_wal = false;
+			double flush = time_checkpoint(filename, &options);
+			options.use_wal = true;
+			double checkpoint = time_checkpoint(filename, &options);
+
+			options.pool_frames = SCAN_FRAMES;
+			options.use_wal = false;
+			double scan = 0;
+			for(uint32_t j = 0; j < scans; j++){
+				scan += time_cold_scan(filename, &options, rows);
+			}
+			scan /= scans;
+
+			printf("%-9s %-9s  flush %8.1f ms  log checkpoint %8.1f ms  cold scan %8.1f ms %8.0f pages/sec\n",
+					io_backend_name(backends[i]), direct ? "O_DIRECT" : "cached",
+					1000 * flush, 1000 * checkpoint, 1000 * scan, pages / scan);
+		}
+	}
+
+	options.use_mmap = true;
+	options.use_direct = false;
+	double scan = 0;
+	for(uint32_t j = 0; j < scans; j++){
+		scan += time_cold_scan(filename, &options, rows);
+	}
+	scan /= scans;
+	printf("mmap                cold scan %8.1f ms %8.0f pages/sec\n", 1000 * scan, pages / scan);
+
+	unlink(filename);
+	return 0;
+}
@@ -0,0 +1,442 @@
+/*
+ * Load generator for db --server, speaking the binary protocol with
+ * pipelined prepared statements.
+ *
+ * usage: make bench
+ *        ./db --no-wal --server unix:/tmp/db.sock /tmp/server.db &
+ *        bench/loadgen [options]
+ * options: --address A (unix:/tmp/db.sock)  --connections N (4)
+ *          --pipeline N (16)  --seconds N (5)  --records N (100000)
+ *          --read-percent N (90)  --no-load  --seed N
+ * Each connection is a thread that prepares "insert ? ? ?" and "select
+ * where id = ?" once. Unless --no-load, ids 1 to records are inserted
+ * first, spread over the connections. Then for --seconds every connection
+ * keeps --pipeline requests in flight: point selects of loaded ids, and
+ * inserts of ids past any in the table for the rest. Latency is from sending a request to
+ * reading its response. Errors are responses other than RESPONSE_OK and
+ * selects that did not return the row asked for.
+ */
+#include "../db.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <time.h>
+
+typedef struct {
+	const char *address;
+	uint32_t connections;
+	uint32_t pipeline;
+	uint32_t seconds;
+	uint32_t records;
+	uint32_t read_percent;
+	bool load;
+	uint64_t seed;
+} Config;
+
+typedef struct {
+	uint8_t *data;
+	size_t length;
+	size_t size;
+} Buffer;
+
+typedef struct {
+	uint64_t sent;	/* ns */
+	uint32_t key;	/* 0 for an insert */
+} Pending;
+
+typedef struct {
+	Config *config;
+	uint32_t number;
+	pthread_t thread;
+	int fd;
+	uint32_t insert_handle;
+	uint32_t select_handle;
+	uint64_t seed;
+	uint64_t next_insert;	/* this connection's ids are number + 1 apart by connections */
+	Buffer in;
+	Buffer out;
+	Pending *pending;	/* ring of config->pipeline */
+	uint32_t pending_head;
+	uint32_t num_pending;
+	bool timed;	/* record latencies */
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t *latencies;
+	uint64_t num_latencies;
+	uint64_t latencies_size;
+} Worker;
+
+uint64_t next_random(uint64_t *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+uint64_t now_ns(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void buffer_append(Buffer *buffer, const void *data, size_t length){
+	if(buffer->length + length > buffer->size){
+		buffer->size = 2 * (buffer->length + length);
+		buffer->data = (uint8_t *)realloc(buffer->data, buffer->size);
+	}
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+}
+
+void append_request(Buffer *buffer, uint8_t type, const void *body, uint32_t length){
+	uint32_t message_length = length + 1;
+
+	buffer_append(buffer, &message_length, SERVER_LENGTH_SIZE);
+	buffer_append(buffer, &type, 1);
+	buffer_append(buffer, body, length);
+}
+
+void append_text(Buffer *buffer, const char *text){
+	uint16_t length = strlen(text);
+
+	buffer_append(buffer, &length, sizeof(length));
+	buffer_append(buffer, text, length);
+}
+
+void send_all(Worker *worker){
+	size_t sent = 0;
+
+	while(sent < worker->out.length){
+		ssize_t n = send(worker->fd, worker->out.data + sent, worker->out.length - sent, MSG_NOSIGNAL);
+		if(n == -1 && errno != EINTR){
+			printf("Error sending: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		if(n > 0){
+			sent += n;
+		}
+	}
+	worker->out.length = 0;
+}
+
+bool next_response(Worker *worker, size_t *offset, uint8_t *type, uint8_t **body, uint32_t *length){
+/*
+ * The next whole response in worker->in from offset, if there is one.
+ */
+	uint32_t message_length;
+
+	if(worker->in.length - *offset < SERVER_LENGTH_SIZE){
+		return false;
+	}
+	memcpy(&message_length, worker->in.data + *offset, SERVER_LENGTH_SIZE);
+	if(worker->in.length - *offset - SERVER_LENGTH_SIZE < message_length){
+		return false;
+	}
+	*type = worker->in.data[*offset + SERVER_LENGTH_SIZE];
+	*body = worker->in.data + *offset + SERVER_HEADER_SIZE;
+	*length = message_length - 1;
+	*offset += SERVER_LENGTH_SIZE + message_length;
+	return true;
+}
+
+void receive(Worker *worker){
+	if(worker->in.size - worker->in.length < SERVER_READ_SIZE){
+		worker->in.size = worker->in.length + SERVER_READ_SIZE;
+		worker->in.data = (uint8_t *)realloc(worker->in.data, worker->in.size);
+	}
+	ssize_t n = read(worker->fd, worker->in.data + worker->in.length,
+			worker->in.size - worker->in.length);
+	if(n <= 0){
+		printf("Server closed the connection.\n");
+		exit(EXIT_FAILURE);
+	}
+	worker->in.length += n;
+}
+
+uint8_t request(Worker *worker, uint8_t request_type, const char *text, uint8_t **body,
+		uint32_t *length){
+/*
+ * Send one request and wait for its response. The body points into
+ * worker->in, which the caller empties once it is done with it.
+ */
+	size_t offset = 0;
+	uint8_t type;
+
+	append_request(&worker->out, request_type, text, strlen(text));
+	send_all(worker);
+	while(!next_response(worker, &offset, &type, body, length)){
+		receive(worker);
+	}
+	return type;
+}
+
+uint32_t prepare(Worker *worker, const char *text){
+	uint8_t type, *body;
+	uint32_t length, handle;
+
+	type = request(worker, REQUEST_PREPARE, text, &body, &length);
+	if(type != RESPONSE_OK || length < sizeof(handle)){
+		printf("Unable to prepare '%s': response %d\n", text, type);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(&handle, body, sizeof(handle));
+	worker->in.length = 0;
+	return handle;
+}
+
+uint32_t max_id(Worker *worker){
+	uint8_t type, *body;
+	uint32_t length, id = 0;
+
+	type = request(worker, REQUEST_QUERY, "select max(id)", &body, &length);
+	if(type == RESPONSE_OK && length == sizeof(id)){
+		memcpy(&id, body, sizeof(id));
+	}
+	worker->in.length = 0;
+	return id;
+}
+
+void append_insert(Worker *worker, uint32_t id){
+	char username[COLUMN_USERNAME_SIZE + 1], email[COLUMN_EMAIL_SIZE + 1];
+	Buffer body = {0};
+
+	snprintf(username, sizeof(username), "user%d", id);
+	snprintf(email, sizeof(email), "user%d@example.com", id);
+	buffer_append(&body, &worker->insert_handle, sizeof(uint32_t));
+	buffer_append(&body, &id, sizeof(id));
+	append_text(&body, username);
+	append_text(&body, email);
+	append_request(&worker->out, REQUEST_EXECUTE, body.data, body.length);
+	free(body.data);
+}
+
+void append_select(Worker *worker, uint32_t id){
+	uint32_t body[2] = { worker->select_handle, id };
+
+	append_request(&worker->out, REQUEST_EXECUTE, body, sizeof(body));
+}
+
+void check_response(Worker *worker, Pending *pending, uint8_t type, uint8_t *body,
+		uint32_t length){
+	uint32_t id;
+
+	if(type != RESPONSE_OK){
+		worker->errors++;
+	} else if(pending->key != 0){
+		/* One row, stored as id, the two lengths and the strings */
+		if(length < USERNAME_OFFSET ||
+				length != USERNAME_OFFSET + body[USERNAME_LENGTH_OFFSET] + body[EMAIL_LENGTH_OFFSET]){
+			worker->errors++;
+			return;
+		}
+		memcpy(&id, body, sizeof(id));
+		if(id != pending->key){
+			worker->errors++;
+		}
+	}
+}
+
+void run(Worker *worker, uint64_t deadline, uint32_t insert_until){
+/*
+ * Keep up to pipeline requests in flight, until the deadline when there
+ * is one, or else until every id up to insert_until is inserted.
+ */
+	Config *config = worker->config;
+
+	while(true){
+		bool more = deadline ? now_ns() < deadline : worker->next_insert <= insert_until;
+		uint64_t sent = now_ns();
+
+		while(more && worker->num_pending < config->pipeline){
+			Pending *pending = &worker->pending[(worker->pending_head + worker->num_pending) %
+				config->pipeline];
+			pending->sent = sent;
+			pending->key = 0;
+
+			if(deadline && next_random(&worker->seed) % 100 < config->read_percent){
+				pending->key = next_random(&worker->seed) % config->records + 1;
+				append_select(worker, pending->key);
+			} else{
+				append_insert(worker, worker->next_insert);
+				worker->next_insert += config->connections;
+				more = deadline || worker->next_insert <= insert_until;
+			}
+			worker->num_pending++;
+		}
+		if(worker->out.length > 0){
+			send_all(worker);
+		}
+		if(worker->num_pending == 0){
+			break;
+		}
+
+		receive(worker);
+		uint64_t received = now_ns();
+		size_t offset = 0;
+		uint8_t type, *body;
+		uint32_t length;
+		while(next_response(worker, &offset, &type, &body, &length)){
+			Pending *pending = &worker->pending[worker->pending_head];
+
+			check_response(worker, pending, type, body, length);
+			if(worker->timed){
+				if(worker->num_latencies == worker->latencies_size){
+					worker->latencies_size = worker->latencies_size ? 2 * worker->latencies_size : 65536;
+					worker->latencies = (uint64_t *)realloc(worker->latencies,
+							worker->latencies_size * sizeof(uint64_t));
+				}
+				worker->latencies[worker->num_latencies++] = received - pending->sent;
+			}
+			worker->pending_head = (worker->pending_head + 1) % config->pipeline;
+			worker->num_pending--;
+			worker->requests++;
+		}
+		memmove(worker->in.data, worker->in.data + offset, worker->in.length - offset);
+		worker->in.length -= offset;
+	}
+}
+
+void *load_thread(void *arg){
+	Worker *worker = (Worker *)arg;
+
+	run(worker, 0, worker->config->records);
+	return NULL;
+}
+
+void *timed_thread(void *arg){
+	Worker *worker = (Worker *)arg;
+
+	worker->timed = true;
+	run(worker, now_ns() + (uint64_t)worker->config->seconds * 1000000000, 0);
+	return NULL;
+}
+
+double run_phase(Worker *workers, Config *config, void *(*thread)(void *)){
+	uint64_t start = now_ns();
+
+	for(uint32_t i = 0; i < config->connections; i++){
+		workers[i].requests = 0;
+		pthread_create(&workers[i].thread, NULL, thread, &workers[i]);
+	}
+	for(uint32_t i = 0; i < config->connections; i++){
+		pthread_join(workers[i].thread, NULL);
+	}
+	return (now_ns() - start) / 1e9;
+}
+
+int compare_latency(const void *a, const void *b){
+	uint64_t latency_a = *(const uint64_t *)a;
+	uint64_t latency_b = *(const uint64_t *)b;
+
+	return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+int main(int argc, char *argv[]){
+	Config config = {
+		.address = "unix:/tmp/db.sock",
+		.connections = 4,
+		.pipeline = 16,
+		.seconds = 5,
+		.records = 100000,
+		.read_percent = 90,
+		.load = true,
+		.seed = 1
+	};
+
+	for(int i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "--address") && i + 1 < argc){
+			config.address = argv[++i];
+		} else if(!strcmp(argv[i], "--connections") && i + 1 < argc){
+			config.connections = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--pipeline") && i + 1 < argc){
+			config.pipeline = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--seconds") && i + 1 < argc){
+			config.seconds = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--records") && i + 1 < argc){
+			config.records = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--read-percent") && i + 1 < argc){
+			config.read_percent = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--no-load")){
+			config.load = false;
+		} else if(!strcmp(argv[i], "--seed") && i + 1 < argc){
+			config.seed = strtoull(argv[++i], NULL, 10);
+		} else{
+			printf("Unknown option '%s'.\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(config.connections == 0 || config.pipeline == 0 || config.records == 0){
+		printf("--connections, --pipeline and --records must be at least 1.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	Worker *workers = (Worker *)calloc(config.connections, sizeof(Worker));
+	for(uint32_t i = 0; i < config.connections; i++){
+		Worker *worker = &workers[i];
+		worker->config = &config;
+		worker->number = i;
+		worker->seed = config.seed * 0x9e3779b97f4a7c15ULL + i + 1;
+		worker->next_insert = i + 1;
+		worker->pending = (Pending *)malloc(config.pipeline * sizeof(Pending));
+		worker->fd = server_connect(config.address);
+		if(worker->fd == -1){
+			printf("Unable to connect to '%s': %d\n", config.address, errno);
+			exit(EXIT_FAILURE);
+		}
+		worker->insert_handle = prepare(worker, "insert ? ? ?");
+		worker->select_handle = prepare(worker, "select where id = ?");
+	}
+
+	if(config.load){
+		double seconds = run_phase(workers, &config, load_thread);
+		printf("load   %d rows  %10.0f inserts/sec\n", config.records, config.records / seconds);
+	}
+	/* New ids start past the loaded ones, and any an earlier run added */
+	uint32_t first_insert = max_id(&workers[0]);
+	if(first_insert < config.records){
+		first_insert = config.records;
+	}
+	for(uint32_t i = 0; i < config.connections; i++){
+		workers[i].next_insert = first_insert + 1 + i;
+	}
+
+	double seconds = run_phase(workers, &config, timed_thread);
+	uint64_t requests = 0, errors = 0, num_latencies = 0;
+	for(uint32_t i = 0; i < config.connections; i++){
+		requests += workers[i].requests;
+		errors += workers[i].errors;
+		num_latencies += workers[i].num_latencies;
+	}
+	uint64_t *latencies = (uint64_t *)malloc((num_latencies + 1) * sizeof(uint64_t));
+	uint64_t copied = 0;
+	for(uint32_t i = 0; i < config.connections; i++){
+		memcpy(latencies + copied, workers[i].latencies, workers[i].num_latencies * sizeof(uint64_t));
+		copied += workers[i].num_latencies;
+	}
+	qsort(latencies, num_latencies, sizeof(uint64_t), compare_latency);
+
+	double p50 = 0, p99 = 0, p999 = 0;
+	if(num_latencies > 0){
+		p50 = latencies[(uint64_t)(0.50 * (num_latencies - 1))] / 1e3;
+		p99 = latencies[(uint64_t)(0.99 * (num_latencies - 1))] / 1e3;
+		p999 = latencies[(uint64_t)(0.999 * (num_latencies - 1))] / 1e3;
+	}
+	printf("mixed  %d connections x %d in flight, %d%% reads  %10.0f requests/sec  "
+			"p50 %.1f us  p99 %.1f us  p99.9 %.1f us  %lu errors\n",
+			config.connections, config.pipeline, config.read_percent, requests / seconds,
+			p50, p99, p999, (unsigned long)errors);
+
+	for(uint32_t i = 0; i < config.connections; i++){
+		close(workers[i].fd);
+		free(workers[i].pending);
+		free(workers[i].in.data);
+		free(workers[i].out.data);
+		free(workers[i].latencies);
+	}
+	free(latencies);
+	free(workers);
+	return errors > 0;
+}
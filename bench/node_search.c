@@ -0,0 +1,132 @@
+/*
+ * Point lookups per second through table_find on bulk loaded trees, and
+ * the search inside one full node against a classic branchy binary search.
+ *
+ * usage: cc -O2 -std=c99 -pthread bench/node_search.c -o node_search
+ *        ./node_search [keys...]
+ * Add -mavx2 for the AVX2 compares. The default sizes are 10^5 to 10^7
+ * keys; 10^8 needs about 2 GB of disk under $TMPDIR. The tree is read
+ * through --mmap so the numbers are search cost rather than pool misses.
+ */
+#define main db_main
+#include "../main.c"
+#undef main
+#include <time.h>
+
+#define LOOKUPS 2000000
+#define NODE_SEARCHES 20000000
+
+volatile uint32_t sink;	/* keeps the searches from being optimized out */
+
+double now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint32_t next_random(uint64_t *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return (uint32_t)*state;
+}
+
+uint32_t binary_search(const uint32_t *keys, uint32_t num_keys, uint32_t key){
+	uint32_t min_index = 0;
+	uint32_t max_index = num_keys;
+	while(min_index != max_index){
+		uint32_t index = (min_index + max_index) / 2;
+		if(keys[index] >= key){
+			max_index = index;
+		} else{
+			min_index = index + 1;
+		}
+	}
+	return min_index;
+}
+
+void bench_tree(uint32_t num_keys){
+	char filename[PATH_MAX];
+	char wal_filename[PATH_MAX];
+	const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	DbOptions options = {
+		.pool_frames = PAGER_DEFAULT_FRAMES,
+		.use_mmap = true,
+		.use_wal = false,
+		.group_commit = WAL_DEFAULT_GROUP_COMMIT
+	};
+
+	snprintf(filename, sizeof(filename), "%s/bench_node_search.db", dir);
+	snprintf(wal_filename, sizeof(wal_filename), "%s-wal", filename);
+	unlink(filename);
+	unlink(wal_filename);
+
+	Table *table = db_open(filename, &options);
+	BulkLoader *loader = bulk_load_begin(table, 100);
+	Row row = {0};
+	uint32_t duplicates;
+	for(uint32_t i = 1; i <= num_keys; i++){
+		row.id = i;
+		bulk_load_add(loader, &row);
+	}
+	bulk_load_finish(loader, &duplicates);
+
+	uint64_t state = 88172645463325252ULL;
+	uint64_t found = 0;
+	double start = now();
+	for(uint32_t i = 0; i < LOOKUPS; i++){
+		uint32_t key = next_random(&state) % num_keys + 1;
+		Cursor *cursor = table_find(table, key);
+		void *node = get_page(table->pager, cursor->page_num);
+		found += cursor->cell_num < *leaf_node_num_cells(node) &&
+			leaf_node_key_at(node, cursor->cell_num) == key;
+		unpin_page(table->pager, cursor->page_num);
+		cursor_close(cursor);
+		arena_reset(arena_thread());
+	}
+	double elapsed = now() - start;
+
+	printf("tree %10u keys  %12.0f lookups/sec  (%lu found)\n", num_keys,
+			LOOKUPS / elapsed, (unsigned long)found);
+	db_close(table);
+	unlink(filename);
+	unlink(wal_filename);
+}
+
+void bench_node(){
+	uint32_t keys[INTERNAL_NODE_MAX_CELLS];
+	uint64_t state = 88172645463325252ULL;
+
+	for(uint32_t i = 0; i < INTERNAL_NODE_MAX_CELLS; i++){
+		keys[i] = (i + 1) * 1000;
+	}
+
+	double start = now();
+	for(uint32_t i = 0; i < NODE_SEARCHES; i++){
+		sink = binary_search(keys, INTERNAL_NODE_MAX_CELLS, next_random(&state) % 520000);
+	}
+	double branchy = now() - start;
+
+	start = now();
+	for(uint32_t i = 0; i < NODE_SEARCHES; i++){
+		sink = node_keys_lower_bound(keys, INTERNAL_NODE_MAX_CELLS, next_random(&state) % 520000);
+	}
+	double branchless = now() - start;
+
+	printf("node %10d keys  binary search %6.2f ns  node_keys_lower_bound %6.2f ns\n",
+			INTERNAL_NODE_MAX_CELLS, 1e9 * branchy / NODE_SEARCHES,
+			1e9 * branchless / NODE_SEARCHES);
+}
+
+int main(int argc, char *argv[]){
+	bench_node();
+	if(argc == 1){
+		bench_tree(100000);
+		bench_tree(1000000);
+		bench_tree(10000000);
+	}
+	for(int i = 1; i < argc; i++){
+		bench_tree(strtoul(argv[i], NULL, 10));
+	}
+	return 0;
+}
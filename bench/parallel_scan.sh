@@ -0,0 +1,43 @@
+#!/bin/sh
+# Full-table count(*), min and max with 1 to N scan threads.
+#
+# usage: bench/parallel_scan.sh [rows] [max threads] [scans]
+# Run from the repository root after `make`. The default is 10^6 rows;
+# 10^7 needs about 400 MB of disk under $TMPDIR. The table is bulk loaded
+# once and each query runs [scans] times in a single process, so the
+# numbers are scan cost rather than startup.
+
+ROWS=${1:-1000000}
+MAX_THREADS=${2:-$(nproc)}
+SCANS=${3:-5}
+DB=${TMPDIR:-/tmp}/bench_parallel_scan.db
+INPUT=${TMPDIR:-/tmp}/bench_parallel_scan.txt
+
+rm -f "$DB" "$DB-wal"
+seq 1 "$ROWS" | awk '{ printf "%d user%d user%d@example.com\n", $1, $1 * 7919 % 1000003, $1 }' > "$INPUT"
+printf '.load %s\n.exit\n' "$INPUT" | ./db "$DB" > /dev/null
+
+run() {
+	start=$(date +%s.%N)
+	i=0
+	while [ $i -lt "$SCANS" ]; do
+		echo "$2"
+		i=$((i + 1))
+	done | { cat; echo .exit; } | ./db --threads "$1" "$DB" > /dev/null
+	end=$(date +%s.%N)
+	echo "$start $end" | awk -v rows="$ROWS" -v scans="$SCANS" -v query="$2" -v threads="$1" \
+		'{ printf "%2d threads  %-26s %8.2f ms/scan %12.0f rows/sec\n", threads, query,
+			1000 * ($2 - $1) / scans, rows * scans / ($2 - $1) }'
+}
+
+threads=1
+while :; do
+	run $threads "select count(*)"
+	run $threads "select max(id)"
+	run $threads "select min(username)"
+	[ $threads -ge "$MAX_THREADS" ] && break
+	threads=$((threads * 2))
+	[ $threads -gt "$MAX_THREADS" ] && threads=$MAX_THREADS
+done
+
+rm -f "$DB" "$DB-wal" "$INPUT"
@@ -0,0 +1,39 @@
+#!/bin/sh
+# Key-only scans (select id, select count(*)) against the row-at-a-time
+# cursor loop of a plain select.
+#
+# usage: bench/projection.sh [rows] [scans]
+# Run from the repository root after `make` (or `make CFLAGS=-mavx2`).
+# The table is bulk loaded once. Each query then runs [scans] times in a
+# single process, so the numbers are scan cost rather than startup.
+
+ROWS=${1:-1000000}
+SCANS=${2:-5}
+DB=${TMPDIR:-/tmp}/bench_projection.db
+INPUT=${TMPDIR:-/tmp}/bench_projection.txt
+
+rm -f "$DB" "$DB-wal"
+seq 1 "$ROWS" | awk '{ printf "%d user%d user%d@example.com\n", $1, $1, $1 }' > "$INPUT"
+printf '.load %s\n.exit\n' "$INPUT" | ./db "$DB" > /dev/null
+
+run() {
+	start=$(date +%s.%N)
+	i=0
+	while [ $i -lt "$SCANS" ]; do
+		echo "$1"
+		i=$((i + 1))
+	done | { cat; echo .exit; } | ./db "$DB" > /dev/null
+	end=$(date +%s.%N)
+	echo "$start $end" | awk -v rows="$ROWS" -v scans="$SCANS" -v query="$1" \
+		'{ printf "%-40s %8.2f ms/scan %12.0f rows/sec\n", query,
+			1000 * ($2 - $1) / scans, rows * scans / ($2 - $1) }'
+}
+
+half=$((ROWS / 2))
+for where in "" "where id > $half"; do
+	run "select $where"
+	run "select id $where"
+	run "select count(*) $where"
+done
+
+rm -f "$DB" "$DB-wal" "$INPUT"
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Full table scan time with the read()-based buffer pool versus --mmap.
+#
+# usage: bench/scan.sh [rows] [scans]
+# Run from the repository root after `make`. Each scan starts a fresh
+# process, so the pool is cold while the OS page cache stays warm.
+
+ROWS=${1:-10000}
+SCANS=${2:-10}
+DB=${TMPDIR:-/tmp}/bench_scan.db
+
+rm -f "$DB" "$DB-wal"
+if ! seq 1 "$ROWS" | awk '{ printf "insert %d user%d user%d@example.com\n", $1, $1, $1 }
+		END { print ".exit" }' | ./db --group-commit 1000 "$DB" > /dev/null; then
+	echo "db failed inserting $ROWS rows" >&2
+	exit 1
+fi
+
+for mode in "" "--mmap"; do
+	start=$(date +%s.%N)
+	i=0
+	while [ $i -lt "$SCANS" ]; do
+		if ! printf 'select\n.exit\n' | ./db $mode "$DB" > /dev/null; then
+			echo "db failed scanning $DB" >&2
+			exit 1
+		fi
+		i=$((i + 1))
+	done
+	end=$(date +%s.%N)
+	echo "$start $end" | awk -v rows="$ROWS" -v scans="$SCANS" -v mode="${mode:-read}" \
+		'{ printf "%-8s %8.2f ms/scan %12.0f rows/sec\n", mode,
+			1000 * ($2 - $1) / scans, rows * scans / ($2 - $1) }'
+done
+
+rm -f "$DB" "$DB-wal"
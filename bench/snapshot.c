@@ -0,0 +1,174 @@
+/*
+ * Inserts per second from one writer thread while 0 to N threads scan the
+ * whole table over and over, each scan through its own snapshot.
+ *
+ * usage: cc -O2 -std=c99 -pthread bench/snapshot.c -o snapshot
+ *        ./snapshot [rows] [max scanners] [seconds per run]
+ * The table is bulk loaded with every KEY_SPACING-th key and the writer
+ * fills in random keys between them, as in bench/concurrency.c. Every
+ * scan checks what it saw: keys in order, rows intact, and no fewer rows
+ * than were committed before it opened nor more than were tried by the
+ * time it closed. Failed checks are reported as errors.
+ */
+#define main db_main
+#include "../main.c"
+#undef main
+
+#define KEY_SPACING 16
+
+typedef struct {
+	Table *table;
+	uint32_t rows;
+	uint64_t seed;
+	uint64_t operations;
+	uint64_t rows_read;
+	uint64_t errors;
+} Worker;
+
+bool stop;
+uint64_t tried;	/* inserts started */
+uint64_t committed;	/* inserts that returned EXECUTE_SUCCESS */
+
+uint32_t next_random(uint64_t *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return (uint32_t)*state;
+}
+
+bool row_is_intact(Row *row){
+	char expected[COLUMN_USERNAME_SIZE + 1];
+
+	snprintf(expected, sizeof(expected), row->id % KEY_SPACING == 0 ? "user%d" : "writer%d",
+			row->id);
+	return !strcmp(row->username, expected);
+}
+
+void *scanner_thread(void *arg){
+	Worker *worker = arg;
+	Row row;
+
+	while(!__atomic_load_n(&stop, __ATOMIC_RELAXED)){
+		uint64_t before = __atomic_load_n(&committed, __ATOMIC_ACQUIRE);
+		Scan *scan = scan_open(worker->table, 0, UINT32_MAX);
+		uint64_t count = 0;
+		uint32_t last_key = 0;
+
+		while(scan_next(scan)){
+			for(uint32_t i = 0; i < scan->num_keys; i++){
+				deserialize_row(scan_value(scan, i), &row);
+				if(row.id != scan->keys[i] || (count > 0 && row.id <= last_key) ||
+						!row_is_intact(&row)){
+					worker->errors++;
+				}
+				last_key = row.id;
+				count++;
+			}
+		}
+		scan_close(scan);
+
+		uint64_t after = __atomic_load_n(&tried, __ATOMIC_ACQUIRE);
+		if(count < worker->rows + before || count > worker->rows + after){
+			worker->errors++;
+		}
+		worker->rows_read += count;
+		worker->operations++;
+	}
+	return NULL;
+}
+
+void *writer_thread(void *arg){
+	Worker *worker = arg;
+	Row row = {0};
+
+	while(!__atomic_load_n(&stop, __ATOMIC_RELAXED)){
+		row.id = next_random(&worker->seed) % (KEY_SPACING * worker->rows);
+		if(row.id % KEY_SPACING == 0){
+			continue;
+		}
+		snprintf(row.username, sizeof(row.username), "writer%d", row.id);
+		__atomic_add_fetch(&tried, 1, __ATOMIC_RELEASE);
+		if(table_insert(worker->table, &row) == EXECUTE_SUCCESS){
+			__atomic_add_fetch(&committed, 1, __ATOMIC_RELEASE);
+			worker->operations++;
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]){
+	uint32_t rows = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+	uint32_t max_scanners = argc > 2 ? strtoul(argv[2], NULL, 10) : 4;
+	uint32_t seconds = argc > 3 ? strtoul(argv[3], NULL, 10) : 2;
+	const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	char filename[PATH_MAX];
+	DbOptions options = {
+		.pool_frames = rows / 20 + 1024,
+		.use_mmap = false,
+		.use_wal = false,
+		.group_commit = WAL_DEFAULT_GROUP_COMMIT
+	};
+
+	snprintf(filename, sizeof(filename), "%s/bench_snapshot.db", dir);
+	unlink(filename);
+
+	Table *table = db_open(filename, &options);
+	BulkLoader *loader = bulk_load_begin(table, 70);
+	Row row = {0};
+	uint32_t duplicates;
+	for(uint32_t i = 1; i <= rows; i++){
+		row.id = KEY_SPACING * i;
+		snprintf(row.username, sizeof(row.username), "user%d", row.id);
+		bulk_load_add(loader, &row);
+	}
+	bulk_load_finish(loader, &duplicates);
+
+	uint64_t table_rows = rows;
+	for(uint32_t scanners = 0; ; scanners = scanners ? scanners * 2 : 1){
+		if(scanners > max_scanners){
+			scanners = max_scanners;
+		}
+		pthread_t threads[scanners + 1];
+		Worker workers[scanners + 1];
+
+		/* Scanners check counts against what the writer adds from here */
+		__atomic_store_n(&stop, false, __ATOMIC_RELAXED);
+		__atomic_store_n(&tried, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&committed, 0, __ATOMIC_RELAXED);
+		for(uint32_t i = 0; i <= scanners; i++){
+			workers[i] = (Worker){ .table = table, .rows = i == 0 ? rows : table_rows,
+				.seed = 0x9e3779b97f4a7c15ULL * (scanners * 64 + i + 1) };
+		}
+		for(uint32_t i = 0; i <= scanners; i++){
+			pthread_create(&threads[i], NULL, i == 0 ? writer_thread : scanner_thread, &workers[i]);
+		}
+		sleep(seconds);
+		__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+
+		uint64_t scans = 0, rows_read = 0, errors = 0;
+		for(uint32_t i = 0; i <= scanners; i++){
+			pthread_join(threads[i], NULL);
+			scans += workers[i].operations * (i > 0);
+			rows_read += workers[i].rows_read;
+			errors += workers[i].errors;
+		}
+		table_rows += committed;
+		printf("%3d scanners  %10.0f inserts/sec  %8.1f scans/sec  %12.0f rows/sec  %lu errors\n",
+				scanners, (double)workers[0].operations / seconds, (double)scans / seconds,
+				(double)rows_read / seconds, (unsigned long)errors);
+		if(scanners >= max_scanners){
+			break;
+		}
+	}
+
+	/* Nothing is open any more, so the collector frees every kept page */
+	usleep(100000);
+	pthread_mutex_lock(&table->pager->mvcc->lock);
+	printf("versions kept after the last scan: %d (collected %lu)\n",
+			table->pager->mvcc->kept, (unsigned long)table->pager->mvcc->collected);
+	pthread_mutex_unlock(&table->pager->mvcc->lock);
+
+	db_close(table);
+	unlink(filename);
+	return 0;
+}
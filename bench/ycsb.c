@@ -0,0 +1,413 @@
+/*
+ * YCSB-style workloads against the engine, linked as a library so that
+ * nothing is parsed or printed per operation.
+ *
+ * usage: make bench
+ *        bench/ycsb [options] [workload...]
+ * Workloads run in the order given, all of them by default:
+ *   insert-seq      keys 1 to records in order, one execute_insert each
+ *   insert-random   the same keys shuffled
+ *   insert-zipfian  keys drawn from a scrambled zipfian over 10 x records;
+ *                   repeats come back as duplicates
+ *   read            point lookups with table_find
+ *   scan            ranges of --scan-length keys, every row deserialized
+ *   mixed           --read-percent lookups, the rest inserts of new keys
+ * Inserts start from an empty file. The others start from records rows,
+ * bulk loaded, and run operations operations, picking keys with
+ * --distribution (zipfian: YCSB's, theta 0.99, scrambled).
+ *
+ * options: --records N (100000)  --operations N (100000)
+ *          --distribution uniform|zipfian  --scan-length N (100)
+ *          --read-percent N (50)  --frames N  --mmap  --no-wal
+ *          --group-commit N  --format text|json  --seed N
+ * For each workload: throughput, latency percentiles, and page reads and
+ * writes per operation. Reads are counted by the buffer pool, so they are
+ * 0 under --mmap. --format json prints one object per line. Misses in any
+ * workload but insert-zipfian are a bug, and the run stops with a failure.
+ */
+#include "../db.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+
+#define ZIPFIAN_THETA 0.99
+
+typedef struct {
+	uint64_t items;
+	double zetan;
+	double alpha;
+	double eta;
+	double half_pow_theta;
+} Zipfian;
+
+typedef struct {
+	uint32_t records;
+	uint32_t operations;
+	bool zipfian;
+	uint32_t scan_length;
+	uint32_t read_percent;
+	bool json;
+	uint64_t seed;
+	DbOptions options;
+	char filename[PATH_MAX];
+} Config;
+
+typedef struct {
+	const char *workload;
+	uint64_t operations;
+	double seconds;
+	uint64_t *latencies;	/* ns, one per operation */
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t misses;	/* lookups that found nothing, duplicate inserts */
+	uint64_t rows;	/* returned by scans */
+} Result;
+
+uint64_t next_random(uint64_t *state){
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+double next_unit(uint64_t *state){
+	return (next_random(state) >> 11) * 0x1.0p-53;
+}
+
+uint64_t now_ns(){
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void zipfian_init(Zipfian *zipfian, uint64_t items){
+/*
+ * Gray et al., "Quickly generating billion-record synthetic databases",
+ * as YCSB does it. Item 0 is the most popular.
+ */
+	double zeta2 = 1 + pow(0.5, ZIPFIAN_THETA);
+
+	zipfian->items = items;
+	zipfian->zetan = 0;
+	for(uint64_t i = 1; i <= items; i++){
+		zipfian->zetan += 1 / pow((double)i, ZIPFIAN_THETA);
+	}
+	zipfian->alpha = 1 / (1 - ZIPFIAN_THETA);
+	zipfian->eta = (1 - pow(2.0 / items, 1 - ZIPFIAN_THETA)) / (1 - zeta2 / zipfian->zetan);
+	zipfian->half_pow_theta = pow(0.5, ZIPFIAN_THETA);
+}
+
+uint64_t zipfian_next(Zipfian *zipfian, uint64_t *state){
+	double u = next_unit(state);
+	double uz = u * zipfian->zetan;
+	uint64_t item;
+
+	if(uz < 1){
+		item = 0;
+	} else if(uz < 1 + zipfian->half_pow_theta){
+		item = 1;
+	} else{
+		item = zipfian->items * pow(zipfian->eta * u - zipfian->eta + 1, zipfian->alpha);
+	}
+	if(item >= zipfian->items){
+		item = zipfian->items - 1;
+	}
+
+	/* Scramble, so the popular keys are spread over the table */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for(uint32_t i = 0; i < 8; i++){
+		hash = (hash ^ ((item >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+	}
+	return hash % zipfian->items;
+}
+
+void make_row(Row *row, uint32_t key){
+	row->id = key;
+	snprintf(row->username, sizeof(row->username), "user%d", key);
+	snprintf(row->email, sizeof(row->email), "user%d@example.com", key);
+}
+
+Table *open_table(Config *config, bool load){
+	char wal_filename[PATH_MAX + 8];
+
+	snprintf(wal_filename, sizeof(wal_filename), "%s-wal", config->filename);
+	unlink(config->filename);
+	unlink(wal_filename);
+
+	Table *table = db_open(config->filename, &config->options);
+	if(load){
+		BulkLoader *loader = bulk_load_begin(table, 100);
+		Row row;
+		uint32_t duplicates;
+
+		for(uint32_t key = 1; key <= config->records; key++){
+			make_row(&row, key);
+			bulk_load_add(loader, &row);
+		}
+		bulk_load_finish(loader, &duplicates);
+	}
+	return table;
+}
+
+ExecuteResult insert_key(Table *table, uint32_t key){
+	Statement statement;
+
+	statement.type = STATEMENT_INSERT;
+	make_row(&statement.row_to_insert, key);
+	statement.rows = &statement.row_to_insert;
+	statement.num_rows = 1;
+	return execute_insert(table, &statement);
+}
+
+bool read_key(Table *table, uint32_t key){
+	Arena *arena = arena_thread();
+	ArenaMark mark = arena_mark(arena);
+	Cursor *cursor = table_find(table, key);
+	RowView view;
+
+	/* table_find leaves the cursor one past the leaf's last cell if key is above it */
+	void *page = get_page(table->pager, cursor->page_num);
+	bool found = cursor->cell_num < *leaf_node_num_cells(page);
+	unpin_page(table->pager, cursor->page_num);
+
+	if(found){
+		cursor_view(cursor, &view);
+		found = view.id == key;
+	}
+	cursor_close(cursor);
+	arena_release(arena, mark);
+	return found;
+}
+
+uint64_t scan_keys(Table *table, uint32_t key, uint32_t length){
+	Scan *scan = scan_open(table, key, key + length - 1);
+	uint64_t rows = 0;
+	Row row;
+
+	while(scan_next(scan)){
+		for(uint32_t i = 0; i < scan->num_keys; i++){
+			if(scan->selected[i / 8] & (1 << (i % 8))){
+				deserialize_row(scan_value(scan, i), &row);
+				rows++;
+			}
+		}
+	}
+	scan_close(scan);
+	return rows;
+}
+
+void run_workload(Config *config, const char *workload, Result *result){
+	bool inserts = !strncmp(workload, "insert-", 7);
+	uint32_t operations = inserts ? config->records : config->operations;
+	uint64_t state = config->seed;
+	uint32_t *keys = NULL;
+	Zipfian zipfian;
+
+	memset(result, 0, sizeof(*result));
+	result->workload = workload;
+	result->latencies = (uint64_t *)malloc((operations + 1) * sizeof(uint64_t));
+
+	/* Keys are drawn before the clock starts */
+	if(!strcmp(workload, "insert-seq") || !strcmp(workload, "insert-random")){
+		keys = (uint32_t *)malloc((operations + 1) * sizeof(uint32_t));
+		for(uint32_t i = 0; i < operations; i++){
+			keys[i] = i + 1;
+		}
+		for(uint32_t i = operations; workload[7] == 'r' && i > 1; i--){
+			uint32_t j = next_random(&state) % i;
+			uint32_t key = keys[i - 1];
+			keys[i - 1] = keys[j];
+			keys[j] = key;
+		}
+	} else if(!strcmp(workload, "insert-zipfian")){
+		keys = (uint32_t *)malloc((operations + 1) * sizeof(uint32_t));
+		zipfian_init(&zipfian, 10ULL * config->records);
+		for(uint32_t i = 0; i < operations; i++){
+			keys[i] = 1 + zipfian_next(&zipfian, &state);
+		}
+	} else{
+		zipfian_init(&zipfian, config->zipfian ? config->records : 1);
+	}
+
+	Table *table = open_table(config, !inserts);
+	Pager *pager = table->pager;
+	uint64_t reads = pager->reads, writes = pager->writebacks;
+	uint32_t next_key = config->records + 1;
+	uint64_t start = now_ns();
+
+	for(uint32_t i = 0; i < operations; i++){
+		uint32_t key = 0;
+		bool read = true;
+
+		if(!inserts){
+			key = 1 + (config->zipfian ? zipfian_next(&zipfian, &state) :
+					next_random(&state) % config->records);
+			if(!strcmp(workload, "mixed")){
+				read = next_random(&state) % 100 < config->read_percent;
+			}
+		}
+
+		uint64_t begin = now_ns();
+		if(inserts){
+			result->misses += insert_key(table, keys[i]) != EXECUTE_SUCCESS;
+		} else if(!strcmp(workload, "scan")){
+			result->rows += scan_keys(table, key, config->scan_length);
+		} else if(read){
+			result->misses += !read_key(table, key);
+		} else{
+			result->misses += insert_key(table, next_key++) != EXECUTE_SUCCESS;
+		}
+		result->latencies[i] = now_ns() - begin;
+	}
+
+	result->seconds = (now_ns() - start) / 1e9;
+	result->operations = operations;
+	result->reads = pager->reads - reads;
+	result->writes = pager->writebacks - writes;
+	db_close(table);
+	free(keys);
+}
+
+int compare_latency(const void *a, const void *b){
+	uint64_t latency_a = *(const uint64_t *)a;
+	uint64_t latency_b = *(const uint64_t *)b;
+
+	return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+double percentile_us(Result *result, double fraction){
+	uint64_t i = result->operations * fraction;
+
+	if(i >= result->operations){
+		i = result->operations - 1;
+	}
+	return result->latencies[i] / 1e3;
+}
+
+void print_result(Config *config, Result *result){
+	qsort(result->latencies, result->operations, sizeof(uint64_t), compare_latency);
+
+	double per_second = result->operations / result->seconds;
+	double p50 = percentile_us(result, 0.50);
+	double p99 = percentile_us(result, 0.99);
+	double p999 = percentile_us(result, 0.999);
+	double reads = (double)result->reads / result->operations;
+	double writes = (double)result->writes / result->operations;
+
+	if(config->json){
+		printf("{\"workload\": \"%s\", \"records\": %d, \"operations\": %lu, "
+				"\"distribution\": \"%s\", \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+				"\"p50_us\": %.2f, \"p99_us\": %.2f, \"p999_us\": %.2f, "
+				"\"reads_per_op\": %.4f, \"writes_per_op\": %.4f, \"misses\": %lu, "
+				"\"rows\": %lu}\n",
+				result->workload, config->records, (unsigned long)result->operations,
+				config->zipfian ? "zipfian" : "uniform", result->seconds, per_second,
+				p50, p99, p999, reads, writes, (unsigned long)result->misses,
+				(unsigned long)result->rows);
+	} else{
+		printf("%-15s %9lu %12.0f %10.2f %10.2f %10.2f %9.3f %9.3f %8lu\n",
+				result->workload, (unsigned long)result->operations, per_second,
+				p50, p99, p999, reads, writes, (unsigned long)result->misses);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]){
+	const char *all[] = { "insert-seq", "insert-random", "insert-zipfian", "read", "scan",
+		"mixed" };
+	const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+	const char **workloads = (const char **)malloc(argc * sizeof(char *));
+	uint32_t num_workloads = 0;
+	Config config = {
+		.records = 100000,
+		.operations = 100000,
+		.zipfian = false,
+		.scan_length = 100,
+		.read_percent = 50,
+		.json = false,
+		.seed = 0x9e3779b97f4a7c15ULL,
+		.options = {
+			.pool_frames = PAGER_DEFAULT_FRAMES,
+			.use_mmap = false,
+			.use_wal = true,
+			.group_commit = WAL_DEFAULT_GROUP_COMMIT,
+			.scan_threads = 1
+		}
+	};
+
+	for(int i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "--records") && i + 1 < argc){
+			config.records = strtoul(argv[++i], NULL, 10);
+		} else if(!strcmp(argv[i], "--operations") && i + 1 < argc){
+			config.operations = strtoul(argv[++i], NULL, 10);
+		} else if(!strcmp(argv[i], "--distribution") && i + 1 < argc){
+			config.zipfian = !strcmp(argv[++i], "zipfian");
+		} else if(!strcmp(argv[i], "--scan-length") && i + 1 < argc){
+			config.scan_length = strtoul(argv[++i], NULL, 10);
+		} else if(!strcmp(argv[i], "--read-percent") && i + 1 < argc){
+			config.read_percent = strtoul(argv[++i], NULL, 10);
+		} else if(!strcmp(argv[i], "--format") && i + 1 < argc){
+			config.json = !strcmp(argv[++i], "json");
+		} else if(!strcmp(argv[i], "--seed") && i + 1 < argc){
+			config.seed = strtoull(argv[++i], NULL, 10) | 1;
+		} else if(!strcmp(argv[i], "--frames") && i + 1 < argc){
+			config.options.pool_frames = strtoul(argv[++i], NULL, 10);
+		} else if(!strcmp(argv[i], "--group-commit") && i + 1 < argc){
+			config.options.group_commit = strtoul(argv[++i], NULL, 10);
+		} else if(!strcmp(argv[i], "--mmap")){
+			config.options.use_mmap = true;
+		} else if(!strcmp(argv[i], "--no-wal")){
+			config.options.use_wal = false;
+		} else if(argv[i][0] == '-'){
+			printf("Unknown option '%s'.\n", argv[i]);
+			exit(EXIT_FAILURE);
+		} else{
+			workloads[num_workloads++] = argv[i];
+		}
+	}
+	if(num_workloads == 0){
+		free(workloads);
+		workloads = all;
+		num_workloads = sizeof(all) / sizeof(all[0]);
+	}
+	if(config.records == 0 || config.operations == 0 || config.scan_length == 0){
+		printf("--records, --operations and --scan-length must be positive.\n");
+		exit(EXIT_FAILURE);
+	}
+	snprintf(config.filename, sizeof(config.filename), "%s/bench_ycsb.db", dir);
+
+	for(uint32_t i = 0; i < num_workloads; i++){
+		bool known = false;
+		for(uint32_t j = 0; j < sizeof(all) / sizeof(all[0]); j++){
+			known |= !strcmp(workloads[i], all[j]);
+		}
+		if(!known){
+			printf("Unknown workload '%s'.\n", workloads[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(!config.json){
+		printf("%-15s %9s %12s %10s %10s %10s %9s %9s %8s\n", "workload", "ops", "ops/sec",
+				"p50 us", "p99 us", "p999 us", "reads/op", "writes/op", "misses");
+	}
+	for(uint32_t i = 0; i < num_workloads; i++){
+		Result result;
+		run_workload(&config, workloads[i], &result);
+		print_result(&config, &result);
+		free(result.latencies);
+		if(result.misses > 0 && strcmp(workloads[i], "insert-zipfian")){
+			printf("%s: %lu operations missed.\n", workloads[i],
+					(unsigned long)result.misses);
+			unlink(config.filename);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	unlink(config.filename);
+	return 0;
+}
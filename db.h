@@ -0,0 +1,1017 @@
+/*
+ * The storage engine as a library: link main.c built with -DDB_LIBRARY,
+ * which leaves out the REPL's main(), and include this header.
+ */
+#ifndef DB_H
+#define DB_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* Only pointed to here, main.c includes their headers */
+struct iovec;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+typedef enum {
+	NODE_INTERNAL,
+	NODE_LEAF
+} NodeType;
+
+/*
+ * Common Node Header Layout
+ * Every field sits at an offset aligned to its size, and both node
+ * headers are padded to NODE_HEADER_ALIGNMENT, so the key arrays after
+ * them are aligned for the searches.
+ */
+#define NODE_HEADER_ALIGNMENT 16
+#define ALIGN_UP(size, alignment) (((size) + (alignment) - 1) / (alignment) * (alignment))
+#define NODE_TYPE_SIZE (sizeof(uint8_t))
+#define NODE_TYPE_OFFSET (0)
+#define IS_ROOT_SIZE (sizeof(uint8_t))
+#define IS_ROOT_OFFSET (NODE_TYPE_SIZE)
+#define PARENT_POINTER_SIZE (sizeof(uint32_t))
+#define PARENT_POINTER_OFFSET \
+	ALIGN_UP(IS_ROOT_OFFSET + IS_ROOT_SIZE, PARENT_POINTER_SIZE)
+#define COMMON_NODE_HEADER_SIZE (PARENT_POINTER_OFFSET + PARENT_POINTER_SIZE)
+
+/** Leaf Node Header Layout(How many cells) **/
+#define LEAF_NODE_NUM_CELLS_SIZE (sizeof(uint32_t))
+#define LEAF_NODE_NUM_CELLS_OFFSET (COMMON_NODE_HEADER_SIZE)
+#define LEAF_NODE_NEXT_LEAF_SIZE (sizeof(uint32_t))
+#define LEAF_NODE_NEXT_LEAF_OFFSET (LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE)
+#define LEAF_NODE_CELL_CONTENT_SIZE (sizeof(uint16_t))
+#define LEAF_NODE_CELL_CONTENT_OFFSET \
+	(LEAF_NODE_NEXT_LEAF_OFFSET + LEAF_NODE_NEXT_LEAF_SIZE)
+#define LEAF_NODE_FORMAT_SIZE (sizeof(uint8_t))
+#define LEAF_NODE_FORMAT_OFFSET \
+	(LEAF_NODE_CELL_CONTENT_OFFSET + LEAF_NODE_CELL_CONTENT_SIZE)
+#define LEAF_NODE_HEADER_SIZE \
+	ALIGN_UP(LEAF_NODE_FORMAT_OFFSET + LEAF_NODE_FORMAT_SIZE, NODE_HEADER_ALIGNMENT)
+
+typedef enum {
+	LEAF_FORMAT_SLOTTED,
+	LEAF_FORMAT_PACKED
+} LeafFormat;
+
+/*
+ * Leaf Node Body Layout
+ * The keys follow the header as one sorted array, then the slot
+ * directory of cell offsets in the same order. Searches only touch the
+ * key array. Cells are packed from the end of the page towards them; cell
+ * content starts at the offset kept in the header. A cell is a serialized
+ * row, whose leading id is also the key.
+ */
+#define LEAF_NODE_KEY_SIZE (sizeof(uint32_t))
+#define LEAF_NODE_OFFSET_SIZE (sizeof(uint16_t))
+#define LEAF_NODE_SLOT_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_OFFSET_SIZE)
+#define LEAF_NODE_MAX_CELL_SIZE (ROW_SIZE)
+#define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_HEADER_SIZE)
+
+/*
+ * Packed Leaf Body Layout
+ * Written by the bulk loader and only ever read: the first change to a
+ * packed leaf turns it back into slotted leaves (leaf_node_unpack).
+ * After the leaf header come the smallest key, the bit width of each
+ * key's distance from it, the offsets of the restart rows, the distances
+ * bit-packed in key order, then the strings of each row. A string is
+ * stored as the length of the prefix and of the suffix it shares with
+ * the same column of the row before, then the bytes in between. Every
+ * LEAF_PACKED_RESTART_INTERVAL-th row shares nothing, so a row can be
+ * decoded from the restart before it. There are no slots and the
+ * cell content start is unused.
+ */
+#define LEAF_PACKED_KEY_BASE_SIZE (sizeof(uint32_t))
+#define LEAF_PACKED_KEY_BASE_OFFSET (LEAF_NODE_HEADER_SIZE)
+#define LEAF_PACKED_KEY_BITS_SIZE (sizeof(uint8_t))
+#define LEAF_PACKED_KEY_BITS_OFFSET \
+	(LEAF_PACKED_KEY_BASE_OFFSET + LEAF_PACKED_KEY_BASE_SIZE)
+#define LEAF_PACKED_RESTART_SIZE (sizeof(uint16_t))
+#define LEAF_PACKED_HEADER_SIZE \
+	ALIGN_UP(LEAF_PACKED_KEY_BITS_OFFSET + LEAF_PACKED_KEY_BITS_SIZE, LEAF_PACKED_RESTART_SIZE)
+#define LEAF_PACKED_RESTART_INTERVAL 16
+#define LEAF_PACKED_STRING_HEADER_SIZE (3 * sizeof(uint8_t))
+#define LEAF_PACKED_MAX_CELLS (PAGE_SIZE / (2 * LEAF_PACKED_STRING_HEADER_SIZE))
+
+/*
+ * Internal Node Header Layout
+ */
+#define INTERNAL_NODE_NUM_KEYS_SIZE (sizeof(uint32_t))
+#define INTERNAL_NODE_NUM_KEYS_OFFSET (COMMON_NODE_HEADER_SIZE)
+#define INTERNAL_NODE_RIGHT_CHILD_SIZE (sizeof(uint32_t))
+#define INTERNAL_NODE_RIGHT_CHILD_OFFSET \
+	(INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE)
+#define INTERNAL_NODE_HEADER_SIZE ALIGN_UP(INTERNAL_NODE_RIGHT_CHILD_OFFSET + \
+		INTERNAL_NODE_RIGHT_CHILD_SIZE, NODE_HEADER_ALIGNMENT)
+
+/*
+ * Internal Node Body Layout
+ * An array of keys sized for INTERNAL_NODE_MAX_CELLS, then the array of
+ * children, so a search reads only keys.
+*/
+#define INTERNAL_NODE_KEY_SIZE (sizeof(uint32_t))
+#define INTERNAL_NODE_CHILD_SIZE (sizeof(uint32_t))
+#define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_CHILD_SIZE)
+#define INTERNAL_NODE_SPACE_FOR_CELLS (PAGE_SIZE - INTERNAL_NODE_HEADER_SIZE)
+#define INTERNAL_NODE_MAX_CELLS (INTERNAL_NODE_SPACE_FOR_CELLS / INTERNAL_NODE_CELL_SIZE)
+#define INTERNAL_NODE_KEYS_OFFSET (INTERNAL_NODE_HEADER_SIZE)
+#define INTERNAL_NODE_CHILDREN_OFFSET \
+	(INTERNAL_NODE_KEYS_OFFSET + INTERNAL_NODE_MAX_CELLS * INTERNAL_NODE_KEY_SIZE)
+
+/*
+ * Searches halve the key range without branching down to this many keys,
+ * then compare the rest all at once.
+ */
+#define NODE_SEARCH_LINEAR_KEYS 16
+
+/*
+ * A node on the right edge of the tree that splits because of a new
+ * largest key keeps this much of the data, so increasing keys leave
+ * nearly full nodes behind instead of half empty ones.
+ */
+#define RIGHT_EDGE_SPLIT_PERCENT 90
+
+/*
+ * Deepest path a writer can hold latched. Every internal node has at
+ * least two children, so this is never reached with 32-bit keys.
+ */
+#define TABLE_MAX_HEIGHT 33
+
+typedef enum {
+	META_COMMAND_SUCCESS,
+	META_COMMAND_UNRECOGNIZED_COMMAND
+} MetaCommandResult;
+
+typedef enum {
+	PREPARE_SUCCESS,
+	PREPARE_NEGATIVE_ID,
+	PREPARE_STRING_TOO_LONG,
+	PREPARE_SYNTAX_ERROR,
+	PREPARE_UNRECOGNIZED_STATEMENT
+} PrepareResult;
+
+typedef enum {
+	STATEMENT_INSERT,
+	STATEMENT_SELECT,
+	STATEMENT_CREATE_INDEX
+} StatementType;
+
+typedef enum {
+	EXECUTE_SUCCESS,
+	EXECUTE_DUPLICATE_KEY,
+	EXECUTE_TABLE_FULL,
+	EXECUTE_INDEX_EXISTS
+} ExecuteResult;
+
+typedef enum {
+	PROJECT_ROW,
+	PROJECT_ID,
+	PROJECT_COUNT,
+	PROJECT_MIN,
+	PROJECT_MAX
+} Projection;
+
+typedef enum {
+	COLUMN_ID,
+	COLUMN_USERNAME,
+	COLUMN_EMAIL,
+	NUM_COLUMNS
+} Column;
+
+#define COLUMN_USERNAME_SIZE 32
+#define COLUMN_EMAIL_SIZE 255
+typedef struct Row{
+	uint32_t id;
+	char username[COLUMN_USERNAME_SIZE+1];
+	char email[COLUMN_EMAIL_SIZE+1];
+} Row;
+
+/* select ... where id: what the key sets, see statement_set_key */
+typedef enum {
+	KEY_EQUAL,
+	KEY_AT_LEAST,
+	KEY_AT_MOST,
+	KEY_ABOVE,
+	KEY_BELOW,
+	KEY_BETWEEN
+} KeyPredicate;
+
+/*
+ * What a ? in a prepared statement stands for. The keys and the id are
+ * bound as integers, the rest as strings.
+ */
+typedef enum {
+	PARAM_ID,
+	PARAM_USERNAME,
+	PARAM_EMAIL,
+	PARAM_KEY,	/* the key of the predicate, key_min for between */
+	PARAM_KEY_MAX,	/* between: the second key */
+	PARAM_VALUE
+} StatementParam;
+
+#define STATEMENT_MAX_PARAMS 4
+
+typedef struct Statement {
+	StatementType type;
+	Row row_to_insert;	//only used by insert statement
+	Row *rows;	//insert: row_to_insert, or an allocated batch
+	uint32_t num_rows;
+	uint32_t key_min;	//select returns keys in [key_min, key_max], none if min > max
+	uint32_t key_max;
+	Column column;	//select: COLUMN_ID, or the column compared with value
+	Projection projection;	//select: whole rows, ids only, count(*), min or max
+	Column aggregate;	//select: the column min or max is over
+	char value[COLUMN_EMAIL_SIZE+1];	//create index uses column only
+	KeyPredicate key_predicate;	//select where id
+	uint32_t num_params;	//placeholders still to be bound
+	uint32_t max_params;	//0 unless prepared by prepare_template
+	StatementParam params[STATEMENT_MAX_PARAMS];
+} Statement;
+
+#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
+
+/*
+ * Serialized Row Layout
+ * id, the lengths of username and email, then both strings without their
+ * terminators. ROW_SIZE is the largest possible serialized row.
+ */
+#define ID_SIZE size_of_attribute(Row, id)
+#define LENGTH_SIZE (sizeof(uint8_t))
+#define ROW_SIZE  (ID_SIZE + 2 * LENGTH_SIZE + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE)
+
+#define ID_OFFSET (0)
+#define USERNAME_LENGTH_OFFSET (ID_OFFSET + ID_SIZE)
+#define EMAIL_LENGTH_OFFSET (USERNAME_LENGTH_OFFSET + LENGTH_SIZE)
+#define USERNAME_OFFSET (EMAIL_LENGTH_OFFSET + LENGTH_SIZE)
+
+/*
+ * A serialized row read in place, see row_view. The strings point into
+ * the cell and are not terminated, so it is only valid as long as the
+ * cell is.
+ */
+typedef struct {
+	void *cell;
+	uint32_t id;
+	const char *username;
+	const char *email;
+	uint8_t username_length;
+	uint8_t email_length;
+} RowView;
+
+/* "(id, username, email)\n" at its longest, the id printed as an int32_t */
+#define ROW_TEXT_SIZE (11 + COLUMN_USERNAME_SIZE + COLUMN_EMAIL_SIZE + 7)
+
+#define PAGE_SIZE (4096)
+
+/*
+ * Catalog Page Layout
+ * Page 1 holds a magic number, the version of the node layout and the
+ * root page of each column's index, 0 when the column has no index (page
+ * 0 is always the row table's root). CATALOG_FORMAT_VERSION goes up with
+ * every change to how nodes are laid out. Files from before it was kept
+ * have the first index root where it is, and that is never 1.
+ */
+#define CATALOG_PAGE_NUM 1
+#define CATALOG_MAGIC 0x47544143
+#define CATALOG_FORMAT_VERSION 1
+#define CATALOG_MAGIC_OFFSET 0
+#define CATALOG_FORMAT_VERSION_OFFSET (sizeof(uint32_t))
+#define CATALOG_INDEX_ROOTS_OFFSET (2 * sizeof(uint32_t))
+
+/*
+ * Index Cell Layout
+ * Laid out like a serialized row so that the leaf code can size it: the
+ * key, the length of the column value, the length of the row id (always
+ * 4), the column value and the id of the row it belongs to.
+ * The key is a hash of the value below INDEX_HASH_LIMIT. Unlike a table,
+ * an index holds equal keys: every entry for one value, and for any value
+ * whose hash collides with it, has the same key, so they sit next to each
+ * other and a lookup reads on while the key matches.
+ */
+#define INDEX_HASH_LIMIT (1U << 31)
+#define INDEX_ROW_ID_SIZE (sizeof(uint32_t))
+#define PAGER_DEFAULT_FRAMES 256
+#define PAGER_MMAP_RESERVE (1ULL << 36)
+#define INVALID_PAGE_NUM UINT32_MAX
+#define INVALID_FRAME UINT32_MAX
+
+/*
+ * Page latches are allocated PAGER_LATCH_CHUNK_SIZE at a time, and the
+ * chunks are found through directories of PAGER_LATCH_DIRECTORY_SIZE,
+ * both made on first use, so every page number can have a latch.
+ */
+#define PAGER_LATCH_CHUNK_SIZE 1024
+#define PAGER_LATCH_DIRECTORY_SIZE 2048
+#define PAGER_LATCH_DIRECTORIES \
+	((1ULL << 32) / PAGER_LATCH_CHUNK_SIZE / PAGER_LATCH_DIRECTORY_SIZE)
+
+/*
+ * The frames' pages are one slab, mapped when the pager opens. It is made
+ * of explicit huge pages when enough are reserved, and otherwise asks for
+ * transparent ones.
+ */
+#define FRAME_SLAB_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+ * An optimistic reader that has to start over this many times falls back
+ * to shared latches, so a busy writer cannot starve it.
+ */
+#define OPTIMISTIC_READ_ATTEMPTS 8
+
+/*
+ * A page as it was before a write changed it, kept for the snapshots that
+ * must not see the write. begin is the timestamp of the write that left
+ * the page like this and end that of the write that changed it, so a
+ * snapshot at ts reads this image when begin <= ts < end.
+ */
+typedef struct PageVersion {
+	uint32_t page_num;
+	uint64_t begin;
+	uint64_t end;
+	struct PageVersion *older;	/* same page, next older image */
+	struct PageVersion *newer;
+	struct PageVersion *next;	/* kept in order of end, or the write's undo list */
+	uint8_t image[PAGE_SIZE];
+} PageVersion;
+
+/*
+ * Every page has a latch, and a version that a writer bumps when it takes
+ * the latch exclusive and again when it lets go. The version is odd while
+ * the page may be changing, so a reader can check that a page did not
+ * change under it without writing to shared memory.
+ */
+typedef struct {
+	pthread_rwlock_t latch;
+	uint64_t version;
+	uint64_t written;	/* timestamp of the last write to latch it */
+	PageVersion *versions;	/* newest kept image, NULL if none */
+} PageLatch;
+
+#define MVCC_MAX_SNAPSHOTS 1024
+#define MVCC_SPARE_VERSIONS 64
+
+/*
+ * Snapshots. Every write that latches pages gets the next timestamp, and
+ * a snapshot at ts sees the table as it was when write ts committed. A
+ * write that starts while a snapshot is open, or being opened, copies
+ * each page before its first change to it; the copy is kept while a
+ * snapshot may need it, and the collector thread frees it once none can.
+ * Other writes copy nothing, and a snapshot opened during one waits for
+ * it to commit.
+ */
+typedef struct {
+	pthread_mutex_t lock;	/* covers everything here and the image chains */
+	pthread_cond_t cond;
+	pthread_cond_t committed_cond;	/* signalled for snapshots waiting on a write */
+	pthread_t collector;
+	bool stop;
+	uint64_t committed;	/* timestamp of the last committed write */
+	uint64_t writing;	/* of the write in progress, 0 if none */
+	bool copying;	/* the write in progress copies pages, read by it alone */
+	uint32_t num_waiting;	/* snapshot_open calls waiting for a write to commit */
+	uint64_t snapshots[MVCC_MAX_SNAPSHOTS];	/* open snapshots, unordered */
+	uint32_t num_snapshots;
+	PageVersion *undo;	/* copies made by the write in progress, not kept */
+	PageVersion *spare;	/* up to MVCC_SPARE_VERSIONS, for the next copies */
+	uint32_t num_spare;
+	PageVersion *oldest;	/* kept images, by end */
+	PageVersion *newest;
+	uint32_t kept;
+	uint64_t collected;
+} Mvcc;
+
+/*
+ * A frame is one PAGE_SIZE slot of the buffer pool. page_num is
+ * INVALID_PAGE_NUM while the frame holds no page. Pages already in the
+ * pool are pinned and unpinned without the pager lock, so page_num,
+ * pin_count, referenced, read_ahead, hits and hash_next are only changed
+ * atomically. While the pager gives a frame another page its pin_count is
+ * FRAME_EVICTING, and nobody can pin it.
+ */
+#define FRAME_EVICTING (1U << 31)
+
+typedef struct {
+	uint32_t page_num;
+	uint32_t pin_count;
+	bool dirty;
+	bool referenced;	/* CLOCK second-chance bit */
+	bool read_ahead;	/* read ahead of a scan, not used since */
+	uint32_t hash_next;	/* next frame in the same page table bucket */
+	uint64_t hits;	/* pins taken without the lock, moved to pager->hits on eviction */
+	void *data;
+} Frame;
+
+/*
+ * Page I/O is handed to an io_uring when the kernel has one, else to
+ * IO_POOL_THREADS threads calling preadv/pwritev, or done by the calling
+ * thread (IO_SYNC, one system call after another). A caller submits a
+ * whole batch and waits for all of it, so up to IO_QUEUE_DEPTH requests
+ * are in flight at once.
+ */
+typedef enum {
+	IO_DEFAULT,	/* io_uring if the kernel allows it, else threads */
+	IO_URING,
+	IO_THREADS,
+	IO_SYNC
+} IoBackend;
+
+#define IO_QUEUE_DEPTH 64
+#define IO_POOL_THREADS 4
+
+typedef struct {
+	bool write;
+	int fd;
+	struct iovec *iov;
+	uint32_t iov_count;
+	uint64_t offset;
+	ssize_t result;	/* bytes transferred, or -errno */
+} IoRequest;
+
+typedef struct {
+	IoBackend backend;	/* the one in use, never IO_DEFAULT */
+	uint64_t batches;
+	uint64_t requests;
+
+	/* IO_URING: the rings shared with the kernel */
+	int ring_fd;
+	uint32_t entries;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;	/* same as sq_ring if the kernel maps both at once */
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_mask;
+	uint32_t *sq_array;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* IO_THREADS: the workers take the requests of batch in turn */
+	pthread_t threads[IO_POOL_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	IoRequest *batch;
+	uint32_t batch_size;
+	uint32_t next;
+	uint32_t completed;
+	bool stop;
+} Io;
+
+#define WAL_MAGIC 0x4c415744
+#define WAL_HEADER_SIZE 16
+#define WAL_FRAME_HEADER_SIZE 16
+#define WAL_COMMIT_RECORD INVALID_PAGE_NUM
+#define WAL_CHECKPOINT_FRAMES 1024
+#define WAL_DEFAULT_GROUP_COMMIT 1
+
+/*
+ * Every frame in the log starts with this header. A frame with page_num
+ * WAL_COMMIT_RECORD has no page image and makes all frames before it
+ * durable. checksum covers the header fields and the page image.
+ */
+typedef struct {
+	uint32_t page_num;
+	uint32_t db_pages;	/* commit records only */
+	uint32_t salt;
+	uint32_t checksum;
+} WalFrameHeader;
+
+typedef struct {
+	uint32_t page_num;
+	uint64_t offset;
+} WalIndexEntry;
+
+typedef struct {
+	int file_descriptor;
+	int db_file_descriptor;
+	char *filename;
+	Io *io;	/* checkpoint copies */
+	uint32_t salt;
+	uint64_t write_offset;
+	uint64_t commit_offset;	/* end of the last commit record */
+	uint64_t *index;	/* page_num -> offset of latest frame, 0 if none */
+	uint32_t index_size;
+	uint32_t frames;	/* frames written since the log was restarted */
+	uint32_t group_commit;
+	uint32_t pending_statements;
+	uint64_t commits;
+	uint64_t checkpoints;
+
+	/* Background checkpoint, protected by lock */
+	pthread_t checkpointer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	WalIndexEntry *checkpoint_entries;
+	uint32_t checkpoint_num_entries;
+	uint64_t checkpoint_end_offset;
+	bool checkpoint_busy;	/* handed to the thread, not finished yet */
+	bool checkpoint_done;	/* finished, log can be restarted */
+	bool stop;
+} Wal;
+
+typedef struct {
+	int file_descriptor;
+	uint64_t file_length;
+	uint32_t num_pages;
+	uint32_t num_frames;
+	Frame *frames;
+	uint32_t *page_table;	/* bucket -> first frame, chained by hash_next */
+	uint32_t page_table_size;
+	uint32_t clock_hand;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t reads;	/* pages read from the db file or the log */
+	uint64_t evictions;
+	uint64_t writebacks;
+	uint64_t read_ahead;	/* pages read ahead of scans */
+	uint64_t read_ahead_hits;	/* of those, used before eviction */
+	uint64_t read_ahead_wasted;	/* and evicted unused */
+	void *frame_slab;	/* frame i's page is at i * PAGE_SIZE, NULL in mmap mode */
+	size_t frame_slab_size;
+	bool frame_slab_huge;	/* made of explicit huge pages */
+	Wal *wal;	/* NULL when the log is disabled */
+	Io *io;
+	bool direct;	/* the db file was opened O_DIRECT */
+
+	/* mmap mode: the whole file is mapped and the frames are unused */
+	void *map;	/* NULL in buffer pool mode */
+	uint64_t map_size;
+	uint8_t *dirty_pages;	/* one flag per page */
+	uint32_t dirty_pages_size;
+
+	/*
+	 * lock covers everything above, including the I/O, apart from the
+	 * atomic frame fields a hit changes without it. The contents of a page
+	 * are covered by its latch, taken by the tree code.
+	 */
+	pthread_mutex_t lock;
+	PageLatch ***latches;	/* PAGER_LATCH_DIRECTORIES directories of chunks */
+	Mvcc *mvcc;
+} Pager;
+
+/*
+ * Statistics, compiled in with -DDB_STATS (make STATS=1) and out otherwise,
+ * when the STATS_ macros expand to nothing. Each thread counts into its
+ * own Stats, so the hot paths write nothing shared; .stats and the JSON
+ * dump add them up. Latencies are in clock ticks, the TSC on x86, kept in
+ * buckets of four per power of two.
+ */
+typedef enum {
+	STAT_PAGE_HITS,
+	STAT_PAGE_MISSES,
+	STAT_PAGE_READS,	/* pages read from the db file or the log */
+	STAT_PAGE_WRITES,	/* pages written back, to the log or the db file */
+	STAT_BYTES_FLUSHED,	/* bytes written to either file, log headers included */
+	STAT_CHECKPOINT_PAGES,	/* pages copied from the log to the db file */
+	STAT_LEAF_SPLITS,
+	STAT_INTERNAL_SPLITS,
+	STAT_ROOT_SPLITS,
+	STAT_LEAVES_SCANNED,
+	NUM_STATS
+} StatCounter;
+
+typedef enum {
+	TIMER_FIND,	/* table_find, table_get, and a scan finding its first leaf */
+	TIMER_INSERT,	/* table_insert, and table_insert_rows per batch */
+	TIMER_SCAN,	/* scan_open to scan_close */
+	NUM_TIMERS
+} StatTimer;
+
+#define STATS_BUCKETS 256
+#define STATS_DEFAULT_INTERVAL 1000
+
+typedef struct {
+	uint64_t count;
+	uint64_t ticks;
+	uint64_t buckets[STATS_BUCKETS];
+} StatsHistogram;
+
+typedef struct Stats {
+	uint64_t counters[NUM_STATS];
+	StatsHistogram timers[NUM_TIMERS];
+	struct Stats *next;	/* live threads, under stats_lock */
+} Stats;
+
+#ifdef DB_STATS
+#define STATS_ADD(counter, n) stats_add(stats_thread(), (counter), (n))
+#define STATS_TIME_START(started) uint64_t started = stats_ticks()
+#define STATS_TIME_END(timer, started) stats_time(stats_thread(), (timer), stats_ticks() - (started))
+#else
+#define STATS_ADD(counter, n) ((void)0)
+#define STATS_TIME_START(started) ((void)0)
+#define STATS_TIME_END(timer, started) ((void)0)
+#endif
+
+/* Writes the statistics to a file every interval, see stats_dump_open */
+typedef struct {
+	struct Table *table;
+	char *filename;
+	uint32_t interval_ms;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+} StatsDump;
+
+typedef struct {
+	uint32_t pool_frames;
+	bool use_mmap;
+	bool use_wal;
+	uint32_t group_commit;
+	uint32_t scan_threads;	/* 0: one per online CPU */
+	IoBackend io_backend;
+	bool use_direct;	/* bypass the page cache, buffer pool mode only */
+	const char *stats_file;	/* NULL: no periodic statistics dump */
+	uint32_t stats_interval;	/* ms between dumps, 0: STATS_DEFAULT_INTERVAL */
+} DbOptions;
+
+/*
+ * Arena. Memory that lives no longer than a statement: cursors, the rows
+ * of a batch insert, scratch arrays. It is taken from the current block
+ * by moving a pointer up, and given back all at once by moving it back,
+ * to a mark or to the start; the blocks are kept for the next statement.
+ * Every thread has its own, see arena_thread. Whoever runs statements
+ * resets it after each one, the REPL after a line and the server after a
+ * request. table_insert and the other calls that may be made outside a
+ * statement release what they took themselves, and so do cursor_close
+ * and scan_close.
+ */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct ArenaBlock {
+	struct ArenaBlock *next;
+	size_t size;	/* of data */
+	uint8_t data[];
+} ArenaBlock;
+
+typedef struct {
+	ArenaBlock *first;
+	ArenaBlock *block;	/* allocating from it, NULL before the first */
+	size_t used;	/* bytes of block taken */
+} Arena;
+
+typedef struct {
+	ArenaBlock *block;
+	size_t used;
+} ArenaMark;
+
+/*
+ * A table is one B+tree in the pager file: the rows keyed by id, or a
+ * secondary index. indexes is only used on the row table, a column's slot
+ * is NULL when it has no index.
+ */
+typedef struct Table {
+	Pager *pager;
+	uint32_t root_page_num;
+	uint32_t rightmost_leaf;	/* last leaf seen with no next leaf, a hint */
+	struct Table *indexes[NUM_COLUMNS];
+	pthread_mutex_t writer_lock;	/* writers take turns, readers never take it */
+	uint32_t scan_threads;	/* at most this many threads scan for one select */
+	StatsDump *stats_dump;	/* NULL unless options->stats_file was set */
+} Table;
+
+typedef struct {
+	Table *table;
+	uint32_t page_num;
+	uint32_t cell_num;
+	bool end_of_table;	
+	uint32_t pinned_page_num;	/* INVALID_PAGE_NUM, or the page cursor_view holds */
+	void *pinned;
+
+	/* Last row decoded from a packed leaf, see cursor_value */
+	uint32_t decoded_page_num;	/* INVALID_PAGE_NUM if none */
+	uint32_t decoded_cell_num;
+	uint32_t decoded_next_offset;	/* strings of the row after it */
+	uint8_t decoded[ROW_SIZE];
+	ArenaMark mark;	/* the thread's arena before the cursor was taken from it */
+} Cursor;
+
+/*
+ * A scan reads a whole leaf at a time. The keys are copied out into one
+ * array and the range predicate is evaluated over all of them into a
+ * bitmap, so select id and select count(*) never touch the strings.
+ * No leaf holds more keys than a packed one. A scan reads a snapshot, so
+ * it neither waits for writers nor holds them up.
+ */
+#define SCAN_MAX_KEYS LEAF_PACKED_MAX_CELLS
+
+/*
+ * Read-ahead. Once a scan has used half of the leaves it read ahead, it
+ * reads the next window of them as one batch. The window starts at
+ * READ_AHEAD_MIN_LEAVES and doubles each time, up to READ_AHEAD_MAX_LEAVES
+ * or a quarter of the pool. It is halved when leaves read ahead were
+ * evicted before anything used them: the scan is falling behind the
+ * rest of the pool.
+ */
+#define READ_AHEAD_MIN_LEAVES 4
+#define READ_AHEAD_MAX_LEAVES IO_QUEUE_DEPTH
+
+typedef struct {
+	Table *table;
+	uint64_t snapshot;
+	uint32_t page_num;	/* next leaf to read */
+	bool end_of_table;
+	uint32_t key_min;
+	uint32_t key_max;
+
+	/* The last leaf read */
+	uint64_t leaf[PAGE_SIZE / sizeof(uint64_t)];
+	uint32_t num_keys;
+	uint32_t keys[SCAN_MAX_KEYS];
+	uint8_t selected[(SCAN_MAX_KEYS + 7) / 8];	/* bit i: keys[i] is in range */
+	uint32_t num_selected;
+
+	/* Last row decoded from it if it is packed, see scan_value */
+	bool decoded_valid;
+	uint32_t decoded_cell_num;
+	uint32_t decoded_next_offset;
+	uint8_t decoded[ROW_SIZE];
+	bool owns_snapshot;	/* opened by scan_open, closed by scan_close */
+	ArenaMark mark;	/* the thread's arena before the scan was taken from it */
+
+	/*
+	 * Read-ahead. The leaves do not say where the ones after the next
+	 * are, their parents do: path holds the internal nodes above the
+	 * last leaf listed, path_child the child taken at each, and parent a
+	 * copy of the lowest. depth is 0 when there is nothing left to list.
+	 */
+	uint32_t path[TABLE_MAX_HEIGHT];
+	uint32_t path_child[TABLE_MAX_HEIGHT];
+	uint32_t path_num_keys[TABLE_MAX_HEIGHT];
+	uint32_t depth;
+	uint64_t parent[PAGE_SIZE / sizeof(uint64_t)];
+	uint32_t ahead[READ_AHEAD_MAX_LEAVES];	/* leaves read ahead, in key order */
+	uint32_t ahead_next;	/* the first the scan has not reached */
+	uint32_t num_ahead;
+	uint32_t window;
+	uint32_t max_window;
+	uint64_t wasted;	/* pager->read_ahead_wasted at the last window */
+	uint64_t started;	/* stats_ticks() when opened, with DB_STATS */
+} Scan;
+
+/*
+ * What a scan of an id range produced for a select. Rows and ids are
+ * written as they are found, count, min and max are kept here. Rows are
+ * formatted from the leaf straight into batch, which goes to out in one
+ * write whenever it fills and at the end of the scan.
+ */
+#define SCAN_BATCH_SIZE 16384
+
+typedef struct {
+	FILE *out;
+	bool binary;	/* write_view and write_id write binary, not text */
+	uint64_t count;
+	bool found;	/* min, max: row holds the value so far */
+	Row row;
+	uint32_t batch_length;
+	char batch[SCAN_BATCH_SIZE];
+} ScanResult;
+
+/*
+ * A select scanned by several threads. The id range is cut at the keys in
+ * splits, and each thread takes the next range nobody has taken until
+ * there are none left.
+ */
+#define PARALLEL_SCAN_RANGES_PER_THREAD 8
+#define PARALLEL_SCAN_MAX_NODES 4096
+
+typedef struct {
+	Table *table;
+	Statement *statement;
+	uint64_t snapshot;
+	uint32_t *splits;	/* range i ends at splits[i], the last at key_max */
+	uint32_t num_ranges;
+	uint32_t next_range;
+	ScanResult *results;	/* one per range */
+	char **buffers;	/* select and select id: what each range printed */
+	size_t *buffer_sizes;
+
+	pthread_mutex_t lock;	/* covers done */
+	pthread_cond_t cond;
+	bool *done;
+} ParallelScan;
+
+#define BULK_LOAD_RUN_BYTES (8 << 20)
+#define BULK_LOAD_DEFAULT_FILL 100
+
+typedef struct {
+	uint32_t key;
+	uint32_t offset;	/* of the serialized row in the run buffer */
+} BulkLoadEntry;
+
+typedef struct {
+	uint32_t page_num;
+	uint32_t max_key;
+} BulkLoadChild;
+
+/*
+ * Rows are added in any order and collected into runs of up to
+ * BULK_LOAD_RUN_BYTES. Each full run is sorted and spilled to a temporary
+ * file, and the runs are merged when the load finishes. The sorted rows
+ * are packed into leaves left to right, then the internal levels are
+ * built on top of them, the last one in the root page.
+ */
+typedef struct {
+	Table *table;
+	uint32_t fill_percent;
+
+	/* Run being collected */
+	uint8_t *run_buffer;
+	uint32_t run_bytes;
+	BulkLoadEntry *entries;
+	uint32_t num_entries;
+	uint32_t entries_capacity;
+	FILE **runs;
+	uint32_t num_runs;
+
+	/* Leaf being filled, written out once the next leaf is started */
+	void *leaf;
+	uint32_t next_page_num;
+	BulkLoadChild *leaves;
+	uint32_t num_leaves;
+	uint32_t leaves_capacity;
+	uint32_t last_key;
+	uint32_t rows_loaded;
+	uint32_t duplicates;
+	bool keep_duplicates;	/* index build: equal keys are all kept instead of skipped */
+
+	/* Packed leaves: rows held back, one per ROW_SIZE slot, until the leaf is full */
+	bool pack_leaves;
+	uint8_t *staged;
+	uint32_t num_staged;
+	uint32_t staged_string_bytes;
+} BulkLoader;
+
+typedef struct InputBuffer {
+	char *buf;
+	size_t buf_len;
+	ssize_t input_len;
+} InputBuffer;
+
+/*
+ * Server wire protocol. Every message is a uint32_t length and then that
+ * many bytes: a type byte and the body. Integers are little-endian. A
+ * client may send any number of requests without waiting for responses,
+ * which come back in order, one per request.
+ *
+ * Requests, by type:
+ *   REQUEST_QUERY    the text of a statement, as typed at the REPL
+ *   REQUEST_PREPARE  the same with ? for values, see prepare_template
+ *   REQUEST_EXECUTE  a uint32_t handle from REQUEST_PREPARE, then for each
+ *                    ? a uint32_t for a key or id, or a uint16_t length
+ *                    and the text
+ *   REQUEST_CLOSE    a uint32_t handle, which may be handed out again
+ * A response's type is a ServerResponse. Bodies only come with
+ * RESPONSE_OK: for a select the results in binary (see write_view and
+ * write_aggregate), for a batch insert the index of each row skipped as a
+ * duplicate, for a prepare the uint32_t handle, a byte with the number of
+ * ? and a byte for each, 1 if it is a key.
+ */
+#define SERVER_LENGTH_SIZE 4
+#define SERVER_HEADER_SIZE (SERVER_LENGTH_SIZE + 1)
+#define SERVER_MAX_MESSAGE (16 * 1024 * 1024)
+#define SERVER_READ_SIZE 65536
+#define SERVER_MAX_EVENTS 64
+#define SERVER_BACKLOG 128
+
+typedef enum {
+	REQUEST_QUERY = 'Q',
+	REQUEST_PREPARE = 'P',
+	REQUEST_EXECUTE = 'E',
+	REQUEST_CLOSE = 'C'
+} ServerRequest;
+
+typedef enum {
+	RESPONSE_OK,
+	RESPONSE_DUPLICATE_KEY,
+	RESPONSE_TABLE_FULL,
+	RESPONSE_INDEX_EXISTS,
+	RESPONSE_NEGATIVE_ID,
+	RESPONSE_STRING_TOO_LONG,
+	RESPONSE_SYNTAX_ERROR,
+	RESPONSE_UNRECOGNIZED_STATEMENT,
+	RESPONSE_BAD_REQUEST	/* unknown type or handle, or a short body */
+} ServerResponse;
+
+typedef struct Connection {
+	int fd;	/* -1 once closed */
+	uint8_t *in;	/* read, not yet a whole request */
+	uint32_t in_length;
+	uint32_t in_size;
+	char *out;	/* responses, sent up to out_sent */
+	size_t out_length;
+	size_t out_sent;
+	bool sending;	/* waiting for the socket to take out, not reading */
+	Statement **prepared;	/* by handle, NULL when closed */
+	uint32_t num_prepared;
+	struct Connection *prev;
+	struct Connection *next;
+	struct Connection *held_next;	/* on server->held */
+} Connection;
+
+typedef struct {
+	Table *table;
+	int listen_fd;
+	int signal_fd;
+	int epoll_fd;
+	Connection *connections;
+	Connection *closed;	/* freed at the end of each round of events */
+	Connection *held;	/* responses not sent until the log commits */
+} Server;
+
+/** prototype **/
+void *get_page(Pager *pager, uint32_t page_num);
+void unpin_page(Pager *pager, uint32_t page_num);
+void mark_page_dirty(Pager *pager, uint32_t page_num);
+void latch_page(Pager *pager, uint32_t page_num, bool exclusive);
+void unlatch_page(Pager *pager, uint32_t page_num);
+uint64_t page_version(Pager *pager, uint32_t page_num);
+bool page_version_unchanged(Pager *pager, uint32_t page_num, uint64_t version);
+void page_read(Pager *pager, uint32_t page_num, void *copy);
+void mvcc_keep_page(Pager *pager, uint32_t page_num, PageLatch *latch);
+void mvcc_begin_write(Pager *pager);
+void mvcc_end_write(Pager *pager);
+void mvcc_open(Pager *pager);
+void mvcc_close(Mvcc *mvcc);
+uint64_t snapshot_open(Pager *pager);
+void snapshot_close(Pager *pager, uint64_t ts);
+void page_read_snapshot(Pager *pager, uint32_t page_num, uint64_t ts, void *copy);
+char *row_column(Row *row, Column column);
+int compare_uint32(const void *a, const void *b);
+void write_view(ScanResult *result, RowView *view);
+void write_id(ScanResult *result, uint32_t id);
+void write_flush(ScanResult *result);
+bool statement_placeholder(Statement *statement, char *string, StatementParam param);
+void statement_set_key(Statement *statement, uint32_t key);
+void serialize_row(Row *row, void *dest);
+uint32_t serialized_row_size(Row *row);
+uint32_t row_size_at(void *src);
+uint32_t row_key_at(void *src);
+void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level);
+void internal_node_insert(Table *table, uint32_t parent_page_num,
+		uint32_t left_page_num, uint32_t child_page_num);
+void update_internal_node_key(void *node, uint32_t child_page_num, uint32_t new_key);
+Cursor *table_find(Table *table, uint32_t key);
+PrepareResult parse_row(char *id_string, char *username, char *email, Row *row);
+Cursor *table_seek(Table *table, uint32_t key);
+void index_insert_row(Table *table, Row *row);
+void index_build(Table *table, Column column);
+Table *index_open(Pager *pager, uint32_t root_page_num);
+uint32_t *catalog_index_root(void *catalog, Column column);
+void pager_end_statement(Pager *pager);
+void deserialize_row(void *src, Row *row);
+void *cursor_value(Cursor *cursor);
+Stats *stats_thread();
+void stats_add(Stats *stats, StatCounter counter, uint64_t n);
+uint64_t stats_ticks();
+void stats_time(Stats *stats, StatTimer timer, uint64_t ticks);
+StatsDump *stats_dump_open(Table *table, const char *filename, uint32_t interval_ms);
+void stats_dump_close(StatsDump *dump);
+
+/** library **/
+Table *db_open(const char *filename, DbOptions *options);
+void db_close(Table *table);
+ExecuteResult execute_insert(Table *table, Statement *statement);
+ExecuteResult execute_statement(Table *table, Statement *statement);
+ExecuteResult execute_statement_to(Table *table, Statement *statement, FILE *out, bool binary);
+PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement);
+PrepareResult prepare_template(InputBuffer *input_buffer, Statement *statement);
+bool statement_param_is_key(StatementParam param);
+PrepareResult statement_bind_key(Statement *statement, uint32_t param_num, uint32_t key);
+PrepareResult statement_bind_text(Statement *statement, uint32_t param_num, const char *text,
+		uint32_t length);
+ExecuteResult table_insert(Table *table, Row *row);
+uint32_t table_insert_rows(Table *table, Row *rows, uint32_t num_rows,
+		ExecuteResult *results);
+bool table_get(Table *table, uint32_t key, Row *row);
+Scan *scan_open(Table *table, uint32_t key_min, uint32_t key_max);
+bool scan_next(Scan *scan);
+void *scan_value(Scan *scan, uint32_t cell_num);
+void scan_close(Scan *scan);
+BulkLoader *bulk_load_begin(Table *table, uint32_t fill_percent);
+void bulk_load_add(BulkLoader *loader, Row *row);
+uint32_t bulk_load_finish(BulkLoader *loader, uint32_t *duplicates);
+void row_view(void *cell, RowView *view);
+void cursor_view(Cursor *cursor, RowView *view);
+void cursor_close(Cursor *cursor);
+uint32_t *leaf_node_num_cells(void *node);
+Arena *arena_thread();
+void *arena_alloc(Arena *arena, size_t size);
+ArenaMark arena_mark(Arena *arena);
+void arena_release(Arena *arena, ArenaMark mark);
+void arena_reset(Arena *arena);
+uint32_t pager_checkpoint(Pager *pager);
+void server_run(Table *table, const char *address);
+int server_connect(const char *address);
+
+#endif
@@ -1,146 +1,36 @@
+/* The Makefile passes -D_GNU_SOURCE, the benches that include this file may not */
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE
-#include <stdio.h>
+#endif
 #include <stdlib.h>
 #include <string.h>
-#include <stdbool.h>
-#include <stdint.h>
 #include <ctype.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
-
-typedef enum {
-	NODE_INTERNAL,
-	NODE_LEAF
-} NodeType;
-
-/** Common Node Header Layout **/
-#define NODE_TYPE_SIZE (sizeof(uint8_t))
-#define NODE_TYPE_OFFSET (0)
-#define IS_ROOT_SIZE (sizeof(uint8_t))
-#define IS_ROOT_OFFSET (NODE_TYPE_SIZE)
-#define PARENT_POINTER_SIZE (sizeof(uint32_t))
-#define PARENT_POINTER_OFFSET (IS_ROOT_OFFSET + IS_ROOT_SIZE)
-#define COMMON_NODE_HEADER_SIZE (NODE_TYPE_SIZE + IS_ROOT_SIZE + PARENT_POINTER_SIZE)
-
-/** Leaf Node Header Layout(How many cells) **/
-#define LEAF_NODE_NUM_CELLS_SIZE (sizeof(uint32_t))
-#define LEAF_NODE_NUM_CELLS_OFFSET (COMMON_NODE_HEADER_SIZE)
-#define LEAF_NODE_NEXT_LEAF_SIZE (sizeof(uint32_t))
-#define LEAF_NODE_NEXT_LEAF_OFFSET (LEAF_NODE_NUM_CELLS_OFFSET + LEAF_NODE_NUM_CELLS_SIZE)
-#define LEAF_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + \
-		LEAF_NODE_NUM_CELLS_SIZE + LEAF_NODE_NEXT_LEAF_SIZE)
-
-/** Leaf Node Body Layout **/
-#define LEAF_NODE_KEY_SIZE (sizeof(uint32_t))
-#define LEAF_NODE_KEY_OFFSET (0)
-#define LEAF_NODE_VALUE_SIZE (ROW_SIZE)
-#define LEAF_NODE_VALUE_OFFSET (LEAF_NODE_KEY_OFFSET + LEAF_NODE_KEY_SIZE)
-#define LEAF_NODE_CELL_SIZE (LEAF_NODE_KEY_SIZE + LEAF_NODE_VALUE_SIZE)
-#define LEAF_NODE_SPACE_FOR_CELLS (PAGE_SIZE - LEAF_NODE_HEADER_SIZE)
-//#define LEAF_NODE_MAX_CELLS (LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE)  // 13
-#define LEAF_NODE_MAX_CELLS 2
-
-/*
- * Internal Node Header Layout
- */
-#define INTERNAL_NODE_NUM_KEYS_SIZE (sizeof(uint32_t))
-#define INTERNAL_NODE_NUM_KEYS_OFFSET (COMMON_NODE_HEADER_SIZE)
-#define INTERNAL_NODE_RIGHT_CHILD_SIZE (sizeof(uint32_t))
-#define INTERNAL_NODE_RIGHT_CHILD_OFFSET \
-	(INTERNAL_NODE_NUM_KEYS_OFFSET + INTERNAL_NODE_NUM_KEYS_SIZE)
-#define INTERNAL_NODE_HEADER_SIZE (COMMON_NODE_HEADER_SIZE + \
-		INTERNAL_NODE_NUM_KEYS_SIZE + INTERNAL_NODE_RIGHT_CHILD_SIZE)
-
-/*
- * Internal Node Body Layout
-*/
-#define INTERNAL_NODE_KEY_SIZE (sizeof(uint32_t))
-#define INTERNAL_NODE_CHILD_SIZE (sizeof(uint32_t))
-#define INTERNAL_NODE_CELL_SIZE (INTERNAL_NODE_KEY_SIZE + INTERNAL_NODE_CHILD_SIZE)
-
-#define INTERNAL_NODE_MAX_CELLS 3
-
-typedef enum {
-	META_COMMAND_SUCCESS,
-	META_COMMAND_UNRECOGNIZED_COMMAND
-} MetaCommandResult;
-
-typedef enum {
-	PREPARE_SUCCESS,
-	PREPARE_NEGATIVE_ID,
-	PREPARE_STRING_TOO_LONG,
-	PREPARE_SYNTAX_ERROR,
-	PREPARE_UNRECOGNIZED_STATEMENT
-} PrepareResult;
-
-typedef enum {
-	STATEMENT_INSERT,
-	STATEMENT_SELECT
-} StatementType;
-
-typedef enum {
-	EXECUTE_SUCCESS,
-	EXECUTE_DUPLICATE_KEY,
-	EXECUTE_TABLE_FULL
-} ExecuteResult;
-
-#define COLUMN_USERNAME_SIZE 32
-#define COLUMN_EMAIL_SIZE 255
-typedef struct Row{
-	uint32_t id;
-	char username[COLUMN_USERNAME_SIZE+1];
-	char email[COLUMN_EMAIL_SIZE+1];
-} Row;
-
-typedef struct Statement {
-	StatementType type;
-	Row row_to_insert;	//only used by insert statement
-} Statement;
-
-#define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
-
-const uint32_t ID_SIZE = size_of_attribute(Row, id);
-const uint32_t USERNAME_SIZE = size_of_attribute(Row, username);
-const uint32_t EMAIL_SIZE = size_of_attribute(Row, email);
-#define ROW_SIZE  (ID_SIZE + USERNAME_SIZE + EMAIL_SIZE)
-
-#define ID_OFFSET (0)
-#define USERNAME_OFFSET (ID_OFFSET + ID_SIZE)
-#define EMAIL_OFFSET (USERNAME_OFFSET + USERNAME_SIZE)
-
-#define PAGE_SIZE (4096)
-#define TABLE_MAX_PAGES 100
-
-typedef struct {
-	int file_descriptor;
-	uint32_t file_length;
-	uint32_t num_pages;
-	void *pages[TABLE_MAX_PAGES];
-} Pager;
-
-typedef struct Table {
-	Pager *pager;
-	uint32_t root_page_num;
-} Table;
-
-typedef struct {
-	Table *table;
-	uint32_t page_num;
-	uint32_t cell_num;
-	bool end_of_table;	
-} Cursor;
-
-typedef struct InputBuffer {
-	char *buf;
-	size_t buf_len;
-	ssize_t input_len;
-} InputBuffer;
-
-/** prototype **/
-void *get_page(Pager *pager, uint32_t page_num);
-void serialize_row(Row *row, void *dest);
-Cursor *table_find(Table *table, uint32_t key);
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "db.h"
 
 InputBuffer *new_input_buffer() {
 	InputBuffer *input_buffer = (InputBuffer *)malloc(sizeof(*input_buffer));
@@ -183,16 +73,74 @@ uint32_t *leaf_node_next_leaf(void *node){
 	return node + LEAF_NODE_NEXT_LEAF_OFFSET;
 }
 
+uint16_t *leaf_node_cell_content_start(void *node){
+	return node + LEAF_NODE_CELL_CONTENT_OFFSET;
+}
+
+uint32_t *leaf_node_keys(void *node){
+	return node + LEAF_NODE_HEADER_SIZE;
+}
+
+uint16_t *leaf_node_offsets(void *node){
+	/* Moves up as the key array grows */
+	return (void *)(leaf_node_keys(node) + *leaf_node_num_cells(node));
+}
+
+uint16_t *leaf_node_slot(void *node, uint32_t cell_num){
+	return leaf_node_offsets(node) + cell_num;
+}
+
 void *leaf_node_cell(void *node, uint32_t cell_num){
-	return node + LEAF_NODE_HEADER_SIZE + cell_num * LEAF_NODE_CELL_SIZE;
+	return node + *leaf_node_slot(node, cell_num);
 }
 
 uint32_t *leaf_node_key(void *node, uint32_t cell_num){
-	return leaf_node_cell(node, cell_num) + LEAF_NODE_KEY_OFFSET;
+	return leaf_node_keys(node) + cell_num;
 }
 
 void *leaf_node_value(void *node, uint32_t cell_num){
-	return leaf_node_cell(node, cell_num) + LEAF_NODE_VALUE_OFFSET;
+	return leaf_node_cell(node, cell_num);
+}
+
+uint32_t leaf_node_cell_size(void *node, uint32_t cell_num){
+	return row_size_at(leaf_node_cell(node, cell_num));
+}
+
+uint32_t leaf_node_free_space(void *node){
+	/* Bytes between the end of the offsets and the first cell */
+	return *leaf_node_cell_content_start(node) -
+		(LEAF_NODE_HEADER_SIZE + *leaf_node_num_cells(node) * LEAF_NODE_SLOT_SIZE);
+}
+
+void leaf_node_insert_slot(void *node, uint32_t cell_num, uint32_t key, uint16_t offset){
+/*
+ * Add key and offset at cell_num of the key array and the offsets. The
+ * offsets move up one key to make room: the ones after cell_num are moved
+ * first, as the ones before them land on where they start.
+ */
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	uint16_t *old_offsets = leaf_node_offsets(node);
+	uint16_t *new_offsets = (void *)old_offsets + LEAF_NODE_KEY_SIZE;
+	uint32_t *keys = leaf_node_keys(node);
+
+	memmove(new_offsets + cell_num + 1, old_offsets + cell_num,
+			(num_cells - cell_num) * LEAF_NODE_OFFSET_SIZE);
+	memmove(new_offsets, old_offsets, cell_num * LEAF_NODE_OFFSET_SIZE);
+	memmove(keys + cell_num + 1, keys + cell_num, (num_cells - cell_num) * LEAF_NODE_KEY_SIZE);
+	keys[cell_num] = key;
+	new_offsets[cell_num] = offset;
+	*leaf_node_num_cells(node) = num_cells + 1;
+}
+
+void leaf_node_append_cell(void *node, void *cell, uint32_t cell_size){
+/*
+ * Add a cell after the last slot. The caller guarantees key order and
+ * that the cell fits.
+ */
+	*leaf_node_cell_content_start(node) -= cell_size;
+	memcpy(node + *leaf_node_cell_content_start(node), cell, cell_size);
+	leaf_node_insert_slot(node, *leaf_node_num_cells(node), row_key_at(cell),
+			*leaf_node_cell_content_start(node));
 }
 
 uint32_t* node_parent(void *node) {
@@ -222,10 +170,214 @@ void set_node_root(void *node, bool is_root){
 void init_leaf_node(void *node){
 	*leaf_node_num_cells(node) = 0;
 	*leaf_node_next_leaf(node) = 0;
+	*leaf_node_cell_content_start(node) = PAGE_SIZE;
+	*(uint8_t *)(node + LEAF_NODE_FORMAT_OFFSET) = LEAF_FORMAT_SLOTTED;
 	set_node_type(node, NODE_LEAF);
 	set_node_root(node, false);
 }
 
+/*------------------Packed leaf node------------------*/
+bool leaf_node_is_packed(void *node){
+	return *(uint8_t *)(node + LEAF_NODE_FORMAT_OFFSET) == LEAF_FORMAT_PACKED;
+}
+
+uint16_t *leaf_packed_restart(void *node, uint32_t restart_num){
+	return node + LEAF_PACKED_HEADER_SIZE + restart_num * LEAF_PACKED_RESTART_SIZE;
+}
+
+uint32_t leaf_packed_num_restarts(uint32_t num_cells){
+	return (num_cells + LEAF_PACKED_RESTART_INTERVAL - 1) / LEAF_PACKED_RESTART_INTERVAL;
+}
+
+uint8_t *leaf_packed_keys(void *node){
+	return (uint8_t *)leaf_packed_restart(node,
+			leaf_packed_num_restarts(*leaf_node_num_cells(node)));
+}
+
+uint32_t leaf_packed_key_bytes(uint32_t num_cells, uint32_t key_bits){
+	return (num_cells * key_bits + 7) / 8;
+}
+
+uint32_t leaf_packed_key(void *node, uint32_t cell_num){
+	uint32_t key_base = *(uint32_t *)(node + LEAF_PACKED_KEY_BASE_OFFSET);
+	uint32_t key_bits = *(uint8_t *)(node + LEAF_PACKED_KEY_BITS_OFFSET);
+	uint32_t bit = cell_num * key_bits;
+	uint64_t word = 0;
+
+	if(key_bits == 0){
+		return key_base;
+	}
+	/* Only the bytes holding this key, so the read never runs off the page */
+	memcpy(&word, leaf_packed_keys(node) + bit / 8, (bit % 8 + key_bits + 7) / 8);
+	return key_base + (uint32_t)((word >> (bit % 8)) & ((1ULL << key_bits) - 1));
+}
+
+uint32_t leaf_node_key_at(void *node, uint32_t cell_num){
+	if(leaf_node_is_packed(node)){
+		return leaf_packed_key(node, cell_num);
+	}
+	return *leaf_node_key(node, cell_num);
+}
+
+uint32_t leaf_node_copy_keys(void *node, uint32_t *keys){
+/*
+ * Copy the keys of a leaf, in order, into keys and return how many there
+ * are. Packed keys are unpacked on the way.
+ */
+	uint32_t num_cells = *leaf_node_num_cells(node);
+
+	if(!leaf_node_is_packed(node)){
+		for(uint32_t i = 0; i < num_cells; i++){
+			keys[i] = *leaf_node_key(node, i);
+		}
+		return num_cells;
+	}
+
+	uint32_t key_base = *(uint32_t *)(node + LEAF_PACKED_KEY_BASE_OFFSET);
+	uint32_t key_bits = *(uint8_t *)(node + LEAF_PACKED_KEY_BITS_OFFSET);
+	uint64_t key_mask = (1ULL << key_bits) - 1;
+	uint8_t *packed = leaf_packed_keys(node);
+
+	for(uint32_t i = 0; i < num_cells; i++){
+		uint32_t bit = i * key_bits;
+		uint64_t word = 0;
+		memcpy(&word, packed + bit / 8, (bit % 8 + key_bits + 7) / 8);
+		keys[i] = key_base + (uint32_t)((word >> (bit % 8)) & key_mask);
+	}
+	return num_cells;
+}
+
+uint32_t leaf_packed_key_bits(uint32_t key_range){
+	return key_range == 0 ? 0 : 32 - __builtin_clz(key_range);
+}
+
+uint32_t leaf_packed_shared(const uint8_t *string, uint32_t length,
+		const uint8_t *prev, uint32_t prev_length, uint32_t *suffix){
+/*
+ * Length of the prefix string shares with prev, and in *suffix of the
+ * suffix the rest of them share.
+ */
+	uint32_t max_shared = length < prev_length ? length : prev_length;
+	uint32_t prefix = 0;
+
+	while(prefix < max_shared && string[prefix] == prev[prefix]){
+		prefix++;
+	}
+	*suffix = 0;
+	while(*suffix < max_shared - prefix &&
+			string[length - 1 - *suffix] == prev[prev_length - 1 - *suffix]){
+		(*suffix)++;
+	}
+	return prefix;
+}
+
+uint32_t leaf_packed_row_size(void *row, void *prev_row){
+/*
+ * Bytes the strings of serialized row take in a packed leaf, coded
+ * against prev_row, or stored whole if prev_row is NULL.
+ */
+	uint32_t size = 2 * LEAF_PACKED_STRING_HEADER_SIZE;
+	uint32_t offset = USERNAME_OFFSET, prev_offset = USERNAME_OFFSET;
+
+	for(uint32_t column = 0; column < 2; column++){
+		uint32_t length = *(uint8_t *)(row + USERNAME_LENGTH_OFFSET + column);
+		uint32_t prefix = 0, suffix = 0;
+
+		if(prev_row != NULL){
+			uint32_t prev_length = *(uint8_t *)(prev_row + USERNAME_LENGTH_OFFSET + column);
+			prefix = leaf_packed_shared(row + offset, length, prev_row + prev_offset,
+					prev_length, &suffix);
+			prev_offset += prev_length;
+		}
+		size += length - prefix - suffix;
+		offset += length;
+	}
+	return size;
+}
+
+void leaf_node_pack(void *node, uint8_t **rows, uint32_t num_rows){
+/*
+ * Write serialized rows, in key order, into node as a packed leaf.
+ * The caller has checked the result fits with leaf_packed_row_size.
+ */
+	uint32_t key_base = row_key_at(rows[0]);
+	uint32_t key_bits = leaf_packed_key_bits(row_key_at(rows[num_rows - 1]) - key_base);
+
+	*(uint8_t *)(node + LEAF_NODE_FORMAT_OFFSET) = LEAF_FORMAT_PACKED;
+	*leaf_node_num_cells(node) = num_rows;
+	*leaf_node_cell_content_start(node) = 0;
+	*(uint32_t *)(node + LEAF_PACKED_KEY_BASE_OFFSET) = key_base;
+	*(uint8_t *)(node + LEAF_PACKED_KEY_BITS_OFFSET) = key_bits;
+
+	uint8_t *keys = leaf_packed_keys(node);
+	memset(keys, 0, leaf_packed_key_bytes(num_rows, key_bits));
+	for(uint32_t i = 0; i < num_rows; i++){
+		uint64_t delta = row_key_at(rows[i]) - key_base;
+		uint32_t bit = i * key_bits;
+		for(uint32_t b = 0; b < key_bits; b++, bit++){
+			keys[bit / 8] |= ((delta >> b) & 1) << (bit % 8);
+		}
+	}
+
+	uint8_t *p = keys + leaf_packed_key_bytes(num_rows, key_bits);
+	for(uint32_t i = 0; i < num_rows; i++){
+		uint8_t *row = rows[i];
+		uint8_t *prev_row = (i % LEAF_PACKED_RESTART_INTERVAL) ? rows[i - 1] : NULL;
+		uint32_t offset = USERNAME_OFFSET, prev_offset = USERNAME_OFFSET;
+
+		if(prev_row == NULL){
+			*leaf_packed_restart(node, i / LEAF_PACKED_RESTART_INTERVAL) = p - (uint8_t *)node;
+		}
+		for(uint32_t column = 0; column < 2; column++){
+			uint32_t length = row[USERNAME_LENGTH_OFFSET + column];
+			uint32_t prefix = 0, suffix = 0;
+
+			if(prev_row != NULL){
+				uint32_t prev_length = prev_row[USERNAME_LENGTH_OFFSET + column];
+				prefix = leaf_packed_shared(row + offset, length, prev_row + prev_offset,
+						prev_length, &suffix);
+				prev_offset += prev_length;
+			}
+			*p++ = prefix;
+			*p++ = suffix;
+			*p++ = length - prefix - suffix;
+			memcpy(p, row + offset + prefix, length - prefix - suffix);
+			p += length - prefix - suffix;
+			offset += length;
+		}
+	}
+}
+
+uint32_t leaf_packed_decode(void *node, uint32_t cell_num, uint32_t offset, uint8_t *row){
+/*
+ * Decode the row at cell_num, whose strings start at offset, into row as
+ * a serialized row. row must hold the row before it unless cell_num is a
+ * restart. Returns the offset of the next row's strings.
+ */
+	uint8_t decoded[ROW_SIZE];
+	uint8_t *p = node + offset;
+	uint32_t out = USERNAME_OFFSET, prev_offset = USERNAME_OFFSET;
+
+	uint32_t key = leaf_packed_key(node, cell_num);
+	memcpy(decoded + ID_OFFSET, &key, ID_SIZE);
+	for(uint32_t column = 0; column < 2; column++){
+		uint32_t prefix = p[0], suffix = p[1], middle = p[2];
+		uint32_t prev_length = row[USERNAME_LENGTH_OFFSET + column];
+
+		memcpy(decoded + out, row + prev_offset, prefix);
+		memcpy(decoded + out + prefix, p + LEAF_PACKED_STRING_HEADER_SIZE, middle);
+		memcpy(decoded + out + prefix + middle, row + prev_offset + prev_length - suffix, suffix);
+		decoded[USERNAME_LENGTH_OFFSET + column] = prefix + middle + suffix;
+		p += LEAF_PACKED_STRING_HEADER_SIZE + middle;
+		out += prefix + middle + suffix;
+		prev_offset += prev_length;
+	}
+	memcpy(row, decoded, out);
+
+	return p - (uint8_t *)node;
+}
+
+
 /*------------------Internal node------------------*/
 uint32_t *internal_node_num_keys(void *node){
 	return node + INTERNAL_NODE_NUM_KEYS_OFFSET;	
@@ -235,8 +387,12 @@ uint32_t *internal_node_right_child(void *node){
 	return node + INTERNAL_NODE_RIGHT_CHILD_OFFSET;
 }
 
-uint32_t *internal_node_cell(void *node, uint32_t cell_num){
-	return node + INTERNAL_NODE_HEADER_SIZE + cell_num * INTERNAL_NODE_CELL_SIZE;
+uint32_t *internal_node_keys(void *node){
+	return node + INTERNAL_NODE_KEYS_OFFSET;
+}
+
+uint32_t *internal_node_children(void *node){
+	return node + INTERNAL_NODE_CHILDREN_OFFSET;
 }
 
 uint32_t *internal_node_child(void *node, uint32_t child_num){
@@ -247,12 +403,12 @@ uint32_t *internal_node_child(void *node, uint32_t child_num){
 	} else if(child_num == num_cells){
 		return internal_node_right_child(node);
 	} else{
-		return internal_node_cell(node, child_num);
+		return internal_node_children(node) + child_num;
 	}
 }
 
 uint32_t *internal_node_key(void *node, uint32_t child_num){
-	return (void*)internal_node_cell(node, child_num) + INTERNAL_NODE_CHILD_SIZE;
+	return internal_node_keys(node) + child_num;
 }
 
 void init_internal_node(void *node){
@@ -261,27 +417,26 @@ void init_internal_node(void *node){
 	set_node_root(node, false);
 }
 
-uint32_t get_node_max_key(void *node){
+uint32_t get_node_max_key(Pager *pager, void *node){
 /*
- * For an internal node, the maximum key is always its right key. For a leaf
- * node, it's key at the maximum index.
+ * For an internal node, the maximum key is the maximum key of its right
+ * child. For a leaf node, it's key at the maximum index.
  */
-	switch(get_node_type(node)){
-		case NODE_INTERNAL:
-			return *internal_node_key(node, *internal_node_num_keys(node)-1);
-		case NODE_LEAF:
-			return *leaf_node_key(node, *leaf_node_num_cells(node) - 1);
+	uint32_t right_child_page_num, max_key;
+
+	if(get_node_type(node) == NODE_INTERNAL){
+		right_child_page_num = *internal_node_right_child(node);
+		max_key = get_node_max_key(pager, get_page(pager, right_child_page_num));
+		unpin_page(pager, right_child_page_num);
+		return max_key;
 	}
+	return leaf_node_key_at(node, *leaf_node_num_cells(node) - 1);
 }
 
 uint32_t get_unused_page_num(Pager *pager){
 	return pager->num_pages;
 }
 
-#define LEAF_NODE_RIGHT_SPLIT_COUNT ((LEAF_NODE_MAX_CELLS + 1) / 2)
-#define LEAF_NODE_LEFT_SPLIT_COUNT \
-	((LEAF_NODE_MAX_CELLS + 1) - LEAF_NODE_RIGHT_SPLIT_COUNT)
-
 void create_new_root(Table *table, uint32_t right_child_page_num){
 /*
 	Handle splitting the root.
@@ -290,6 +445,7 @@ void create_new_root(Table *table, uint32_t right_child_page_num){
 	Re-initialize root page to contain the new root node.
 	New root node points to two children.
 */
+	STATS_ADD(STAT_ROOT_SPLITS, 1);
 	void *root = get_page(table->pager, table->root_page_num);
 	void *right_child = get_page(table->pager, right_child_page_num);
 	uint32_t left_child_page_num = get_unused_page_num(table->pager);
@@ -298,129 +454,370 @@ void create_new_root(Table *table, uint32_t right_child_page_num){
 	memcpy(left_child, root, PAGE_SIZE);
 	set_node_root(left_child, false);
 
+	if(get_node_type(left_child) == NODE_INTERNAL){
+		/* The children of the old root now hang off the left child */
+		for(uint32_t i = 0; i <= *internal_node_num_keys(left_child); i++){
+			uint32_t child_page_num = *internal_node_child(left_child, i);
+			*node_parent(get_page(table->pager, child_page_num)) = left_child_page_num;
+			mark_page_dirty(table->pager, child_page_num);
+			unpin_page(table->pager, child_page_num);
+		}
+	}
+
 	/* Root node is a new internal node with one key and two children */
 	init_internal_node(root);
 	set_node_root(root, true);
 	*internal_node_num_keys(root) = 1;
 	*internal_node_child(root, 0) = left_child_page_num;
-	uint32_t left_child_max_key = get_node_max_key(left_child);
+	uint32_t left_child_max_key = get_node_max_key(table->pager, left_child);
 	*internal_node_key(root, 0) = left_child_max_key;
 	*internal_node_right_child(root) = right_child_page_num;
 	*node_parent(left_child) = table->root_page_num;
 	*node_parent(right_child) = table->root_page_num;
 
 	// print_tree(table->pager, 0, 0);
+	mark_page_dirty(table->pager, table->root_page_num);
+	mark_page_dirty(table->pager, right_child_page_num);
+	mark_page_dirty(table->pager, left_child_page_num);
+	unpin_page(table->pager, table->root_page_num);
+	unpin_page(table->pager, right_child_page_num);
+	unpin_page(table->pager, left_child_page_num);
+}
+
+void leaf_node_link_split(Table *table, uint32_t old_page_num, uint32_t new_page_num){
+/*
+ * Hook a leaf split off the right of old into the tree: old's key in the
+ * parent drops to its new max and new is added after it, or a new root is
+ * created above them.
+ */
+	void *old_node = get_page(table->pager, old_page_num);
+	bool old_is_root = is_node_root(old_node);
+	uint32_t parent_page_num = *node_parent(old_node);
+	uint32_t new_max = get_node_max_key(table->pager, old_node);
+	unpin_page(table->pager, old_page_num);
+
+	if(old_is_root){
+		create_new_root(table, new_page_num);
+	} else{
+		void *parent = get_page(table->pager, parent_page_num);
+
+		update_internal_node_key(parent, old_page_num, new_max);
+		mark_page_dirty(table->pager, parent_page_num);
+		unpin_page(table->pager, parent_page_num);
+		internal_node_insert(table, parent_page_num, old_page_num, new_page_num);
+	}
 }
 
-void leaf_node_split_and_insert(Cursor *cursor, uint32_t key, Row *value){
+void leaf_node_split_and_insert(Cursor *cursor, void *cell, uint32_t cell_size){
 /*
    Create a new node and move half the cells over.
    Insert the new value in one of the two nodes.
    Update parent or create a new parent.
 */
+	STATS_ADD(STAT_LEAF_SPLITS, 1);
 	void *old_node = get_page(cursor->table->pager, cursor->page_num);
-	uint32_t old_max = get_node_max_key(old_node);
 	uint32_t new_page_num = get_unused_page_num(cursor->table->pager);
 	void *new_node = get_page(cursor->table->pager, new_page_num);
 	init_leaf_node(new_node);
 	*node_parent(new_node) = *node_parent(old_node);
 	*leaf_node_next_leaf(new_node) = *leaf_node_next_leaf(old_node);
-	*leaf_node_next_leaf(old_node) = new_page_num;
 
 /*
-   All existing keys plus new key should be divided
-   evenly between old (left) and new (right) nodes.
-   Starting from the right, move each key to correct position.
+   All existing cells plus the new one are divided between old (left) and
+   new (right) nodes by size: the left node takes cells in key order until
+   it holds half of the bytes, or RIGHT_EDGE_SPLIT_PERCENT of them when the
+   new key is appended to the rightmost leaf. The old node is rebuilt from
+   a copy.
 */
-	for(int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--){
-		void *dest_node;
-		if(i >= LEAF_NODE_LEFT_SPLIT_COUNT){
-			dest_node = new_node;
-		} else{
-			dest_node = old_node;
-		}
-		uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
-		void *dest = leaf_node_cell(dest_node, index_within_node);
+	Arena *arena = arena_thread();
+	ArenaMark mark = arena_mark(arena);
+	void *old_copy = arena_alloc(arena, PAGE_SIZE);
+	memcpy(old_copy, old_node, PAGE_SIZE);
+
+	uint32_t total_cells = *leaf_node_num_cells(old_copy) + 1;
+	uint32_t total_bytes = (PAGE_SIZE - *leaf_node_cell_content_start(old_copy)) +
+		cell_size + total_cells * LEAF_NODE_SLOT_SIZE;
+	uint32_t left_target = total_bytes / 2;
+
+	if(*leaf_node_next_leaf(old_copy) == 0 && cursor->cell_num == total_cells - 1){
+		left_target = (uint64_t)total_bytes * RIGHT_EDGE_SPLIT_PERCENT / 100;
+		cursor->table->rightmost_leaf = new_page_num;
+	}
+
+	bool is_root = is_node_root(old_node);
+	init_leaf_node(old_node);
+	set_node_root(old_node, is_root);
+	*leaf_node_next_leaf(old_node) = new_page_num;
 
+	uint32_t left_bytes = 0;
+	for(uint32_t i = 0; i < total_cells; i++){
+		void *next_cell;
 		if(i == cursor->cell_num){
-			 serialize_row(value, leaf_node_value(dest_node, index_within_node));
-			 *leaf_node_key(dest_node, index_within_node) = key;
+			next_cell = cell;
 		} else if(i > cursor->cell_num){
-			memcpy(dest, leaf_node_cell(old_node, i-1), LEAF_NODE_CELL_SIZE);
+			next_cell = leaf_node_cell(old_copy, i - 1);
+		} else{
+			next_cell = leaf_node_cell(old_copy, i);
+		}
+		uint32_t next_cell_size = row_size_at(next_cell);
+
+		if(left_bytes < left_target && i < total_cells - 1){
+			leaf_node_append_cell(old_node, next_cell, next_cell_size);
+			left_bytes += next_cell_size + LEAF_NODE_SLOT_SIZE;
 		} else{
-			memcpy(dest, leaf_node_cell(old_node, i), LEAF_NODE_CELL_SIZE);
+			leaf_node_append_cell(new_node, next_cell, next_cell_size);
 		}
 	}
+	arena_release(arena, mark);
 
-	*(leaf_node_num_cells(old_node)) = LEAF_NODE_LEFT_SPLIT_COUNT;
-	*(leaf_node_num_cells(new_node)) = LEAF_NODE_RIGHT_SPLIT_COUNT;
+	mark_page_dirty(cursor->table->pager, cursor->page_num);
+	mark_page_dirty(cursor->table->pager, new_page_num);
+	unpin_page(cursor->table->pager, cursor->page_num);
+	unpin_page(cursor->table->pager, new_page_num);
 
-	print_tree(cursor->table->pager, 1, 0);
-	print_tree(cursor->table->pager, 2, 0);
+	leaf_node_link_split(cursor->table, cursor->page_num, new_page_num);
+}
 
-	if(is_node_root(old_node)){
-		return create_new_root(cursor->table, new_page_num);
-	} else{
-		uint32_t parent_page_num = *node_parent(old_node);
-		uint32_t new_max = get_node_max_key(old_node);
-		void *parent = get_page(cursor->table->pager, parent_page_num);
+void leaf_node_insert_cell(void *node, uint32_t cell_num, void *cell, uint32_t cell_size){
+/*
+ * Insert cell as cell cell_num of a leaf that has room for it.
+ */
+	*leaf_node_cell_content_start(node) -= cell_size;
+	memcpy(node + *leaf_node_cell_content_start(node), cell, cell_size);
+	leaf_node_insert_slot(node, cell_num, row_key_at(cell),
+			*leaf_node_cell_content_start(node));
+}
 
-		update_internal_node_key(parent, old_max, new_max);
-		internal_node_insert(cursor->table, parent_page_num, new_page_num);
-		return;
+void leaf_node_fill(void *node, uint8_t *rows, uint32_t first, uint32_t last){
+/*
+ * Make node a slotted leaf holding rows[first, last), each in a
+ * ROW_SIZE slot. The parent pointer is kept, the rest of the header is
+ * reset.
+ */
+	init_leaf_node(node);
+	for(uint32_t i = first; i < last; i++){
+		leaf_node_append_cell(node, rows + i * ROW_SIZE, row_size_at(rows + i * ROW_SIZE));
+	}
+}
+
+void leaf_node_unpack(Table *table, uint32_t page_num){
+/*
+ * Turn a packed leaf back into slotted leaves before it is changed. The
+ * rows are spread over as many leaves as they need at
+ * RIGHT_EDGE_SPLIT_PERCENT full. The tail is split off one leaf at a time,
+ * right to left, each step hooked in like an ordinary split, so the page
+ * keeps the first rows and its place in the tree.
+ */
+	Pager *pager = table->pager;
+	void *node = get_page(pager, page_num);
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	Arena *arena = arena_thread();
+	ArenaMark mark = arena_mark(arena);
+	uint8_t *rows = (uint8_t *)arena_alloc(arena, num_cells * ROW_SIZE);
+	uint32_t *chunks = (uint32_t *)arena_alloc(arena, (num_cells + 1) * sizeof(uint32_t));
+	uint32_t offset = *leaf_packed_restart(node, 0);
+	uint32_t total_bytes = 0;
+	uint8_t row[ROW_SIZE];
+
+	for(uint32_t i = 0; i < num_cells; i++){
+		offset = leaf_packed_decode(node, i, offset, row);
+		memcpy(rows + i * ROW_SIZE, row, row_size_at(row));
+		total_bytes += row_size_at(row) + LEAF_NODE_SLOT_SIZE;
+	}
+	uint32_t next_leaf = *leaf_node_next_leaf(node);
+	unpin_page(pager, page_num);
+
+	uint32_t per_leaf = LEAF_NODE_SPACE_FOR_CELLS * RIGHT_EDGE_SPLIT_PERCENT / 100;
+	uint32_t num_leaves = (total_bytes + per_leaf - 1) / per_leaf;
+	uint32_t target = (total_bytes + num_leaves - 1) / num_leaves;
+	uint32_t num_chunks = 0, chunk_bytes = 0;
+
+	chunks[num_chunks++] = 0;
+	for(uint32_t i = 0; i < num_cells; i++){
+		chunk_bytes += row_size_at(rows + i * ROW_SIZE) + LEAF_NODE_SLOT_SIZE;
+		if(chunk_bytes >= target && i + 1 < num_cells){
+			chunks[num_chunks++] = i + 1;
+			chunk_bytes = 0;
+		}
+	}
+	chunks[num_chunks] = num_cells;
+
+	for(uint32_t j = num_chunks - 1; j >= 1; j--){
+		uint32_t new_page_num = get_unused_page_num(pager);
+		void *old_node = get_page(pager, page_num);
+		void *new_node = get_page(pager, new_page_num);
+		bool is_root = is_node_root(old_node);
+
+		leaf_node_fill(new_node, rows, chunks[j], chunks[j + 1]);
+		*node_parent(new_node) = *node_parent(old_node);
+		*leaf_node_next_leaf(new_node) = next_leaf;
+		leaf_node_fill(old_node, rows, chunks[j - 1], chunks[j]);
+		set_node_root(old_node, is_root);
+		*leaf_node_next_leaf(old_node) = new_page_num;
+		next_leaf = new_page_num;
+
+		mark_page_dirty(pager, page_num);
+		mark_page_dirty(pager, new_page_num);
+		unpin_page(pager, page_num);
+		unpin_page(pager, new_page_num);
+		leaf_node_link_split(table, page_num, new_page_num);
+
+		if(is_root){
+			/* The rows moved to the left child of the new root */
+			void *root = get_page(pager, page_num);
+			uint32_t left_child_page_num = *internal_node_child(root, 0);
+			unpin_page(pager, page_num);
+			page_num = left_child_page_num;
+		}
+	}
+
+	if(num_chunks == 1){
+		node = get_page(pager, page_num);
+		bool is_root = is_node_root(node);
+		leaf_node_fill(node, rows, 0, num_cells);
+		set_node_root(node, is_root);
+		*leaf_node_next_leaf(node) = next_leaf;
+		mark_page_dirty(pager, page_num);
+		unpin_page(pager, page_num);
 	}
+
+	arena_release(arena, mark);
 }
 
-void leaf_node_insert(Cursor *cursor, uint32_t key, Row *value){
+void leaf_node_insert(Cursor *cursor, void *cell, uint32_t cell_size){
 	void *node = get_page(cursor->table->pager, cursor->page_num);
 
-	uint32_t num_cells = *leaf_node_num_cells(node);
+	if(leaf_node_is_packed(node)){
+		unpin_page(cursor->table->pager, cursor->page_num);
+		leaf_node_unpack(cursor->table, cursor->page_num);
+
+		Cursor *slotted = table_find(cursor->table, row_key_at(cell));
+		leaf_node_insert(slotted, cell, cell_size);
+		cursor_close(slotted);
+		return;
+	}
 
-	if(num_cells >= LEAF_NODE_MAX_CELLS){
+	if(leaf_node_free_space(node) < cell_size + LEAF_NODE_SLOT_SIZE){
 		// Node full
-		leaf_node_split_and_insert(cursor, key, value);
+		unpin_page(cursor->table->pager, cursor->page_num);
+		leaf_node_split_and_insert(cursor, cell, cell_size);
 		return;
 	}
 
-	if(cursor->cell_num < num_cells){
-		// Make room for new cell
-		for(uint32_t i = num_cells; i > cursor->cell_num; i--){
-			memcpy(leaf_node_cell(node, i), leaf_node_cell(node, i-1), 
-					LEAF_NODE_CELL_SIZE);
-		}
+	leaf_node_insert_cell(node, cursor->cell_num, cell, cell_size);
+	mark_page_dirty(cursor->table->pager, cursor->page_num);
+	unpin_page(cursor->table->pager, cursor->page_num);
+}
+
+uint32_t node_keys_count_below(const uint32_t *keys, uint32_t num_keys, uint32_t key){
+/*
+ * How many of keys are below key, compared all at once. Unsigned keys are
+ * biased by 2^31 for the signed SIMD compare, as in scan_filter_keys.
+ */
+	uint32_t i = 0, count = 0;
+
+#if defined(__AVX2__)
+	__m256i bias = _mm256_set1_epi32(INT32_MIN);
+	__m256i target = _mm256_set1_epi32((int32_t)(key ^ 0x80000000U));
+	for(; i + 8 <= num_keys; i += 8){
+		__m256i k = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + i)), bias);
+		count += __builtin_popcount(_mm256_movemask_ps(
+				_mm256_castsi256_ps(_mm256_cmpgt_epi32(target, k))));
+	}
+#elif defined(__SSE2__)
+	__m128i bias = _mm_set1_epi32(INT32_MIN);
+	__m128i target = _mm_set1_epi32((int32_t)(key ^ 0x80000000U));
+	for(; i + 4 <= num_keys; i += 4){
+		__m128i k = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys + i)), bias);
+		count += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(k, target))));
+	}
+#endif
+	for(; i < num_keys; i++){
+		count += keys[i] < key;
+	}
+	return count;
+}
+
+uint32_t node_keys_lower_bound(const uint32_t *keys, uint32_t num_keys, uint32_t key){
+/*
+ * Index of the first of the sorted keys that is >= key, num_keys if none.
+ * Each halving step keeps the half that holds the answer with a
+ * conditional move instead of a branch, so a search costs the same
+ * whatever the keys are. The last NODE_SEARCH_LINEAR_KEYS are counted.
+ */
+	const uint32_t *base = keys;
+	uint32_t n = num_keys;
+
+	while(n > NODE_SEARCH_LINEAR_KEYS){
+		uint32_t half = n / 2;
+		base = base[half] < key ? base + half : base;
+		n -= half;
+	}
+	return (base - keys) + node_keys_count_below(base, n, key);
+}
+
+uint32_t leaf_packed_lower_bound(void *node, uint32_t key){
+	uint32_t base = 0;
+	uint32_t n = *leaf_node_num_cells(node);
+
+	while(n > 1){
+		uint32_t half = n / 2;
+		base = leaf_packed_key(node, base + half) < key ? base + half : base;
+		n -= half;
+	}
+	return base + (n == 1 && leaf_packed_key(node, base) < key);
+}
+
+uint32_t leaf_node_lower_bound(void *node, uint32_t key){
+	if(leaf_node_is_packed(node)){
+		return leaf_packed_lower_bound(node, key);
+	}
+	return node_keys_lower_bound(leaf_node_keys(node), *leaf_node_num_cells(node), key);
+}
+
+void leaf_node_read_row(void *node, uint32_t cell_num, Row *row){
+/*
+ * Read the row at cell_num of a leaf in either format. Works on any copy
+ * of the page, it needs no cursor.
+ */
+	if(!leaf_node_is_packed(node)){
+		deserialize_row(leaf_node_value(node, cell_num), row);
+		return;
 	}
 
-	*(leaf_node_num_cells(node)) += 1;
-	*(leaf_node_key(node, cursor->cell_num)) = key;
-	serialize_row(value, leaf_node_value(node, cursor->cell_num));
+	uint8_t decoded[ROW_SIZE];
+	uint32_t first = cell_num - cell_num % LEAF_PACKED_RESTART_INTERVAL;
+	uint32_t offset = *leaf_packed_restart(node, first / LEAF_PACKED_RESTART_INTERVAL);
+	for(uint32_t i = first; i <= cell_num; i++){
+		offset = leaf_packed_decode(node, i, offset, decoded);
+	}
+	deserialize_row(decoded, row);
 }
 
 Cursor *leaf_node_find(Table *table, uint32_t page_num, uint32_t key){
 	void *node = get_page(table->pager, page_num);
 	uint32_t num_cells = *leaf_node_num_cells(node);
 
-	Cursor *cursor = (Cursor *)malloc(sizeof(*cursor));
+	Arena *arena = arena_thread();
+	ArenaMark mark = arena_mark(arena);
+	Cursor *cursor = (Cursor *)arena_alloc(arena, sizeof(*cursor));
+	cursor->mark = mark;
 	cursor->table = table;
 	cursor->page_num = page_num;
-
-	// Binary search
-	uint32_t min_index = 0;
-	uint32_t one_past_max_index = num_cells;
-	while(one_past_max_index != min_index){
-		uint32_t index = (min_index + one_past_max_index) / 2;
-		uint32_t key_at_index = *leaf_node_key(node, index);
-		if(key == key_at_index){
-			cursor->cell_num = index;
-			return cursor;
-		} 
-		if(key < key_at_index){
-			one_past_max_index = index;
-		} else{
-			min_index = index + 1;
-		}
+	cursor->cell_num = leaf_node_lower_bound(node, key);
+	/* One past the last cell is only the end if no leaf follows, see table_seek */
+	cursor->end_of_table = cursor->cell_num >= num_cells && *leaf_node_next_leaf(node) == 0;
+	cursor->pinned_page_num = INVALID_PAGE_NUM;
+	cursor->pinned = NULL;
+	cursor->decoded_page_num = INVALID_PAGE_NUM;
+	cursor->decoded_cell_num = 0;
+	cursor->decoded_next_offset = 0;
+
+	if(*leaf_node_next_leaf(node) == 0){
+		table->rightmost_leaf = page_num;
 	}
 
-	cursor->cell_num = min_index;
+	unpin_page(table->pager, page_num);
 	return cursor;
 }
 
@@ -428,22 +825,8 @@ uint32_t internal_node_find_child(void *node, uint32_t key) {
 	/*
 	Return the index of the child which should contain the given key.
 	*/
-	uint32_t num_keys = *internal_node_num_keys(node);
-
-	/* Binary search to find index of child to search  */
-	uint32_t min_index = 0;
-	uint32_t max_index = num_keys;
-	while(min_index != max_index){
-		uint32_t index = (min_index + max_index) / 2;
-		uint32_t key_to_right = *internal_node_key(node, index);
-		if(key_to_right >= key){
-			max_index = index;
-		} else{
-			min_index = index + 1;
-		}
-	}
-
-	return min_index;
+	/* The first child whose key, its largest, is >= key */
+	return node_keys_lower_bound(internal_node_keys(node), *internal_node_num_keys(node), key);
 }
 
 Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key){
@@ -452,424 +835,5997 @@ Cursor *internal_node_find(Table *table, uint32_t page_num, uint32_t key){
 	uint32_t child_index = internal_node_find_child(node, key);
 	uint32_t child_num = *internal_node_child(node, child_index);
 	void *child = get_page(table->pager, child_num);
-	switch(get_node_type(child)){
-		case NODE_INTERNAL:
-			return internal_node_find(table, child_num, key);
-		case NODE_LEAF:
-			return leaf_node_find(table, child_num, key);
+	NodeType child_type = get_node_type(child);
+	unpin_page(table->pager, page_num);
+	unpin_page(table->pager, child_num);
+
+	if(child_type == NODE_INTERNAL){
+		return internal_node_find(table, child_num, key);
+	}
+	return leaf_node_find(table, child_num, key);
+}
+
+void internal_node_fill(void *node, uint32_t *children, uint32_t *keys,
+		uint32_t count){
+	/* The last child becomes the right child and its key is dropped */
+	*internal_node_num_keys(node) = count - 1;
+	for(uint32_t i = 0; i < count - 1; i++){
+		*internal_node_child(node, i) = children[i];
+		*internal_node_key(node, i) = keys[i];
+	}
+	*internal_node_right_child(node) = children[count - 1];
+}
+
+bool internal_node_is_rightmost(Pager *pager, uint32_t page_num){
+/*
+ * True if every node from page_num up to the root is its parent's right
+ * child.
+ */
+	void *node = get_page(pager, page_num);
+
+	while(!is_node_root(node)){
+		uint32_t parent_page_num = *node_parent(node);
+		void *parent = get_page(pager, parent_page_num);
+		bool is_right_child = *internal_node_right_child(parent) == page_num;
+
+		unpin_page(pager, page_num);
+		page_num = parent_page_num;
+		node = parent;
+		if(!is_right_child){
+			unpin_page(pager, page_num);
+			return false;
+		}
+	}
+	unpin_page(pager, page_num);
+
+	return true;
+}
+
+void internal_node_split_and_insert(Table *table, uint32_t parent_page_num,
+		uint32_t left_index, uint32_t child_page_num, uint32_t child_max_key){
+/*
+	Split a full internal node.
+	Its children plus the new one, which goes right after child
+	left_index, are divided evenly between the old (left) node and a new
+	(right) node. Children that move get their parent pointer updated.
+	The new node is then inserted into the grandparent, which may split in
+	turn, or a new root is created.
+*/
+	STATS_ADD(STAT_INTERNAL_SPLITS, 1);
+	Pager *pager = table->pager;
+	void *old_node = get_page(pager, parent_page_num);
+	uint32_t num_keys = *internal_node_num_keys(old_node);
+	uint32_t right_child_page_num = *internal_node_right_child(old_node);
+	uint32_t right_max = get_node_max_key(pager, old_node);
+
+	uint32_t children[INTERNAL_NODE_MAX_CELLS + 2];
+	uint32_t keys[INTERNAL_NODE_MAX_CELLS + 2];
+	uint32_t total = 0;
+	for(uint32_t i = 0; i <= num_keys; i++){
+		children[total] = (i < num_keys) ? *internal_node_child(old_node, i) :
+			right_child_page_num;
+		keys[total++] = (i < num_keys) ? *internal_node_key(old_node, i) : right_max;
+
+		if(i == left_index){
+			children[total] = child_page_num;
+			keys[total++] = child_max_key;
+		}
+	}
+	bool is_append = left_index == num_keys;
+
+	uint32_t left_count = total / 2;
+	if(is_append && internal_node_is_rightmost(pager, parent_page_num)){
+		left_count = total * RIGHT_EDGE_SPLIT_PERCENT / 100;
+	}
+
+	uint32_t new_page_num = get_unused_page_num(pager);
+	void *new_node = get_page(pager, new_page_num);
+	bool is_root = is_node_root(old_node);
+	uint32_t grandparent_page_num = *node_parent(old_node);
+
+	init_internal_node(old_node);
+	set_node_root(old_node, is_root);
+	internal_node_fill(old_node, children, keys, left_count);
+
+	init_internal_node(new_node);
+	*node_parent(new_node) = grandparent_page_num;
+	internal_node_fill(new_node, children + left_count, keys + left_count,
+			total - left_count);
+
+	for(uint32_t i = 0; i < total; i++){
+		uint32_t parent = (i < left_count) ? parent_page_num : new_page_num;
+		void *child = get_page(pager, children[i]);
+		if(*node_parent(child) != parent){
+			*node_parent(child) = parent;
+			mark_page_dirty(pager, children[i]);
+		}
+		unpin_page(pager, children[i]);
+	}
+
+	mark_page_dirty(pager, parent_page_num);
+	mark_page_dirty(pager, new_page_num);
+	unpin_page(pager, parent_page_num);
+	unpin_page(pager, new_page_num);
+
+	if(is_root){
+		create_new_root(table, new_page_num);
+	} else{
+		void *grandparent = get_page(pager, grandparent_page_num);
+
+		update_internal_node_key(grandparent, parent_page_num, keys[left_count - 1]);
+		mark_page_dirty(pager, grandparent_page_num);
+		unpin_page(pager, grandparent_page_num);
+		internal_node_insert(table, grandparent_page_num, parent_page_num, new_page_num);
+	}
+}
+
+uint32_t internal_node_child_index(void *node, uint32_t child_page_num){
+/*
+ * Position of a child in node, num_keys for the right child. Children are
+ * told apart by page rather than by key, since in an index several of
+ * them can end with the same key.
+ */
+	uint32_t num_keys = *internal_node_num_keys(node);
+
+	for(uint32_t i = 0; i < num_keys; i++){
+		if(*internal_node_child(node, i) == child_page_num){
+			return i;
+		}
 	}
+	return num_keys;
 }
 
 void internal_node_insert(Table *table, uint32_t parent_page_num, 
-		uint32_t child_page_num) {
+		uint32_t left_page_num, uint32_t child_page_num) {
 	/*
-	Add a new child/key pair to parent that corresponds to child
+	Add a new child/key pair to parent that corresponds to child, right
+	after left, the node it was split from
 	*/
 	void *parent = get_page(table->pager, parent_page_num);
 	void *child = get_page(table->pager, child_page_num);
-	uint32_t child_max_key = get_node_max_key(child);
-	uint32_t index = internal_node_find_child(parent, child_max_key);
+	uint32_t child_max_key = get_node_max_key(table->pager, child);
+	unpin_page(table->pager, child_page_num);
+	uint32_t left_index = internal_node_child_index(parent, left_page_num);
+	uint32_t index = left_index + 1;
 
 	uint32_t originnal_num_keys = *internal_node_num_keys(parent);
-	*internal_node_num_keys(parent) = originnal_num_keys + 1;
 
 	if (originnal_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-		printf("Need to implement splitting internal node\n");
-		exit(EXIT_FAILURE);
+		unpin_page(table->pager, parent_page_num);
+		internal_node_split_and_insert(table, parent_page_num, left_index, child_page_num,
+				child_max_key);
+		return;
 	}
 
+	*internal_node_num_keys(parent) = originnal_num_keys + 1;
+
 	uint32_t right_child_page_num = *internal_node_right_child(parent);
 	void *right_child = get_page(table->pager, right_child_page_num);
+	uint32_t right_child_max_key = get_node_max_key(table->pager, right_child);
+	unpin_page(table->pager, right_child_page_num);
 
-	if (child_max_key > get_node_max_key(right_child)) {
+	if (left_index == originnal_num_keys) {
 		/* 这种情况是分裂的child就是当前parent的最右节点 */
 		*internal_node_child(parent, originnal_num_keys) = right_child_page_num;
-		*internal_node_key(parent, right_child_page_num) = get_node_max_key(right_child);
+		*internal_node_key(parent, originnal_num_keys) = right_child_max_key;
 		*internal_node_right_child(parent) = child_page_num;
 	} else {
 		/* 分裂的是中间节点，需要把后面的往后移 */
-		for (uint32_t i = originnal_num_keys; i > index; i--) {
-			void *dst = internal_node_cell(parent, i);
-			void *src = internal_node_cell(parent, i-1);
-			memcpy(dst, src, INTERNAL_NODE_CELL_SIZE);
-		}
+		memmove(internal_node_keys(parent) + index + 1, internal_node_keys(parent) + index,
+				(originnal_num_keys - index) * INTERNAL_NODE_KEY_SIZE);
+		memmove(internal_node_children(parent) + index + 1, internal_node_children(parent) + index,
+				(originnal_num_keys - index) * INTERNAL_NODE_CHILD_SIZE);
 		*internal_node_key(parent, index) = child_max_key;
 		*internal_node_child(parent, index) = child_page_num;
 	}
+	mark_page_dirty(table->pager, parent_page_num);
+	unpin_page(table->pager, parent_page_num);
 }
 
-void update_internal_node_key(void *node, uint32_t old_key, uint32_t new_key) {
-	uint32_t old_child_index = internal_node_find_child(node, old_key);
-	*internal_node_key(node, old_child_index) = new_key;
+void update_internal_node_key(void *node, uint32_t child_page_num, uint32_t new_key) {
+	uint32_t old_child_index = internal_node_child_index(node, child_page_num);
+
+	/* The right child has no key of its own */
+	if(old_child_index < *internal_node_num_keys(node)){
+		*internal_node_key(node, old_child_index) = new_key;
+	}
 }
 
-Cursor *table_find(Table *table, uint32_t key){
-	uint32_t root_page_num = table->root_page_num;
-	void *root_node = get_page(table->pager, root_page_num);
+Cursor *table_find_rightmost(Table *table, uint32_t key){
+/*
+ * Fast path for increasing keys. A key above every key in the rightmost
+ * leaf goes at its end, so there is no need to descend from the root. The
+ * cached page is only trusted if it is still a leaf with no next leaf.
+ */
+	uint32_t page_num = table->rightmost_leaf;
 
-	if(get_node_type(root_node) == NODE_LEAF){
-		return leaf_node_find(table, root_page_num, key);
-	} else{
-		return internal_node_find(table, root_page_num, key);
+	if(page_num == INVALID_PAGE_NUM){
+		return NULL;
 	}
-}
 
-/*----------------------Pager----------------------------------*/
-void *get_page(Pager *pager, uint32_t page_num){
-	if(page_num > TABLE_MAX_PAGES){
-		printf("Tried to fetch page number out of bounds. %d > %d\n", page_num,
-				TABLE_MAX_PAGES);
-		exit(EXIT_FAILURE);
+	void *node = get_page(table->pager, page_num);
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	bool is_append = get_node_type(node) == NODE_LEAF &&
+		*leaf_node_next_leaf(node) == 0 && num_cells > 0 &&
+		key > leaf_node_key_at(node, num_cells - 1);
+	unpin_page(table->pager, page_num);
+
+	if(!is_append){
+		return NULL;
 	}
 
-	if(pager->pages[page_num] == NULL){
-		void *page = malloc(PAGE_SIZE);
-		uint32_t num_pages = pager->file_length / PAGE_SIZE;
+	Arena *arena = arena_thread();
+	ArenaMark mark = arena_mark(arena);
+	Cursor *cursor = (Cursor *)arena_alloc(arena, sizeof(*cursor));
+	cursor->mark = mark;
+	cursor->table = table;
+	cursor->page_num = page_num;
+	cursor->cell_num = num_cells;
+	cursor->end_of_table = true;
+	cursor->pinned_page_num = INVALID_PAGE_NUM;
+	cursor->pinned = NULL;
+	cursor->decoded_page_num = INVALID_PAGE_NUM;
+	cursor->decoded_cell_num = 0;
+	cursor->decoded_next_offset = 0;
 
-		if(pager->file_length % PAGE_SIZE){
-			num_pages += 1;
-		}
+	return cursor;
+}
 
-		if(page_num <= num_pages){
-			lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-			ssize_t bytes_read = read(pager->file_descriptor, page, PAGE_SIZE);
-			if(bytes_read == -1){
-				printf("Error reading file: %d\n", errno);
-				exit(EXIT_FAILURE);
-			}
-		}
+Cursor *table_find(Table *table, uint32_t key){
+/*
+ * The cursor comes from the calling thread's arena and must be closed
+ * with cursor_close on the same thread, or left to the next reset.
+ */
+	STATS_TIME_START(started);
+	Cursor *cursor = table_find_rightmost(table, key);
 
-		pager->pages[page_num] = page;
+	if(cursor == NULL){
+		uint32_t root_page_num = table->root_page_num;
+		void *root_node = get_page(table->pager, root_page_num);
+		NodeType root_type = get_node_type(root_node);
+		unpin_page(table->pager, root_page_num);
 
-		if(page_num >= pager->num_pages){
-			pager->num_pages = page_num + 1;
+		if(root_type == NODE_LEAF){
+			cursor = leaf_node_find(table, root_page_num, key);
+		} else{
+			cursor = internal_node_find(table, root_page_num, key);
 		}
 	}
+	STATS_TIME_END(TIMER_FIND, started);
 
-	return pager->pages[page_num];
+	return cursor;
 }
 
-Pager *pager_open(const char *filename){
-	int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+/*
+ * Threads sharing a table go through table_get, table_insert, batches and
+ * scans. Readers are optimistic: they take no latches and write nothing
+ * shared, they note each page's version, read it, and start over if the
+ * version changed or was odd, meaning a writer had the page. A reader
+ * that keeps losing to the writer crabs down with shared latches instead.
+ * Writers are serialized by writer_lock, so a writer finds its path
+ * without latches and then latches exclusive only the pages the insert
+ * may change: the leaf and every node above it up to the lowest safe one,
+ * one that the insert cannot split. Exclusive latches bump the versions.
+ * Cursors and table_find take no latches and are for a single thread.
+ */
+bool node_is_safe(void *node, uint32_t cell_size){
+	if(get_node_type(node) == NODE_INTERNAL){
+		return *internal_node_num_keys(node) < INTERNAL_NODE_MAX_CELLS;
+	}
+	/* Writing a packed leaf unpacks it, which may split it several ways */
+	return !leaf_node_is_packed(node) &&
+		leaf_node_free_space(node) >= cell_size + LEAF_NODE_SLOT_SIZE;
+}
 
+uint32_t table_latch_leaf(Table *table, uint32_t key){
+/*
+ * Returns the leaf for key, pinned and latched shared.
+ */
+	Pager *pager = table->pager;
+	uint32_t page_num = table->root_page_num;
+	void *node = get_page(pager, page_num);
+	latch_page(pager, page_num, false);
+
+	while(get_node_type(node) == NODE_INTERNAL){
+		uint32_t child_page_num = *internal_node_child(node, internal_node_find_child(node, key));
+		void *child = get_page(pager, child_page_num);
+		latch_page(pager, child_page_num, false);
+		unlatch_page(pager, page_num);
+		unpin_page(pager, page_num);
+		page_num = child_page_num;
+		node = child;
+	}
+
+	return page_num;
+}
+
+void table_unlatch_path(Pager *pager, uint32_t *path, uint32_t depth){
+	for(uint32_t i = 0; i < depth; i++){
+		unlatch_page(pager, path[i]);
+		unpin_page(pager, path[i]);
+	}
+}
+
+void *table_descend_optimistic(Table *table, uint32_t key, uint32_t *page_num,
+		uint64_t *version){
+/*
+ * Find the leaf for key without latches. Returns it pinned, with its page
+ * number and the version it had when it was reached, or NULL if a writer
+ * got in the way. Nothing read from a node is used before its version is
+ * checked, so a node read half way through a change can at worst point
+ * at the wrong child, and the check catches that before it is followed.
+ */
+	Pager *pager = table->pager;
+	uint32_t node_page_num = table->root_page_num;
+	void *node = get_page(pager, node_page_num);
+	uint64_t node_version = page_version(pager, node_page_num);
+
+	while(get_node_type(node) == NODE_INTERNAL){
+		uint32_t num_keys = *internal_node_num_keys(node);
+		if(num_keys > INTERNAL_NODE_MAX_CELLS){
+			num_keys = INTERNAL_NODE_MAX_CELLS;
+		}
+		uint32_t index = node_keys_lower_bound(internal_node_keys(node), num_keys, key);
+		uint32_t child_page_num = index < num_keys ?
+			internal_node_children(node)[index] : *internal_node_right_child(node);
+
+		if(!page_version_unchanged(pager, node_page_num, node_version)){
+			unpin_page(pager, node_page_num);
+			return NULL;
+		}
+		void *child = get_page(pager, child_page_num);
+		uint64_t child_version = page_version(pager, child_page_num);
+		/* The child was still the right one when its version was read */
+		bool unchanged = page_version_unchanged(pager, node_page_num, node_version);
+		unpin_page(pager, node_page_num);
+		if(!unchanged){
+			unpin_page(pager, child_page_num);
+			return NULL;
+		}
+		node_page_num = child_page_num;
+		node = child;
+		node_version = child_version;
+	}
+
+	*page_num = node_page_num;
+	*version = node_version;
+	return node;
+}
+
+uint32_t table_read_leaf(Table *table, uint32_t key, void *copy){
+/*
+ * Copy the leaf for key as it was between two changes, and return its
+ * page number.
+ */
+	Pager *pager = table->pager;
+	uint32_t page_num;
+	uint64_t version;
+
+	for(uint32_t attempt = 0; attempt < OPTIMISTIC_READ_ATTEMPTS; attempt++){
+		void *node = table_descend_optimistic(table, key, &page_num, &version);
+		if(node == NULL){
+			continue;
+		}
+		memcpy(copy, node, PAGE_SIZE);
+		bool unchanged = page_version_unchanged(pager, page_num, version);
+		unpin_page(pager, page_num);
+		if(unchanged){
+			return page_num;
+		}
+	}
+
+	page_num = table_latch_leaf(table, key);
+	memcpy(copy, get_page(pager, page_num), PAGE_SIZE);
+	unpin_page(pager, page_num);
+	unlatch_page(pager, page_num);
+	unpin_page(pager, page_num);
+	return page_num;
+}
+
+uint32_t table_latch_path(Table *table, uint32_t key, uint32_t cell_size, uint32_t *path){
+/*
+ * Latch exclusive what inserting a cell of cell_size under key may change:
+ * the leaf and the nodes above it up to the lowest safe one, or the whole
+ * path for a packed leaf, whose unpacking may add several keys to its
+ * parent. The caller must hold writer_lock. The pages in path, leaf last,
+ * are pinned and latched; returns how many there are.
+ */
+	Pager *pager = table->pager;
+	uint32_t depth = 0, top = 0;
+	uint32_t page_num = table->root_page_num;
+	void *node = get_page(pager, page_num);
+
+	for(;;){
+		if(depth == TABLE_MAX_HEIGHT){
+			printf("Tree is deeper than %d levels.\n", TABLE_MAX_HEIGHT);
+			exit(EXIT_FAILURE);
+		}
+		path[depth++] = page_num;
+		if(node_is_safe(node, cell_size)){
+			top = depth - 1;
+		}
+		if(get_node_type(node) != NODE_INTERNAL){
+			break;
+		}
+		page_num = *internal_node_child(node, internal_node_find_child(node, key));
+		node = get_page(pager, page_num);
+	}
+	if(leaf_node_is_packed(node)){
+		top = 0;
+	}
+
+	for(uint32_t i = 0; i < top; i++){
+		unpin_page(pager, path[i]);
+	}
+	/* Top down, the order readers falling back to latches take them in */
+	for(uint32_t i = top; i < depth; i++){
+		latch_page(pager, path[i], true);
+		path[i - top] = path[i];
+	}
+
+	return depth - top;
+}
+
+uint32_t table_latch_rightmost(Table *table, uint32_t key, uint32_t cell_size,
+		uint32_t *path){
+/*
+ * table_find_rightmost for a writer: a key appended to the rightmost leaf
+ * that fits without a split only needs that leaf latched. Returns 0 when
+ * the path has to be latched from the root instead.
+ */
+	Pager *pager = table->pager;
+	uint32_t page_num = table->rightmost_leaf;
+
+	if(page_num == INVALID_PAGE_NUM){
+		return 0;
+	}
+
+	void *node = get_page(pager, page_num);
+	latch_page(pager, page_num, true);
+	uint32_t num_cells = *leaf_node_num_cells(node);
+	bool is_append = get_node_type(node) == NODE_LEAF &&
+		*leaf_node_next_leaf(node) == 0 && num_cells > 0 &&
+		key > leaf_node_key_at(node, num_cells - 1) && node_is_safe(node, cell_size);
+
+	if(!is_append){
+		unlatch_page(pager, page_num);
+		unpin_page(pager, page_num);
+		return 0;
+	}
+	path[0] = page_num;
+	return 1;
+}
+
+bool table_get(Table *table, uint32_t key, Row *row){
+/*
+ * Point lookup that is safe against a concurrent writer. Returns false if
+ * there is no row with key.
+ */
+	STATS_TIME_START(started);
+	uint64_t copy[PAGE_SIZE / sizeof(uint64_t)];
+	void *node = copy;
+
+	table_read_leaf(table, key, node);
+	uint32_t cell_num = leaf_node_lower_bound(node, key);
+	bool found = cell_num < *leaf_node_num_cells(node) &&
+		leaf_node_key_at(node, cell_num) == key;
+
+	if(found){
+		leaf_node_read_row(node, cell_num, row);
+	}
+	STATS_TIME_END(TIMER_FIND, started);
+	return found;
+}
+
+ExecuteResult table_insert(Table *table, Row *row){
+/*
+ * Insert one row, safe against concurrent readers and writers, and end
+ * the statement.
+ */
+	STATS_TIME_START(started);
+	Arena *arena = arena_thread();
+	ArenaMark mark = arena_mark(arena);
+	Pager *pager = table->pager;
+	uint32_t path[TABLE_MAX_HEIGHT];
+	uint8_t cell[ROW_SIZE];
+	uint32_t cell_size = serialized_row_size(row);
+	ExecuteResult result = EXECUTE_SUCCESS;
+
+	serialize_row(row, cell);
+	pthread_mutex_lock(&table->writer_lock);
+	mvcc_begin_write(pager);
+
+	uint32_t depth = table_latch_rightmost(table, row->id, cell_size, path);
+	if(depth == 0){
+		depth = table_latch_path(table, row->id, cell_size, path);
+	}
+	void *leaf = get_page(pager, path[depth - 1]);
+
+	Cursor *cursor = leaf_node_find(table, path[depth - 1], row->id);
+	if(cursor->cell_num < *leaf_node_num_cells(leaf) &&
+			leaf_node_key_at(leaf, cursor->cell_num) == row->id){
+		result = EXECUTE_DUPLICATE_KEY;
+	}
+	unpin_page(pager, path[depth - 1]);
+	if(result == EXECUTE_SUCCESS){
+		leaf_node_insert(cursor, cell, cell_size);
+	}
+	cursor_close(cursor);
+	table_unlatch_path(pager, path, depth);
+	mvcc_end_write(pager);
+
+	if(result == EXECUTE_SUCCESS){
+		index_insert_row(table, row);
+		pager_end_statement(pager);
+	}
+	pthread_mutex_unlock(&table->writer_lock);
+	arena_release(arena, mark);
+	STATS_TIME_END(TIMER_INSERT, started);
+
+	return result;
+}
+
+int compare_row_pointer(const void *a, const void *b){
+/*
+ * Order by key, then by position in the batch.
+ */
+	Row *x = *(Row * const *)a, *y = *(Row * const *)b;
+
+	if(x->id != y->id){
+		return x->id < y->id ? -1 : 1;
+	}
+	return x < y ? -1 : (x > y);
+}
+
+uint32_t table_insert_rows(Table *table, Row *rows, uint32_t num_rows,
+		ExecuteResult *results){
+/*
+ * Insert a batch of rows, setting results[i] for rows[i]. The batch is
+ * sorted by key and each descent fills in every following row that
+ * belongs in the same leaf: those up to the leaf's last key, or all of
+ * them for the rightmost leaf. A row that does not fit splits the leaf
+ * and the next row descends again. Of several rows with one key, the
+ * first in the batch wins. Returns the number of rows inserted.
+ * Each descent latches the leaf and, since it may split, its parents.
+ */
+	STATS_TIME_START(started);
+	Arena *arena = arena_thread();
+	ArenaMark mark = arena_mark(arena);
+	Pager *pager = table->pager;
+	Row **order = (Row **)arena_alloc(arena, num_rows * sizeof(Row *));
+	uint32_t path[TABLE_MAX_HEIGHT];
+	uint8_t cell[ROW_SIZE];
+	uint32_t inserted = 0;
+	uint32_t i = 0;
+
+	pthread_mutex_lock(&table->writer_lock);
+	mvcc_begin_write(pager);
+
+	for(uint32_t j = 0; j < num_rows; j++){
+		order[j] = &rows[j];
+	}
+	qsort(order, num_rows, sizeof(Row *), compare_row_pointer);
+
+	while(i < num_rows){
+		/* No cell is that big, so the leaf always counts as unsafe */
+		uint32_t depth = table_latch_path(table, order[i]->id, PAGE_SIZE, path);
+		uint32_t page_num = path[depth - 1];
+		void *node = get_page(pager, page_num);
+
+		if(leaf_node_is_packed(node)){
+			unpin_page(pager, page_num);
+			leaf_node_unpack(table, page_num);
+			table_unlatch_path(pager, path, depth);
+			continue;
+		}
+		Cursor *cursor = leaf_node_find(table, page_num, order[i]->id);
+		uint32_t cell_num = cursor->cell_num;
+		bool is_rightmost = *leaf_node_next_leaf(node) == 0;
+		bool is_dirty = false, needs_split = false;
+
+		for(bool first = true; i < num_rows; first = false){
+			Row *row = order[i];
+			uint32_t num_cells = *leaf_node_num_cells(node);
+			uint32_t cell_size = serialized_row_size(row);
+
+			if(!first && !is_rightmost &&
+					(num_cells == 0 || row->id > *leaf_node_key(node, num_cells - 1))){
+				break;
+			}
+			while(cell_num < num_cells && *leaf_node_key(node, cell_num) < row->id){
+				cell_num++;
+			}
+			if(cell_num < num_cells && *leaf_node_key(node, cell_num) == row->id){
+				results[order[i++] - rows] = EXECUTE_DUPLICATE_KEY;
+				continue;
+			}
+			serialize_row(row, cell);
+			if(leaf_node_free_space(node) < cell_size + LEAF_NODE_SLOT_SIZE){
+				needs_split = true;
+				break;
+			}
+			leaf_node_insert_cell(node, cell_num, cell, cell_size);
+			results[order[i++] - rows] = EXECUTE_SUCCESS;
+			is_dirty = true;
+			inserted++;
+		}
+
+		if(is_dirty){
+			mark_page_dirty(pager, cursor->page_num);
+		}
+		unpin_page(pager, cursor->page_num);
+		if(needs_split){
+			cursor->cell_num = cell_num;
+			leaf_node_split_and_insert(cursor, cell, serialized_row_size(order[i]));
+			results[order[i++] - rows] = EXECUTE_SUCCESS;
+			inserted++;
+		}
+		cursor_close(cursor);
+		table_unlatch_path(pager, path, depth);
+	}
+	mvcc_end_write(pager);
+
+	for(uint32_t j = 0; j < num_rows; j++){
+		if(results[j] == EXECUTE_SUCCESS){
+			index_insert_row(table, &rows[j]);
+		}
+	}
+	pthread_mutex_unlock(&table->writer_lock);
+	arena_release(arena, mark);
+	STATS_TIME_END(TIMER_INSERT, started);
+	return inserted;
+}
+
+/*----------------------I/O----------------------------------*/
+/*
+ * An Io is used by one thread at a time: the pager's under pager->lock,
+ * the log's by whoever is checkpointing. liburing is not needed, the
+ * rings are set up and driven with the raw system calls.
+ */
+void io_perform(IoRequest *request){
+	ssize_t result = request->write ?
+		pwritev(request->fd, request->iov, request->iov_count, request->offset) :
+		preadv(request->fd, request->iov, request->iov_count, request->offset);
+
+	request->result = result == -1 ? -errno : result;
+}
+
+size_t io_request_length(IoRequest *request){
+	size_t length = 0;
+
+	for(uint32_t i = 0; i < request->iov_count; i++){
+		length += request->iov[i].iov_len;
+	}
+	return length;
+}
+
+bool io_uring_open(Io *io){
+	struct io_uring_params params;
+
+	memset(&params, 0, sizeof(params));
+	io->ring_fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params);
+	if(io->ring_fd < 0){
+		return false;
+	}
+
+	io->entries = params.sq_entries;
+	io->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	io->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP){
+		if(io->cq_ring_size > io->sq_ring_size){
+			io->sq_ring_size = io->cq_ring_size;
+		}
+		io->cq_ring_size = io->sq_ring_size;
+	}
+	io->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	io->sq_ring = mmap(NULL, io->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQ_RING);
+	io->cq_ring = io->sq_ring;
+	if(io->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)){
+		io->cq_ring = mmap(NULL, io->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_CQ_RING);
+	}
+	io->sqes = mmap(NULL, io->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, io->ring_fd, IORING_OFF_SQES);
+	if(io->sq_ring == MAP_FAILED || io->cq_ring == MAP_FAILED || io->sqes == MAP_FAILED){
+		printf("Unable to map io_uring: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+
+	io->sq_head = io->sq_ring + params.sq_off.head;
+	io->sq_tail = io->sq_ring + params.sq_off.tail;
+	io->sq_mask = io->sq_ring + params.sq_off.ring_mask;
+	io->sq_array = io->sq_ring + params.sq_off.array;
+	io->cq_head = io->cq_ring + params.cq_off.head;
+	io->cq_tail = io->cq_ring + params.cq_off.tail;
+	io->cq_mask = io->cq_ring + params.cq_off.ring_mask;
+	io->cqes = io->cq_ring + params.cq_off.cqes;
+	return true;
+}
+
+void io_uring_close(Io *io){
+	munmap(io->sqes, io->sqes_size);
+	if(io->cq_ring != io->sq_ring){
+		munmap(io->cq_ring, io->cq_ring_size);
+	}
+	munmap(io->sq_ring, io->sq_ring_size);
+	close(io->ring_fd);
+}
+
+bool io_uring_run(Io *io, IoRequest *requests, uint32_t num_requests){
+/*
+ * Keep the ring full: queue requests while fewer than entries are in
+ * flight, hand the kernel what was queued, and collect whatever has
+ * completed. The completion queue holds twice entries, so it cannot
+ * overflow.
+ */
+	uint32_t queued = 0, completed = 0, unsubmitted = 0;
+
+	while(completed < num_requests){
+		uint32_t tail = *io->sq_tail;
+		while(queued < num_requests && queued - completed < io->entries){
+			IoRequest *request = &requests[queued];
+			uint32_t index = tail & *io->sq_mask;
+			struct io_uring_sqe *sqe = &io->sqes[index];
+
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+			sqe->fd = request->fd;
+			sqe->addr = (uint64_t)(uintptr_t)request->iov;
+			sqe->len = request->iov_count;
+			sqe->off = request->offset;
+			sqe->user_data = queued;
+			io->sq_array[index] = index;
+			tail++;
+			queued++;
+			unsubmitted++;
+		}
+		__atomic_store_n(io->sq_tail, tail, __ATOMIC_RELEASE);
+
+		int submitted = syscall(__NR_io_uring_enter, io->ring_fd, unsubmitted, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if(submitted < 0){
+			if(errno == EINTR || errno == EAGAIN || errno == EBUSY){
+				continue;
+			}
+			return false;
+		}
+		unsubmitted -= submitted;
+
+		uint32_t head = *io->cq_head;
+		uint32_t cq_tail = __atomic_load_n(io->cq_tail, __ATOMIC_ACQUIRE);
+		while(head != cq_tail){
+			struct io_uring_cqe *cqe = &io->cqes[head & *io->cq_mask];
+			requests[cqe->user_data].result = cqe->res;
+			head++;
+			completed++;
+		}
+		__atomic_store_n(io->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+void *io_worker_thread(void *arg){
+	Io *io = (Io *)arg;
+
+	pthread_mutex_lock(&io->lock);
+	while(true){
+		while(!io->stop && io->next == io->batch_size){
+			pthread_cond_wait(&io->work, &io->lock);
+		}
+		if(io->stop){
+			break;
+		}
+		IoRequest *request = &io->batch[io->next++];
+		pthread_mutex_unlock(&io->lock);
+
+		io_perform(request);
+
+		pthread_mutex_lock(&io->lock);
+		if(++io->completed == io->batch_size){
+			pthread_cond_signal(&io->done);
+		}
+	}
+	pthread_mutex_unlock(&io->lock);
+
+	return NULL;
+}
+
+void io_threads_run(Io *io, IoRequest *requests, uint32_t num_requests){
+	pthread_mutex_lock(&io->lock);
+	io->batch = requests;
+	io->batch_size = num_requests;
+	io->next = 0;
+	io->completed = 0;
+	pthread_cond_broadcast(&io->work);
+	while(io->completed < num_requests){
+		pthread_cond_wait(&io->done, &io->lock);
+	}
+	io->batch = NULL;
+	io->batch_size = 0;
+	io->next = 0;
+	pthread_mutex_unlock(&io->lock);
+}
+
+Io *io_open(IoBackend backend){
+	Io *io = (Io *)malloc(sizeof(*io));
+
+	memset(io, 0, sizeof(*io));
+	io->ring_fd = -1;
+	if(backend == IO_DEFAULT || backend == IO_URING){
+		if(io_uring_open(io)){
+			backend = IO_URING;
+		} else if(backend == IO_URING){
+			printf("Unable to set up io_uring: %d\n", errno);
+			exit(EXIT_FAILURE);
+		} else{
+			backend = IO_THREADS;
+		}
+	}
+	io->backend = backend;
+
+	if(backend == IO_THREADS){
+		pthread_mutex_init(&io->lock, NULL);
+		pthread_cond_init(&io->work, NULL);
+		pthread_cond_init(&io->done, NULL);
+		for(uint32_t i = 0; i < IO_POOL_THREADS; i++){
+			if(pthread_create(&io->threads[i], NULL, io_worker_thread, io) != 0){
+				printf("Unable to start I/O thread\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	return io;
+}
+
+void io_close(Io *io){
+	if(io->backend == IO_URING){
+		io_uring_close(io);
+	} else if(io->backend == IO_THREADS){
+		pthread_mutex_lock(&io->lock);
+		io->stop = true;
+		pthread_cond_broadcast(&io->work);
+		pthread_mutex_unlock(&io->lock);
+		for(uint32_t i = 0; i < IO_POOL_THREADS; i++){
+			pthread_join(io->threads[i], NULL);
+		}
+		pthread_mutex_destroy(&io->lock);
+		pthread_cond_destroy(&io->work);
+		pthread_cond_destroy(&io->done);
+	}
+	free(io);
+}
+
+bool io_run(Io *io, IoRequest *requests, uint32_t num_requests){
+/*
+ * Carry out every request and wait until all are done. Returns false with
+ * errno set if one failed. A short write counts as failed; a short read
+ * is left to the caller, it stopped at the end of the file.
+ */
+	if(num_requests == 0){
+		return true;
+	}
+	io->batches++;
+	io->requests += num_requests;
+
+	if(io->backend == IO_URING){
+		if(!io_uring_run(io, requests, num_requests)){
+			return false;
+		}
+	} else if(io->backend == IO_THREADS && num_requests > 1){
+		io_threads_run(io, requests, num_requests);
+	} else{
+		for(uint32_t i = 0; i < num_requests; i++){
+			io_perform(&requests[i]);
+		}
+	}
+
+	for(uint32_t i = 0; i < num_requests; i++){
+		if(requests[i].result < 0){
+			errno = -requests[i].result;
+			return false;
+		}
+		if(requests[i].write && (size_t)requests[i].result < io_request_length(&requests[i])){
+			errno = EIO;
+			return false;
+		}
+	}
+	return true;
+}
+
+const char *io_backend_name(IoBackend backend){
+	switch(backend){
+		case IO_URING:
+			return "io_uring";
+		case IO_THREADS:
+			return "threads";
+		case IO_SYNC:
+			return "sync";
+		default:
+			return "default";
+	}
+}
+
+void *page_buffer_alloc(size_t size){
+/*
+ * Page buffers are aligned to PAGE_SIZE, as O_DIRECT requires.
+ */
+	void *buffer;
+
+	if(posix_memalign(&buffer, PAGE_SIZE, size) != 0){
+		printf("Unable to allocate page buffer\n");
+		exit(EXIT_FAILURE);
+	}
+	return buffer;
+}
+
+void *frame_slab_alloc(size_t *size, bool *huge){
+/*
+ * One mapping for all the frames' pages, rounded up to whole huge pages.
+ * Explicit huge pages are taken when enough are reserved, otherwise the
+ * kernel is asked to back it with transparent ones. Only what the pool
+ * touches is backed either way. Mappings are aligned to PAGE_SIZE.
+ */
+	size_t slab_size = (*size + FRAME_SLAB_HUGE_PAGE_SIZE - 1) & ~(size_t)(FRAME_SLAB_HUGE_PAGE_SIZE - 1);
+	void *slab = MAP_FAILED;
+
+	*huge = false;
+#ifdef MAP_HUGETLB
+	slab = mmap(NULL, slab_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	*huge = slab != MAP_FAILED;
+#endif
+	if(slab == MAP_FAILED){
+		slab = mmap(NULL, slab_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	}
+	if(slab == MAP_FAILED){
+		printf("Unable to allocate buffer pool: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+#ifdef MADV_HUGEPAGE
+	if(!*huge){
+		madvise(slab, slab_size, MADV_HUGEPAGE);
+	}
+#endif
+	*size = slab_size;
+	return slab;
+}
+
+/*----------------------WAL----------------------------------*/
+/*
+ * Write-ahead log kept next to the db file as <db>-wal. When it is enabled
+ * dirty pages never go straight to the db file: they are appended to the
+ * log as full page images, and a commit record followed by one
+ * fdatasync() makes every frame before it durable. Inserts are grouped
+ * group_commit statements per commit. Pages whose latest image lives in
+ * the log are read back from it through wal->index.
+ *
+ * Once the log holds WAL_CHECKPOINT_FRAMES frames, a background thread
+ * copies the committed images into the db file. The frames appended while
+ * it ran are copied by the main thread at the next commit, after which the
+ * log is truncated and starts over with a new salt.
+ */
+uint32_t wal_checksum(uint32_t hash, const void *data, size_t len){
+	/* FNV-1a */
+	const uint8_t *bytes = data;
+	for(size_t i = 0; i < len; i++){
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+uint32_t wal_frame_checksum(WalFrameHeader *header, const void *page){
+	uint32_t hash = wal_checksum(2166136261u, header,
+			offsetof(WalFrameHeader, checksum));
+	if(page != NULL){
+		hash = wal_checksum(hash, page, PAGE_SIZE);
+	}
+	return hash;
+}
+
+void wal_index_set(Wal *wal, uint32_t page_num, uint64_t offset){
+	if(page_num >= wal->index_size){
+		uint32_t new_size = wal->index_size ? wal->index_size : 64;
+		while(new_size <= page_num){
+			new_size *= 2;
+		}
+		wal->index = (uint64_t *)realloc(wal->index, new_size * sizeof(uint64_t));
+		memset(wal->index + wal->index_size, 0,
+				(new_size - wal->index_size) * sizeof(uint64_t));
+		wal->index_size = new_size;
+	}
+	wal->index[page_num] = offset;
+}
+
+uint64_t wal_index_get(Wal *wal, uint32_t page_num){
+	if(page_num >= wal->index_size){
+		return 0;
+	}
+	return wal->index[page_num];
+}
+
+void wal_sync(int fd){
+	if(fdatasync(fd) == -1){
+		printf("Error syncing: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void wal_restart(Wal *wal){
+/*
+ * Everything in the log has reached the db file. Truncate it and pick a
+ * new salt so that nothing written before the restart can validate.
+ */
+	uint32_t header[4] = { WAL_MAGIC, wal->salt + 1, 0, 0 };
+
+	if(ftruncate(wal->file_descriptor, 0) == -1 ||
+			pwrite(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE){
+		printf("Error resetting log: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	wal_sync(wal->file_descriptor);
+
+	wal->salt = header[1];
+	wal->write_offset = WAL_HEADER_SIZE;
+	wal->commit_offset = WAL_HEADER_SIZE;
+	wal->frames = 0;
+	if(wal->index != NULL){
+		memset(wal->index, 0, wal->index_size * sizeof(uint64_t));
+	}
+}
+
+void wal_copy_frames(Wal *wal, WalIndexEntry *entries, uint32_t num_entries){
+/*
+ * Copy the frames IO_QUEUE_DEPTH at a time: read the whole batch from the
+ * log, then write it to the db file. entries are in page order, so frames
+ * next to each other in the log are read with one request, skipping the
+ * headers between them, and consecutive pages are written with one.
+ */
+	uint8_t *pages = page_buffer_alloc(IO_QUEUE_DEPTH * PAGE_SIZE);
+	WalFrameHeader headers[IO_QUEUE_DEPTH];
+	struct iovec read_iov[2 * IO_QUEUE_DEPTH], write_iov[IO_QUEUE_DEPTH];
+	IoRequest reads[IO_QUEUE_DEPTH], writes[IO_QUEUE_DEPTH];
+
+	for(uint32_t first = 0; first < num_entries; first += IO_QUEUE_DEPTH){
+		uint32_t count = num_entries - first < IO_QUEUE_DEPTH ?
+			num_entries - first : IO_QUEUE_DEPTH;
+		uint32_t num_reads = 0, num_writes = 0, num_read_iov = 0;
+
+		for(uint32_t i = 0; i < count; i++){
+			WalIndexEntry *entry = &entries[first + i];
+			void *page = pages + (size_t)i * PAGE_SIZE;
+
+			if(i > 0 && entry->offset == entry[-1].offset + WAL_FRAME_HEADER_SIZE + PAGE_SIZE){
+				read_iov[num_read_iov++] = (struct iovec){ &headers[i], WAL_FRAME_HEADER_SIZE };
+				reads[num_reads - 1].iov_count += 2;
+			} else{
+				reads[num_reads++] = (IoRequest){ .write = false, .fd = wal->file_descriptor,
+					.iov = &read_iov[num_read_iov], .iov_count = 1,
+					.offset = entry->offset + WAL_FRAME_HEADER_SIZE };
+			}
+			read_iov[num_read_iov++] = (struct iovec){ page, PAGE_SIZE };
+
+			write_iov[i] = (struct iovec){ page, PAGE_SIZE };
+			if(i > 0 && entry->page_num == entry[-1].page_num + 1){
+				writes[num_writes - 1].iov_count++;
+			} else{
+				writes[num_writes++] = (IoRequest){ .write = true,
+					.fd = wal->db_file_descriptor, .iov = &write_iov[i], .iov_count = 1,
+					.offset = (uint64_t)entry->page_num * PAGE_SIZE };
+			}
+		}
+
+		bool copied = io_run(wal->io, reads, num_reads);
+		for(uint32_t i = 0; copied && i < num_reads; i++){
+			if((size_t)reads[i].result != io_request_length(&reads[i])){
+				errno = EIO;
+				copied = false;
+			}
+		}
+		if(!copied || !io_run(wal->io, writes, num_writes)){
+			printf("Error checkpointing log: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		STATS_ADD(STAT_CHECKPOINT_PAGES, count);
+		STATS_ADD(STAT_BYTES_FLUSHED, (uint64_t)count * PAGE_SIZE);
+	}
+
+	free(pages);
+}
+
+uint32_t wal_collect_entries(Wal *wal, uint64_t from_offset, WalIndexEntry **entries){
+/*
+ * List the pages whose latest frame starts at or after from_offset.
+ */
+	uint32_t num_entries = 0;
+
+	*entries = (WalIndexEntry *)malloc((wal->index_size + 1) * sizeof(WalIndexEntry));
+	for(uint32_t i = 0; i < wal->index_size; i++){
+		if(wal->index[i] != 0 && wal->index[i] >= from_offset){
+			(*entries)[num_entries].page_num = i;
+			(*entries)[num_entries].offset = wal->index[i];
+			num_entries++;
+		}
+	}
+	return num_entries;
+}
+
+void *wal_checkpoint_thread(void *arg){
+	Wal *wal = (Wal *)arg;
+
+	pthread_mutex_lock(&wal->lock);
+	while(true){
+		while(!wal->stop && !wal->checkpoint_busy){
+			pthread_cond_wait(&wal->cond, &wal->lock);
+		}
+		if(wal->stop){
+			break;
+		}
+		pthread_mutex_unlock(&wal->lock);
+
+		/* Only committed frames are handed over, and the main thread
+		 * never writes the pages listed here to the db file itself */
+		wal_copy_frames(wal, wal->checkpoint_entries, wal->checkpoint_num_entries);
+		wal_sync(wal->db_file_descriptor);
+
+		pthread_mutex_lock(&wal->lock);
+		free(wal->checkpoint_entries);
+		wal->checkpoint_entries = NULL;
+		wal->checkpoint_busy = false;
+		wal->checkpoint_done = true;
+		pthread_cond_broadcast(&wal->cond);
+	}
+	pthread_mutex_unlock(&wal->lock);
+
+	return NULL;
+}
+
+void wal_checkpoint(Wal *wal){
+/*
+ * Bring the db file up to date with the log and restart the log. Must only
+ * run right after a commit. If the background thread already copied a
+ * prefix of the log, only the frames written since are copied here.
+ */
+	pthread_mutex_lock(&wal->lock);
+	while(wal->checkpoint_busy){
+		pthread_cond_wait(&wal->cond, &wal->lock);
+	}
+	uint64_t copied_offset = wal->checkpoint_done ?
+		wal->checkpoint_end_offset : WAL_HEADER_SIZE;
+	wal->checkpoint_done = false;
+	pthread_mutex_unlock(&wal->lock);
+
+	WalIndexEntry *entries;
+	uint32_t num_entries = wal_collect_entries(wal, copied_offset, &entries);
+	wal_copy_frames(wal, entries, num_entries);
+	free(entries);
+
+	wal_sync(wal->db_file_descriptor);
+	wal_restart(wal);
+	wal->checkpoints++;
+}
+
+void wal_maybe_checkpoint(Wal *wal){
+	pthread_mutex_lock(&wal->lock);
+	bool busy = wal->checkpoint_busy;
+	bool done = wal->checkpoint_done;
+	pthread_mutex_unlock(&wal->lock);
+
+	if(done){
+		wal_checkpoint(wal);
+	} else if(!busy && wal->frames >= WAL_CHECKPOINT_FRAMES){
+		pthread_mutex_lock(&wal->lock);
+		wal->checkpoint_num_entries =
+			wal_collect_entries(wal, WAL_HEADER_SIZE, &wal->checkpoint_entries);
+		wal->checkpoint_end_offset = wal->write_offset;
+		wal->checkpoint_busy = true;
+		pthread_cond_signal(&wal->cond);
+		pthread_mutex_unlock(&wal->lock);
+	}
+}
+
+void wal_append_pages(Wal *wal, uint32_t *page_nums, void **pages, uint32_t count){
+/*
+ * Append one frame per page. The frames are not durable until the next
+ * commit record is synced.
+ */
+	WalFrameHeader headers[IOV_MAX / 2];
+	struct iovec iov[IOV_MAX];
+	uint32_t done = 0;
+
+	while(done < count){
+		uint32_t batch = count - done;
+		if(batch > IOV_MAX / 2){
+			batch = IOV_MAX / 2;
+		}
+
+		for(uint32_t i = 0; i < batch; i++){
+			WalFrameHeader *header = &headers[i];
+			header->page_num = page_nums[done + i];
+			header->db_pages = 0;
+			header->salt = wal->salt;
+			header->checksum = wal_frame_checksum(header, pages[done + i]);
+			iov[2 * i].iov_base = header;
+			iov[2 * i].iov_len = WAL_FRAME_HEADER_SIZE;
+			iov[2 * i + 1].iov_base = pages[done + i];
+			iov[2 * i + 1].iov_len = PAGE_SIZE;
+		}
+
+		ssize_t expected = (ssize_t)batch * (WAL_FRAME_HEADER_SIZE + PAGE_SIZE);
+		if(pwritev(wal->file_descriptor, iov, 2 * batch, wal->write_offset) != expected){
+			printf("Error writing log: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+
+		for(uint32_t i = 0; i < batch; i++){
+			wal_index_set(wal, page_nums[done + i], wal->write_offset);
+			wal->write_offset += WAL_FRAME_HEADER_SIZE + PAGE_SIZE;
+		}
+		wal->frames += batch;
+		done += batch;
+		STATS_ADD(STAT_BYTES_FLUSHED, expected);
+	}
+}
+
+void wal_commit(Wal *wal, uint32_t db_pages){
+	WalFrameHeader header;
+	header.page_num = WAL_COMMIT_RECORD;
+	header.db_pages = db_pages;
+	header.salt = wal->salt;
+	header.checksum = wal_frame_checksum(&header, NULL);
+
+	if(pwrite(wal->file_descriptor, &header, WAL_FRAME_HEADER_SIZE,
+				wal->write_offset) != WAL_FRAME_HEADER_SIZE){
+		printf("Error writing log: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	wal->write_offset += WAL_FRAME_HEADER_SIZE;
+	wal_sync(wal->file_descriptor);
+	wal->commit_offset = wal->write_offset;
+
+	wal->pending_statements = 0;
+	wal->commits++;
+}
+
+uint32_t wal_recover(Wal *wal){
+/*
+ * Rebuild the index from the frames covered by the last valid commit
+ * record and discard the rest. Returns the db size in pages recorded by
+ * that commit.
+ */
+	uint32_t header[4];
+	if(pread(wal->file_descriptor, header, WAL_HEADER_SIZE, 0) != WAL_HEADER_SIZE ||
+			header[0] != WAL_MAGIC){
+		wal->salt = 0;
+		return 0;
+	}
+	wal->salt = header[1];
+
+	WalIndexEntry *pending = NULL;
+	uint32_t num_pending = 0, pending_capacity = 0;
+	uint32_t db_pages = 0;
+	uint64_t offset = WAL_HEADER_SIZE;
+	void *page = malloc(PAGE_SIZE);
+	WalFrameHeader frame;
+
+	while(pread(wal->file_descriptor, &frame, WAL_FRAME_HEADER_SIZE, offset) ==
+			WAL_FRAME_HEADER_SIZE && frame.salt == wal->salt){
+		if(frame.page_num == WAL_COMMIT_RECORD){
+			if(frame.checksum != wal_frame_checksum(&frame, NULL)){
+				break;
+			}
+			for(uint32_t i = 0; i < num_pending; i++){
+				wal_index_set(wal, pending[i].page_num, pending[i].offset);
+			}
+			num_pending = 0;
+			db_pages = frame.db_pages;
+			offset += WAL_FRAME_HEADER_SIZE;
+			continue;
+		}
+
+		if(pread(wal->file_descriptor, page, PAGE_SIZE,
+					offset + WAL_FRAME_HEADER_SIZE) != PAGE_SIZE ||
+				frame.checksum != wal_frame_checksum(&frame, page)){
+			break;
+		}
+		if(num_pending == pending_capacity){
+			pending_capacity = pending_capacity ? 2 * pending_capacity : 64;
+			pending = (WalIndexEntry *)realloc(pending,
+					pending_capacity * sizeof(WalIndexEntry));
+		}
+		pending[num_pending].page_num = frame.page_num;
+		pending[num_pending].offset = offset;
+		num_pending++;
+		offset += WAL_FRAME_HEADER_SIZE + PAGE_SIZE;
+	}
+
+	free(page);
+	free(pending);
+	return db_pages;
+}
+
+Wal *wal_open(const char *db_filename, int db_fd, uint32_t group_commit, IoBackend io_backend){
+	Wal *wal = (Wal *)malloc(sizeof(*wal));
+
+	wal->filename = (char *)malloc(strlen(db_filename) + sizeof("-wal"));
+	strcpy(wal->filename, db_filename);
+	strcat(wal->filename, "-wal");
+
+	wal->file_descriptor = open(wal->filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+	if(wal->file_descriptor == -1){
+		printf("Unable to open log file\n");
+		exit(EXIT_FAILURE);
+	}
+
+	wal->db_file_descriptor = db_fd;
+	wal->io = io_open(io_backend);
+	wal->index = NULL;
+	wal->index_size = 0;
+	wal->frames = 0;
+	wal->group_commit = group_commit ? group_commit : WAL_DEFAULT_GROUP_COMMIT;
+	wal->pending_statements = 0;
+	wal->commits = 0;
+	wal->checkpoints = 0;
+	wal->checkpoint_entries = NULL;
+	wal->checkpoint_num_entries = 0;
+	wal->checkpoint_end_offset = 0;
+	wal->checkpoint_busy = false;
+	wal->checkpoint_done = false;
+	wal->stop = false;
+	pthread_mutex_init(&wal->lock, NULL);
+	pthread_cond_init(&wal->cond, NULL);
+
+	/* Replay whatever a crash left behind into the db file */
+	wal_recover(wal);
+	wal_checkpoint(wal);
+	wal->checkpoints = 0;
+
+	if(pthread_create(&wal->checkpointer, NULL, wal_checkpoint_thread, wal) != 0){
+		printf("Unable to start checkpoint thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return wal;
+}
+
+void wal_close(Wal *wal){
+/*
+ * The caller has committed and checkpointed, so the log is empty and can
+ * be removed.
+ */
+	pthread_mutex_lock(&wal->lock);
+	wal->stop = true;
+	pthread_cond_signal(&wal->cond);
+	pthread_mutex_unlock(&wal->lock);
+	pthread_join(wal->checkpointer, NULL);
+
+	close(wal->file_descriptor);
+	unlink(wal->filename);
+	io_close(wal->io);
+
+	pthread_mutex_destroy(&wal->lock);
+	pthread_cond_destroy(&wal->cond);
+	free(wal->checkpoint_entries);
+	free(wal->index);
+	free(wal->filename);
+	free(wal);
+}
+
+/*----------------------Pager----------------------------------*/
+/*
+ * The pager is a fixed-size buffer pool. Pages are cached in num_frames
+ * frames, found through a chained hash table keyed by page number, and
+ * evicted with the CLOCK algorithm once every frame is in use. get_page()
+ * pins the page it returns; every caller must unpin_page() it when done so
+ * the frame becomes eligible for eviction again.
+ * Any thread may call into the pager. A page already in the pool is pinned
+ * and unpinned without a lock, so readers on different threads write
+ * nothing shared but the pin counts of the frames they use. Everything
+ * else holds pager->lock for the whole call. A pin only keeps the page in
+ * memory; threads sharing a table also latch the pages they read or change
+ * (latch_page).
+ */
+uint32_t page_table_bucket(Pager *pager, uint32_t page_num){
+	return (page_num * 2654435761u) % pager->page_table_size;
+}
+
+uint32_t page_table_lookup(Pager *pager, uint32_t page_num){
+/*
+ * Also called without the lock. A chain may then change under the walk,
+ * so the page can be missed or its frame hold another page by the time
+ * the caller looks; callers check and fall back to the lock. The walk is
+ * bounded in case a frame it passed through moved to another chain.
+ */
+	uint32_t frame_index = __atomic_load_n(
+			&pager->page_table[page_table_bucket(pager, page_num)], __ATOMIC_RELAXED);
+
+	for(uint32_t i = 0; frame_index != INVALID_FRAME && i < pager->num_frames; i++){
+		Frame *frame = &pager->frames[frame_index];
+		if(__atomic_load_n(&frame->page_num, __ATOMIC_RELAXED) == page_num){
+			return frame_index;
+		}
+		frame_index = __atomic_load_n(&frame->hash_next, __ATOMIC_RELAXED);
+	}
+
+	return INVALID_FRAME;
+}
+
+void page_table_insert(Pager *pager, uint32_t frame_index){
+	uint32_t bucket = page_table_bucket(pager, pager->frames[frame_index].page_num);
+
+	__atomic_store_n(&pager->frames[frame_index].hash_next, pager->page_table[bucket],
+			__ATOMIC_RELAXED);
+	__atomic_store_n(&pager->page_table[bucket], frame_index, __ATOMIC_RELAXED);
+}
+
+void page_table_remove(Pager *pager, uint32_t frame_index){
+	uint32_t *link = &pager->page_table[
+		page_table_bucket(pager, pager->frames[frame_index].page_num)];
+
+	while(*link != frame_index){
+		link = &pager->frames[*link].hash_next;
+	}
+	__atomic_store_n(link, pager->frames[frame_index].hash_next, __ATOMIC_RELAXED);
+	__atomic_store_n(&pager->frames[frame_index].hash_next, INVALID_FRAME, __ATOMIC_RELAXED);
+}
+
+void pager_write_frame(Pager *pager, Frame *frame){
+	if(pager->wal != NULL){
+		/* The page joins the next commit; the db file is left alone */
+		wal_append_pages(pager->wal, &frame->page_num, &frame->data, 1);
+		frame->dirty = false;
+		pager->writebacks++;
+		STATS_ADD(STAT_PAGE_WRITES, 1);
+		return;
+	}
+
+	struct iovec iov = { frame->data, PAGE_SIZE };
+	IoRequest request = { .write = true, .fd = pager->file_descriptor, .iov = &iov,
+		.iov_count = 1, .offset = (uint64_t)frame->page_num * PAGE_SIZE };
+
+	if(!io_run(pager->io, &request, 1)){
+		printf("Error writing: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+
+	if((uint64_t)(frame->page_num + 1) * PAGE_SIZE > pager->file_length){
+		pager->file_length = (uint64_t)(frame->page_num + 1) * PAGE_SIZE;
+	}
+	frame->dirty = false;
+	pager->writebacks++;
+	STATS_ADD(STAT_PAGE_WRITES, 1);
+	STATS_ADD(STAT_BYTES_FLUSHED, PAGE_SIZE);
+}
+
+uint32_t pager_find_victim(Pager *pager){
+/*
+ * Sweep the clock hand over the frames. Free frames are taken at once,
+ * pinned frames are skipped and referenced frames get a second chance.
+ * Two full sweeps are enough to clear every reference bit, so if nothing
+ * was found by then every frame is pinned. The frame returned is left
+ * FRAME_EVICTING, the caller publishes it with its new page and pins.
+ */
+	for(uint32_t i = 0; i < 2 * pager->num_frames; i++){
+		uint32_t frame_index = pager->clock_hand;
+		Frame *frame = &pager->frames[frame_index];
+		pager->clock_hand = (pager->clock_hand + 1) % pager->num_frames;
+
+		if(frame->page_num != INVALID_PAGE_NUM){
+			if(__atomic_load_n(&frame->pin_count, __ATOMIC_RELAXED) > 0){
+				continue;
+			}
+			if(__atomic_load_n(&frame->referenced, __ATOMIC_RELAXED)){
+				__atomic_store_n(&frame->referenced, false, __ATOMIC_RELAXED);
+				continue;
+			}
+		}
+		/* Fails if a reader pinned the frame since, lock-free */
+		uint32_t unpinned = 0;
+		if(!__atomic_compare_exchange_n(&frame->pin_count, &unpinned, FRAME_EVICTING,
+				false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+			continue;
+		}
+		if(frame->page_num == INVALID_PAGE_NUM){
+			return frame_index;
+		}
+
+		if(frame->dirty){
+			pager_write_frame(pager, frame);
+		}
+		if(frame->read_ahead){
+			__atomic_store_n(&frame->read_ahead, false, __ATOMIC_RELAXED);
+			pager->read_ahead_wasted++;
+		}
+		pager->hits += __atomic_load_n(&frame->hits, __ATOMIC_RELAXED);
+		__atomic_store_n(&frame->hits, 0, __ATOMIC_RELAXED);
+		page_table_remove(pager, frame_index);
+		__atomic_store_n(&frame->page_num, INVALID_PAGE_NUM, __ATOMIC_RELAXED);
+		pager->evictions++;
+		return frame_index;
+	}
+
+	printf("Buffer pool exhausted: all %d frames are pinned.\n", pager->num_frames);
+	exit(EXIT_FAILURE);
+}
+
+void *get_mapped_page(Pager *pager, uint32_t page_num){
+/*
+ * mmap mode: pages are handed out straight from the map, so there is
+ * nothing to pin and no copy. A new page first extends the file, since
+ * touching the map past the end of the file faults.
+ */
+	if(page_num >= pager->num_pages){
+		uint64_t new_length = (uint64_t)(page_num + 1) * PAGE_SIZE;
+
+		if(new_length > pager->map_size){
+			/* Grow in place so that pointers handed out stay valid */
+			uint64_t new_size = pager->map_size * 2;
+			if(mremap(pager->map, pager->map_size, new_size, 0) == MAP_FAILED){
+				printf("Unable to grow db mapping: %d\n", errno);
+				exit(EXIT_FAILURE);
+			}
+			pager->map_size = new_size;
+		}
+		if(ftruncate(pager->file_descriptor, new_length) == -1){
+			printf("Error extending db file: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+		pager->file_length = new_length;
+		/* Published last: get_page reads the page without the lock after this */
+		__atomic_store_n(&pager->num_pages, page_num + 1, __ATOMIC_RELEASE);
+		pager->misses++;
+		STATS_ADD(STAT_PAGE_MISSES, 1);
+	} else{
+		STATS_ADD(STAT_PAGE_HITS, 1);
+	}
+
+	return pager->map + (uint64_t)page_num * PAGE_SIZE;
+}
+
+void *get_pooled_page(Pager *pager, uint32_t page_num){
+	uint32_t frame_index = page_table_lookup(pager, page_num);
+
+	if(frame_index != INVALID_FRAME){
+		Frame *frame = &pager->frames[frame_index];
+		pager->hits++;
+		STATS_ADD(STAT_PAGE_HITS, 1);
+		if(frame->read_ahead){
+			__atomic_store_n(&frame->read_ahead, false, __ATOMIC_RELAXED);
+			pager->read_ahead_hits++;
+		}
+		__atomic_fetch_add(&frame->pin_count, 1, __ATOMIC_ACQUIRE);
+	} else{
+		pager->misses++;
+		STATS_ADD(STAT_PAGE_MISSES, 1);
+		frame_index = pager_find_victim(pager);
+		Frame *frame = &pager->frames[frame_index];
+
+
+		uint64_t wal_offset = pager->wal ? wal_index_get(pager->wal, page_num) : 0;
+
+		if(page_num < pager->num_pages && wal_offset != 0){
+			ssize_t bytes_read = pread(pager->wal->file_descriptor, frame->data,
+					PAGE_SIZE, wal_offset + WAL_FRAME_HEADER_SIZE);
+			if(bytes_read != PAGE_SIZE){
+				printf("Error reading log: %d\n", errno);
+				exit(EXIT_FAILURE);
+			}
+			pager->reads++;
+			STATS_ADD(STAT_PAGE_READS, 1);
+		} else if(page_num < pager->num_pages){
+			struct iovec iov = { frame->data, PAGE_SIZE };
+			IoRequest request = { .write = false, .fd = pager->file_descriptor,
+				.iov = &iov, .iov_count = 1, .offset = (uint64_t)page_num * PAGE_SIZE };
+			if(!io_run(pager->io, &request, 1)){
+				printf("Error reading file: %d\n", errno);
+				exit(EXIT_FAILURE);
+			}
+			memset(frame->data + request.result, 0, PAGE_SIZE - request.result);
+			pager->reads++;
+			STATS_ADD(STAT_PAGE_READS, 1);
+		} else{
+			/* Page was never written, start it zeroed */
+			memset(frame->data, 0, PAGE_SIZE);
+		}
+
+		__atomic_store_n(&frame->page_num, page_num, __ATOMIC_RELAXED);
+		frame->dirty = false;
+		page_table_insert(pager, frame_index);
+		/* The page is in, lock-free readers may pin the frame from here */
+		__atomic_store_n(&frame->pin_count, 1, __ATOMIC_RELEASE);
+
+		if(page_num >= pager->num_pages){
+			pager->num_pages = page_num + 1;
+		}
+	}
+
+	Frame *frame = &pager->frames[frame_index];
+	__atomic_store_n(&frame->referenced, true, __ATOMIC_RELAXED);
+
+	return frame->data;
+}
+
+void *get_cached_page(Pager *pager, uint32_t page_num){
+/*
+ * The hit path of get_pooled_page without the lock: find the frame, pin
+ * it unless it is FRAME_EVICTING, then check it still holds page_num.
+ * Returns NULL to go through the lock instead, also for a page read ahead
+ * and not used yet, so that the use is counted.
+ */
+	uint32_t frame_index = page_table_lookup(pager, page_num);
+
+	if(frame_index == INVALID_FRAME){
+		return NULL;
+	}
+
+	Frame *frame = &pager->frames[frame_index];
+	uint32_t pin_count = __atomic_load_n(&frame->pin_count, __ATOMIC_RELAXED);
+	do{
+		if(pin_count & FRAME_EVICTING){
+			return NULL;
+		}
+	} while(!__atomic_compare_exchange_n(&frame->pin_count, &pin_count, pin_count + 1,
+			true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+	if(__atomic_load_n(&frame->page_num, __ATOMIC_RELAXED) != page_num ||
+			__atomic_load_n(&frame->read_ahead, __ATOMIC_RELAXED)){
+		__atomic_fetch_sub(&frame->pin_count, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+	/* Tested first so that a hot page's bit is not written on every hit */
+	if(!__atomic_load_n(&frame->referenced, __ATOMIC_RELAXED)){
+		__atomic_store_n(&frame->referenced, true, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_add(&frame->hits, 1, __ATOMIC_RELAXED);
+	STATS_ADD(STAT_PAGE_HITS, 1);
+
+	return frame->data;
+}
+
+void *get_page(Pager *pager, uint32_t page_num){
+	/* Mapped pages never move, one the file already has needs no lock */
+	if(pager->map != NULL && page_num < __atomic_load_n(&pager->num_pages, __ATOMIC_ACQUIRE)){
+		STATS_ADD(STAT_PAGE_HITS, 1);
+		return pager->map + (uint64_t)page_num * PAGE_SIZE;
+	}
+	if(pager->map == NULL){
+		void *page = get_cached_page(pager, page_num);
+		if(page != NULL){
+			return page;
+		}
+	}
+
+	pthread_mutex_lock(&pager->lock);
+	void *page = pager->map != NULL ? get_mapped_page(pager, page_num) :
+		get_pooled_page(pager, page_num);
+	pthread_mutex_unlock(&pager->lock);
+
+	return page;
+}
+
+void pager_read_ahead(Pager *pager, uint32_t *page_nums, uint32_t count){
+/*
+ * Start reading pages that a scan will ask for soon, at most
+ * READ_AHEAD_MAX_LEAVES. Mapped pages are left to the kernel with
+ * madvise(MADV_WILLNEED), which reads them in the background. In the
+ * buffer pool the pages not cached yet are read into frames as one batch,
+ * a request per run of consecutive pages. They are left unpinned but
+ * referenced, so the clock passes over them once: by then the scan has
+ * usually caught up with them, and the leaves it read before are older.
+ */
+	struct iovec iov[READ_AHEAD_MAX_LEAVES];
+	IoRequest requests[READ_AHEAD_MAX_LEAVES];
+	Frame *frames[READ_AHEAD_MAX_LEAVES];
+	uint32_t num_requests = 0, num_frames = 0;
+
+	if(count > READ_AHEAD_MAX_LEAVES){
+		count = READ_AHEAD_MAX_LEAVES;
+	}
+
+	if(pager->map != NULL){
+		uint32_t num_pages = __atomic_load_n(&pager->num_pages, __ATOMIC_ACQUIRE);
+		for(uint32_t i = 0; i < count; i++){
+			uint32_t run = 1;
+			while(i + run < count && page_nums[i + run] == page_nums[i] + run){
+				run++;
+			}
+			if(page_nums[i] + run <= num_pages){
+				madvise(pager->map + (uint64_t)page_nums[i] * PAGE_SIZE,
+						(size_t)run * PAGE_SIZE, MADV_WILLNEED);
+			}
+			i += run - 1;
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&pager->lock);
+	for(uint32_t i = 0; i < count; i++){
+		uint32_t page_num = page_nums[i];
+
+		if(page_num >= pager->num_pages || page_table_lookup(pager, page_num) != INVALID_FRAME){
+			continue;
+		}
+
+		uint32_t frame_index = pager_find_victim(pager);
+		Frame *frame = &pager->frames[frame_index];
+		/* FRAME_EVICTING until the batch is in, so no later victim is this frame */
+		__atomic_store_n(&frame->page_num, page_num, __ATOMIC_RELAXED);
+		frame->dirty = false;
+		__atomic_store_n(&frame->referenced, true, __ATOMIC_RELAXED);
+		page_table_insert(pager, frame_index);
+
+		uint64_t wal_offset = pager->wal ? wal_index_get(pager->wal, page_num) : 0;
+		iov[num_frames] = (struct iovec){ frame->data, PAGE_SIZE };
+		if(wal_offset == 0 && num_frames > 0 && frames[num_frames - 1]->page_num + 1 == page_num &&
+				requests[num_requests - 1].fd == pager->file_descriptor){
+			requests[num_requests - 1].iov_count++;
+		} else{
+			requests[num_requests++] = (IoRequest){ .write = false,
+				.fd = wal_offset ? pager->wal->file_descriptor : pager->file_descriptor,
+				.iov = &iov[num_frames], .iov_count = 1,
+				.offset = wal_offset ? wal_offset + WAL_FRAME_HEADER_SIZE :
+					(uint64_t)page_num * PAGE_SIZE };
+		}
+		frames[num_frames++] = frame;
+	}
+
+	if(!io_run(pager->io, requests, num_requests)){
+		printf("Error reading file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	for(uint32_t i = 0; i < num_requests; i++){
+		/* A short read stopped at the end of the file */
+		size_t length = requests[i].result;
+		for(uint32_t j = 0; j < requests[i].iov_count; j++){
+			size_t read = length < PAGE_SIZE ? length : PAGE_SIZE;
+			memset(requests[i].iov[j].iov_base + read, 0, PAGE_SIZE - read);
+			length -= read;
+		}
+	}
+	for(uint32_t i = 0; i < num_frames; i++){
+		__atomic_store_n(&frames[i]->read_ahead, true, __ATOMIC_RELAXED);
+		__atomic_store_n(&frames[i]->pin_count, 0, __ATOMIC_RELEASE);
+	}
+	pager->read_ahead += num_frames;
+	pager->reads += num_frames;
+	STATS_ADD(STAT_PAGE_READS, num_frames);
+	pthread_mutex_unlock(&pager->lock);
+}
+
+uint64_t pager_read_ahead_wasted(Pager *pager){
+	pthread_mutex_lock(&pager->lock);
+	uint64_t wasted = pager->read_ahead_wasted;
+	pthread_mutex_unlock(&pager->lock);
+
+	return wasted;
+}
+
+void unpin_page(Pager *pager, uint32_t page_num){
+/*
+ * A pinned page stays in its frame, so a lookup without the lock can only
+ * miss it if a chain changed under the walk.
+ */
+	if(pager->map != NULL){
+		return;
+	}
+
+	uint32_t frame_index = page_table_lookup(pager, page_num);
+	if(frame_index == INVALID_FRAME){
+		pthread_mutex_lock(&pager->lock);
+		frame_index = page_table_lookup(pager, page_num);
+		pthread_mutex_unlock(&pager->lock);
+	}
+
+	if(frame_index == INVALID_FRAME ||
+			__atomic_load_n(&pager->frames[frame_index].pin_count, __ATOMIC_RELAXED) == 0){
+		printf("Tried to unpin page %d which is not pinned\n", page_num);
+		exit(EXIT_FAILURE);
+	}
+
+	__atomic_fetch_sub(&pager->frames[frame_index].pin_count, 1, __ATOMIC_RELEASE);
+}
+
+PageLatch *page_latch(Pager *pager, uint32_t page_num){
+/*
+ * Latches live apart from the frames, so a page keeps its latch across
+ * eviction and mmap mode has them too. Writers are preferred, otherwise a
+ * steady stream of readers crabbing through the root would starve them.
+ */
+	uint32_t chunk = page_num / PAGER_LATCH_CHUNK_SIZE;
+	uint32_t directory_num = chunk / PAGER_LATCH_DIRECTORY_SIZE;
+
+	PageLatch **directory = __atomic_load_n(&pager->latches[directory_num], __ATOMIC_ACQUIRE);
+	if(directory == NULL){
+		pthread_mutex_lock(&pager->lock);
+		directory = pager->latches[directory_num];
+		if(directory == NULL){
+			directory = (PageLatch **)calloc(PAGER_LATCH_DIRECTORY_SIZE, sizeof(PageLatch *));
+			__atomic_store_n(&pager->latches[directory_num], directory, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&pager->lock);
+	}
+
+	chunk %= PAGER_LATCH_DIRECTORY_SIZE;
+	PageLatch *latches = __atomic_load_n(&directory[chunk], __ATOMIC_ACQUIRE);
+	if(latches == NULL){
+		pthread_mutex_lock(&pager->lock);
+		latches = directory[chunk];
+		if(latches == NULL){
+			pthread_rwlockattr_t attr;
+			pthread_rwlockattr_init(&attr);
+			pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+			latches = (PageLatch *)malloc(PAGER_LATCH_CHUNK_SIZE * sizeof(PageLatch));
+			for(uint32_t i = 0; i < PAGER_LATCH_CHUNK_SIZE; i++){
+				pthread_rwlock_init(&latches[i].latch, &attr);
+				latches[i].version = 0;
+				latches[i].written = 0;
+				latches[i].versions = NULL;
+			}
+			pthread_rwlockattr_destroy(&attr);
+			__atomic_store_n(&directory[chunk], latches, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&pager->lock);
+	}
+
+	return &latches[page_num % PAGER_LATCH_CHUNK_SIZE];
+}
+
+void latch_page(Pager *pager, uint32_t page_num, bool exclusive){
+	PageLatch *latch = page_latch(pager, page_num);
+
+	if(exclusive){
+		pthread_rwlock_wrlock(&latch->latch);
+		mvcc_keep_page(pager, page_num, latch);
+		/* Odd before any change to the page can be seen */
+		__atomic_store_n(&latch->version, latch->version + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	} else{
+		pthread_rwlock_rdlock(&latch->latch);
+	}
+}
+
+void unlatch_page(Pager *pager, uint32_t page_num){
+	PageLatch *latch = page_latch(pager, page_num);
+
+	/* Only the holder of an exclusive latch ever sees the version odd */
+	if(latch->version & 1){
+		__atomic_store_n(&latch->version, latch->version + 1, __ATOMIC_RELEASE);
+	}
+	pthread_rwlock_unlock(&latch->latch);
+}
+
+uint64_t page_version(Pager *pager, uint32_t page_num){
+/*
+ * Start an optimistic read of a page. The page must be pinned.
+ */
+	return __atomic_load_n(&page_latch(pager, page_num)->version, __ATOMIC_ACQUIRE);
+}
+
+bool page_version_unchanged(Pager *pager, uint32_t page_num, uint64_t version){
+/*
+ * End an optimistic read: true if everything read from the page since
+ * page_version returned version is consistent.
+ */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (version & 1) == 0 &&
+		__atomic_load_n(&page_latch(pager, page_num)->version, __ATOMIC_RELAXED) == version;
+}
+
+void page_read(Pager *pager, uint32_t page_num, void *copy){
+/*
+ * Copy a page as it is between two changes. Optimistic first; a reader
+ * that keeps running into the writer waits for a shared latch instead.
+ */
+	void *page = get_page(pager, page_num);
+
+	for(uint32_t attempt = 0; attempt < OPTIMISTIC_READ_ATTEMPTS; attempt++){
+		uint64_t version = page_version(pager, page_num);
+		memcpy(copy, page, PAGE_SIZE);
+		if(page_version_unchanged(pager, page_num, version)){
+			unpin_page(pager, page_num);
+			return;
+		}
+	}
+
+	latch_page(pager, page_num, false);
+	memcpy(copy, page, PAGE_SIZE);
+	unlatch_page(pager, page_num);
+	unpin_page(pager, page_num);
+}
+
+void mark_page_dirty(Pager *pager, uint32_t page_num){
+/*
+ * Must be called while the page is pinned, by whoever modified it. Only
+ * dirty pages are written back on eviction, .flush and db_close.
+ */
+	pthread_mutex_lock(&pager->lock);
+	if(pager->map != NULL){
+		if(page_num >= pager->dirty_pages_size){
+			uint32_t new_size = pager->dirty_pages_size ? pager->dirty_pages_size : 64;
+			while(new_size <= page_num){
+				new_size *= 2;
+			}
+			pager->dirty_pages = (uint8_t *)realloc(pager->dirty_pages, new_size);
+			memset(pager->dirty_pages + pager->dirty_pages_size, 0,
+					new_size - pager->dirty_pages_size);
+			pager->dirty_pages_size = new_size;
+		}
+		pager->dirty_pages[page_num] = true;
+		pthread_mutex_unlock(&pager->lock);
+		return;
+	}
+
+	uint32_t frame_index = page_table_lookup(pager, page_num);
+
+	if(frame_index == INVALID_FRAME ||
+			__atomic_load_n(&pager->frames[frame_index].pin_count, __ATOMIC_RELAXED) == 0){
+		printf("Tried to dirty page %d which is not pinned\n", page_num);
+		exit(EXIT_FAILURE);
+	}
+
+	pager->frames[frame_index].dirty = true;
+	pthread_mutex_unlock(&pager->lock);
+}
+
+Pager *pager_open(const char *filename, DbOptions *options){
+	/* The map reads through the page cache, so O_DIRECT is for the pool only */
+	bool direct = options->use_direct && !options->use_mmap;
+	int fd = open(filename, O_RDWR | O_CREAT | (direct ? O_DIRECT : 0), S_IWUSR | S_IRUSR);
+
+	if(fd == -1 && direct && errno == EINVAL){
+		printf("O_DIRECT is not supported here, using the page cache.\n");
+		direct = false;
+		fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+	}
 	if(fd == -1){
 		printf("Unable to open file\n");
 		exit(EXIT_FAILURE);
 	}
 
-	off_t file_length = lseek(fd, 0, SEEK_END);
+	/* Opening the log replays it, which may grow the db file */
+	Wal *wal = NULL;
+	if(options->use_wal){
+		wal = wal_open(filename, fd, options->group_commit, options->io_backend);
+	}
+
+	off_t file_length = lseek(fd, 0, SEEK_END);
+	
+	Pager *pager = (Pager *)malloc(sizeof(*pager));
+	pager->file_descriptor = fd;
+	pager->file_length = file_length;
+	pager->num_pages = (file_length / PAGE_SIZE);
+
+	if(file_length % PAGE_SIZE != 0){
+		printf("Db file is not a whole number of pages. Corrupt file.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t num_frames = options->pool_frames;
+	if(num_frames == 0){
+		num_frames = PAGER_DEFAULT_FRAMES;
+	}
+	pager->num_frames = num_frames;
+	pager->frames = (Frame *)malloc(num_frames * sizeof(Frame));
+	pager->frame_slab = NULL;
+	pager->frame_slab_size = 0;
+	pager->frame_slab_huge = false;
+	if(!options->use_mmap){
+		pager->frame_slab_size = (size_t)num_frames * PAGE_SIZE;
+		pager->frame_slab = frame_slab_alloc(&pager->frame_slab_size, &pager->frame_slab_huge);
+	}
+	for(uint32_t i = 0; i < num_frames; i++){
+		pager->frames[i].page_num = INVALID_PAGE_NUM;
+		pager->frames[i].pin_count = 0;
+		pager->frames[i].dirty = false;
+		pager->frames[i].referenced = false;
+		pager->frames[i].read_ahead = false;
+		pager->frames[i].hash_next = INVALID_FRAME;
+		pager->frames[i].hits = 0;
+		pager->frames[i].data = pager->frame_slab ?
+			pager->frame_slab + (size_t)i * PAGE_SIZE : NULL;
+	}
+
+	/* Keep the load factor of the page table at or below one half */
+	pager->page_table_size = 2 * num_frames + 1;
+	pager->page_table = (uint32_t *)malloc(pager->page_table_size * sizeof(uint32_t));
+	for(uint32_t i = 0; i < pager->page_table_size; i++){
+		pager->page_table[i] = INVALID_FRAME;
+	}
+
+	pager->clock_hand = 0;
+	pager->hits = 0;
+	pager->misses = 0;
+	pager->reads = 0;
+	pager->evictions = 0;
+	pager->writebacks = 0;
+	pager->read_ahead = 0;
+	pager->read_ahead_hits = 0;
+	pager->read_ahead_wasted = 0;
+	pager->wal = wal;
+	pager->io = io_open(options->io_backend);
+	pager->direct = direct;
+	pager->map = NULL;
+	pager->map_size = 0;
+	pager->dirty_pages = NULL;
+	pager->dirty_pages_size = 0;
+	pthread_mutex_init(&pager->lock, NULL);
+	pager->latches = (PageLatch ***)calloc(PAGER_LATCH_DIRECTORIES, sizeof(PageLatch **));
+	mvcc_open(pager);
+
+	if(options->use_mmap){
+		/*
+		 * Reserve address space well past the end of the file so the map
+		 * rarely has to grow. With the log enabled the map is private:
+		 * changes stay in memory until they are committed to the log, and
+		 * checkpoints write the db file underneath it.
+		 */
+		int flags = (wal != NULL ? MAP_PRIVATE : MAP_SHARED) | MAP_NORESERVE;
+		pager->map_size = PAGER_MMAP_RESERVE;
+		pager->map = mmap(NULL, pager->map_size, PROT_READ | PROT_WRITE,
+				flags, fd, 0);
+		if(pager->map == MAP_FAILED){
+			printf("Unable to map db file: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return pager;
+}
+
+void pager_flush(Pager *pager, uint32_t page_num){
+	pthread_mutex_lock(&pager->lock);
+	uint32_t frame_index = page_table_lookup(pager, page_num);
+
+	if(frame_index == INVALID_FRAME){
+		printf("Tried to flush null page\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pager_write_frame(pager, &pager->frames[frame_index]);
+	pthread_mutex_unlock(&pager->lock);
+}
+
+int compare_frame_page_num(const void *a, const void *b){
+	uint32_t page_a = (*(Frame **)a)->page_num;
+	uint32_t page_b = (*(Frame **)b)->page_num;
+
+	return (page_a > page_b) - (page_a < page_b);
+}
+
+void pager_commit(Pager *pager, uint32_t *page_nums, void **pages, uint32_t num_dirty){
+	wal_append_pages(pager->wal, page_nums, pages, num_dirty);
+	wal_commit(pager->wal, pager->num_pages);
+	pager->writebacks += num_dirty;
+	STATS_ADD(STAT_PAGE_WRITES, num_dirty);
+	wal_maybe_checkpoint(pager->wal);
+}
+
+uint32_t pager_flush_mapped(Pager *pager){
+/*
+ * mmap mode counterpart of pager_flush_dirty(). With the log enabled the map
+ * is private, so the dirty pages are committed to the log straight from
+ * it. Otherwise the map is shared and each run of consecutive dirty pages
+ * is written back with one msync().
+ */
+	uint32_t *page_nums = (uint32_t *)malloc((pager->num_pages + 1) * sizeof(uint32_t));
+	void **pages = (void **)malloc((pager->num_pages + 1) * sizeof(void *));
+	uint32_t num_dirty = 0;
+
+	for(uint32_t i = 0; i < pager->dirty_pages_size; i++){
+		if(pager->dirty_pages[i]){
+			page_nums[num_dirty] = i;
+			pages[num_dirty] = pager->map + (uint64_t)i * PAGE_SIZE;
+			num_dirty++;
+			pager->dirty_pages[i] = false;
+		}
+	}
+
+	if(pager->wal != NULL){
+		if(num_dirty > 0 || pager->wal->write_offset != pager->wal->commit_offset){
+			pager_commit(pager, page_nums, pages, num_dirty);
+		}
+	} else{
+		uint32_t i = 0;
+		while(i < num_dirty){
+			uint32_t run = 1;
+			while(i + run < num_dirty && page_nums[i + run] == page_nums[i] + run){
+				run++;
+			}
+			if(msync(pages[i], (size_t)run * PAGE_SIZE, MS_SYNC) == -1){
+				printf("Error writing: %d\n", errno);
+				exit(EXIT_FAILURE);
+			}
+			i += run;
+		}
+		pager->writebacks += num_dirty;
+		STATS_ADD(STAT_PAGE_WRITES, num_dirty);
+		STATS_ADD(STAT_BYTES_FLUSHED, (uint64_t)num_dirty * PAGE_SIZE);
+	}
+
+	free(page_nums);
+	free(pages);
+	return num_dirty;
+}
+
+uint32_t pager_flush_dirty(Pager *pager){
+/*
+ * Write back every dirty frame in page order. With the log enabled they
+ * are appended to it as one commit. Otherwise they go to the db file as
+ * one batch of writes, one for each run of consecutive page numbers.
+ * Returns the number of pages written. The caller holds pager->lock.
+ */
+	if(pager->map != NULL){
+		return pager_flush_mapped(pager);
+	}
+
+	Frame **dirty = (Frame **)malloc(pager->num_frames * sizeof(Frame *));
+	uint32_t num_dirty = 0;
+
+	for(uint32_t i = 0; i < pager->num_frames; i++){
+		Frame *frame = &pager->frames[i];
+		if(frame->page_num != INVALID_PAGE_NUM && frame->dirty){
+			dirty[num_dirty++] = frame;
+		}
+	}
+	qsort(dirty, num_dirty, sizeof(Frame *), compare_frame_page_num);
+
+	if(pager->wal != NULL){
+		if(num_dirty > 0 || pager->wal->write_offset != pager->wal->commit_offset){
+			uint32_t *page_nums = (uint32_t *)malloc((num_dirty + 1) * sizeof(uint32_t));
+			void **pages = (void **)malloc((num_dirty + 1) * sizeof(void *));
+
+			for(uint32_t i = 0; i < num_dirty; i++){
+				page_nums[i] = dirty[i]->page_num;
+				pages[i] = dirty[i]->data;
+				dirty[i]->dirty = false;
+			}
+			pager_commit(pager, page_nums, pages, num_dirty);
+			free(page_nums);
+			free(pages);
+		}
+		free(dirty);
+		return num_dirty;
+	}
+
+	/* One request per run, all of them submitted together */
+	struct iovec *iov = (struct iovec *)malloc((num_dirty + 1) * sizeof(struct iovec));
+	IoRequest *requests = (IoRequest *)malloc((num_dirty + 1) * sizeof(IoRequest));
+	uint32_t num_requests = 0;
+	uint32_t i = 0;
+	while(i < num_dirty){
+		uint32_t first_page = dirty[i]->page_num;
+		uint32_t run = 0;
+
+		while(i + run < num_dirty && run < IOV_MAX &&
+				dirty[i + run]->page_num == first_page + run){
+			iov[i + run].iov_base = dirty[i + run]->data;
+			iov[i + run].iov_len = PAGE_SIZE;
+			run++;
+		}
+		requests[num_requests++] = (IoRequest){ .write = true,
+			.fd = pager->file_descriptor, .iov = &iov[i], .iov_count = run,
+			.offset = (uint64_t)first_page * PAGE_SIZE };
+
+		if((uint64_t)(first_page + run) * PAGE_SIZE > pager->file_length){
+			pager->file_length = (uint64_t)(first_page + run) * PAGE_SIZE;
+		}
+		i += run;
+	}
+
+	if(!io_run(pager->io, requests, num_requests)){
+		printf("Error writing: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	for(i = 0; i < num_dirty; i++){
+		dirty[i]->dirty = false;
+	}
+	pager->writebacks += num_dirty;
+	STATS_ADD(STAT_PAGE_WRITES, num_dirty);
+	STATS_ADD(STAT_BYTES_FLUSHED, (uint64_t)num_dirty * PAGE_SIZE);
+
+	free(iov);
+	free(requests);
+	free(dirty);
+	return num_dirty;
+}
+
+uint32_t pager_flush_all(Pager *pager){
+	pthread_mutex_lock(&pager->lock);
+	uint32_t pages_written = pager_flush_dirty(pager);
+	pthread_mutex_unlock(&pager->lock);
+
+	return pages_written;
+}
+
+uint32_t pager_checkpoint(Pager *pager){
+/*
+ * Make every change so far durable in the db file itself.
+ */
+	pthread_mutex_lock(&pager->lock);
+	uint32_t pages_written = pager_flush_dirty(pager);
+
+	if(pager->wal != NULL){
+		wal_checkpoint(pager->wal);
+	} else if(fdatasync(pager->file_descriptor) == -1){
+		printf("Error syncing db file: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	pthread_mutex_unlock(&pager->lock);
+
+	return pages_written;
+}
+
+void pager_end_statement(Pager *pager){
+/*
+ * Called after every statement that modified pages. With the log enabled,
+ * group_commit statements share one commit and so one fdatasync().
+ */
+	if(pager->wal == NULL){
+		return;
+	}
+	if(++pager->wal->pending_statements >= pager->wal->group_commit){
+		pager_flush_all(pager);
+	}
+}
+
+/*----------------------MVCC----------------------------------*/
+void mvcc_free_version(Mvcc *mvcc, PageVersion *version){
+/*
+ * The caller holds the mvcc lock.
+ */
+	if(mvcc->num_spare < MVCC_SPARE_VERSIONS){
+		version->next = mvcc->spare;
+		mvcc->spare = version;
+		mvcc->num_spare++;
+	} else{
+		free(version);
+	}
+}
+
+void mvcc_collect(Pager *pager){
+/*
+ * Free the kept images no snapshot can read: those replaced by a write no
+ * later than every open snapshot, and than any snapshot opened from now
+ * on. Images are kept in order of end, and the one freed is always the
+ * oldest of its page. The caller holds the mvcc lock.
+ */
+	Mvcc *mvcc = pager->mvcc;
+	uint64_t oldest = mvcc->committed;
+
+	for(uint32_t i = 0; i < mvcc->num_snapshots; i++){
+		if(mvcc->snapshots[i] < oldest){
+			oldest = mvcc->snapshots[i];
+		}
+	}
+
+	while(mvcc->oldest != NULL && mvcc->oldest->end <= oldest){
+		PageVersion *version = mvcc->oldest;
+		mvcc->oldest = version->next;
+		if(version->newer != NULL){
+			version->newer->older = NULL;
+		} else{
+			page_latch(pager, version->page_num)->versions = NULL;
+		}
+		mvcc_free_version(mvcc, version);
+		mvcc->kept--;
+		mvcc->collected++;
+	}
+	if(mvcc->oldest == NULL){
+		mvcc->newest = NULL;
+	}
+}
+
+void *mvcc_collector_thread(void *arg){
+	Pager *pager = (Pager *)arg;
+	Mvcc *mvcc = pager->mvcc;
+
+	pthread_mutex_lock(&mvcc->lock);
+	while(!mvcc->stop){
+		mvcc_collect(pager);
+		pthread_cond_wait(&mvcc->cond, &mvcc->lock);
+	}
+	pthread_mutex_unlock(&mvcc->lock);
+
+	return NULL;
+}
+
+void mvcc_open(Pager *pager){
+	Mvcc *mvcc = (Mvcc *)malloc(sizeof(*mvcc));
+
+	pthread_mutex_init(&mvcc->lock, NULL);
+	pthread_cond_init(&mvcc->cond, NULL);
+	pthread_cond_init(&mvcc->committed_cond, NULL);
+	mvcc->stop = false;
+	mvcc->committed = 0;
+	mvcc->writing = 0;
+	mvcc->copying = false;
+	mvcc->num_waiting = 0;
+	mvcc->num_snapshots = 0;
+	mvcc->undo = NULL;
+	mvcc->spare = NULL;
+	mvcc->num_spare = 0;
+	mvcc->oldest = NULL;
+	mvcc->newest = NULL;
+	mvcc->kept = 0;
+	mvcc->collected = 0;
+
+	/* Set before the thread starts, it reads pager->mvcc */
+	pager->mvcc = mvcc;
+	if(pthread_create(&mvcc->collector, NULL, mvcc_collector_thread, pager) != 0){
+		printf("Unable to start version collector thread\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void mvcc_close(Mvcc *mvcc){
+/*
+ * No snapshot may still be open.
+ */
+	pthread_mutex_lock(&mvcc->lock);
+	mvcc->stop = true;
+	pthread_cond_signal(&mvcc->cond);
+	pthread_mutex_unlock(&mvcc->lock);
+	pthread_join(mvcc->collector, NULL);
+
+	while(mvcc->oldest != NULL){
+		PageVersion *version = mvcc->oldest;
+		mvcc->oldest = version->next;
+		free(version);
+	}
+	while(mvcc->spare != NULL){
+		PageVersion *version = mvcc->spare;
+		mvcc->spare = version->next;
+		free(version);
+	}
+	pthread_mutex_destroy(&mvcc->lock);
+	pthread_cond_destroy(&mvcc->cond);
+	pthread_cond_destroy(&mvcc->committed_cond);
+	free(mvcc);
+}
+
+void mvcc_publish(Pager *pager, PageVersion *version){
+/*
+ * Keep a copy for snapshots. The caller holds the mvcc lock.
+ */
+	Mvcc *mvcc = pager->mvcc;
+	PageLatch *latch = page_latch(pager, version->page_num);
+
+	version->newer = NULL;
+	version->older = latch->versions;
+	if(version->older != NULL){
+		version->older->newer = version;
+	}
+	latch->versions = version;
+
+	version->next = NULL;
+	if(mvcc->newest != NULL){
+		mvcc->newest->next = version;
+	} else{
+		mvcc->oldest = version;
+	}
+	mvcc->newest = version;
+	mvcc->kept++;
+}
+
+void mvcc_begin_write(Pager *pager){
+/*
+ * Start a write. Writers take turns, so only one is ever in progress. It
+ * copies the pages it changes only if some snapshot may read them.
+ */
+	Mvcc *mvcc = pager->mvcc;
+
+	pthread_mutex_lock(&mvcc->lock);
+	mvcc->writing = mvcc->committed + 1;
+	mvcc->copying = mvcc->num_snapshots > 0 || mvcc->num_waiting > 0;
+	pthread_mutex_unlock(&mvcc->lock);
+}
+
+void mvcc_end_write(Pager *pager){
+/*
+ * Commit the write, once every page it changed is unlatched. Copies that
+ * no snapshot asked for are dropped.
+ */
+	Mvcc *mvcc = pager->mvcc;
+
+	pthread_mutex_lock(&mvcc->lock);
+	mvcc->committed = mvcc->writing;
+	mvcc->writing = 0;
+	if(mvcc->num_waiting > 0){
+		pthread_cond_broadcast(&mvcc->committed_cond);
+	}
+	while(mvcc->undo != NULL){
+		PageVersion *version = mvcc->undo;
+		mvcc->undo = version->next;
+		mvcc_free_version(mvcc, version);
+	}
+	if(mvcc->num_snapshots == 0 && mvcc->kept > 0){
+		pthread_cond_signal(&mvcc->cond);
+	}
+	pthread_mutex_unlock(&mvcc->lock);
+}
+
+void mvcc_keep_page(Pager *pager, uint32_t page_num, PageLatch *latch){
+/*
+ * Called by the writer with page_num just latched exclusive, before it
+ * changes anything. The first time a write that copies latches a page,
+ * the page is copied. The copy is kept if an open snapshot reads it, one no older
+ * than the page; otherwise it only goes on the write's undo list, in case
+ * a snapshot opens before the write commits. A long scan thus makes each
+ * page be kept once, not once for every write to it.
+ */
+	Mvcc *mvcc = pager->mvcc;
+
+	if(mvcc->writing == 0 || latch->written == mvcc->writing){
+		return;
+	}
+	if(!mvcc->copying){
+		__atomic_store_n(&latch->written, mvcc->writing, __ATOMIC_RELEASE);
+		return;
+	}
+
+	pthread_mutex_lock(&mvcc->lock);
+	PageVersion *version = mvcc->spare;
+	if(version != NULL){
+		mvcc->spare = version->next;
+		mvcc->num_spare--;
+	}
+	pthread_mutex_unlock(&mvcc->lock);
+	if(version == NULL){
+		version = (PageVersion *)malloc(sizeof(*version));
+	}
+
+	memcpy(version->image, get_page(pager, page_num), PAGE_SIZE);
+	unpin_page(pager, page_num);
+	version->page_num = page_num;
+	version->begin = latch->written;
+	version->end = mvcc->writing;
+
+	pthread_mutex_lock(&mvcc->lock);
+	bool is_read = false;
+	for(uint32_t i = 0; i < mvcc->num_snapshots; i++){
+		is_read |= mvcc->snapshots[i] >= version->begin;
+	}
+	if(is_read){
+		mvcc_publish(pager, version);
+	} else{
+		version->next = mvcc->undo;
+		mvcc->undo = version;
+	}
+	/* After the copy is reachable, see page_read_snapshot */
+	__atomic_store_n(&latch->written, mvcc->writing, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&mvcc->lock);
+}
+
+uint64_t snapshot_open(Pager *pager){
+/*
+ * Returns the timestamp of a new snapshot, which must be closed with
+ * snapshot_close. A write in progress is not in the snapshot, so the
+ * copies it already made are kept. If it makes none, the snapshot waits
+ * for it to commit and includes it; the write after it copies.
+ */
+	Mvcc *mvcc = pager->mvcc;
+
+	pthread_mutex_lock(&mvcc->lock);
+	mvcc->num_waiting++;
+	while(mvcc->writing != 0 && !mvcc->copying){
+		pthread_cond_wait(&mvcc->committed_cond, &mvcc->lock);
+	}
+	mvcc->num_waiting--;
+	if(mvcc->num_snapshots == MVCC_MAX_SNAPSHOTS){
+		printf("More than %d snapshots open.\n", MVCC_MAX_SNAPSHOTS);
+		exit(EXIT_FAILURE);
+	}
+	uint64_t ts = mvcc->committed;
+	mvcc->snapshots[mvcc->num_snapshots++] = ts;
+
+	/* The undo list is newest first, the kept list must stay by end */
+	PageVersion *undo = NULL;
+	while(mvcc->undo != NULL){
+		PageVersion *version = mvcc->undo;
+		mvcc->undo = version->next;
+		version->next = undo;
+		undo = version;
+	}
+	while(undo != NULL){
+		PageVersion *version = undo;
+		undo = version->next;
+		mvcc_publish(pager, version);
+	}
+	pthread_mutex_unlock(&mvcc->lock);
+
+	return ts;
+}
+
+void snapshot_close(Pager *pager, uint64_t ts){
+	Mvcc *mvcc = pager->mvcc;
+
+	pthread_mutex_lock(&mvcc->lock);
+	for(uint32_t i = 0; i < mvcc->num_snapshots; i++){
+		if(mvcc->snapshots[i] == ts){
+			mvcc->snapshots[i] = mvcc->snapshots[--mvcc->num_snapshots];
+			break;
+		}
+	}
+	pthread_cond_signal(&mvcc->cond);
+	pthread_mutex_unlock(&mvcc->lock);
+}
+
+void mvcc_read_kept(Pager *pager, uint32_t page_num, uint64_t ts, void *copy){
+/*
+ * Copy the image of page_num that snapshot ts reads, for a page a later
+ * write has latched. That write kept the image before it marked the page,
+ * and images a snapshot can read are never collected.
+ */
+	Mvcc *mvcc = pager->mvcc;
+
+	pthread_mutex_lock(&mvcc->lock);
+	PageVersion *kept = page_latch(pager, page_num)->versions;
+	while(kept != NULL && kept->begin > ts){
+		kept = kept->older;
+	}
+	if(kept == NULL || kept->end <= ts){
+		printf("No version of page %d for snapshot %lu.\n", page_num, (unsigned long)ts);
+		exit(EXIT_FAILURE);
+	}
+	memcpy(copy, kept->image, PAGE_SIZE);
+	pthread_mutex_unlock(&mvcc->lock);
+}
+
+void page_read_snapshot(Pager *pager, uint32_t page_num, uint64_t ts, void *copy){
+/*
+ * Copy page_num as snapshot ts sees it: the page itself, read as in
+ * page_read, unless a write after ts latched it. A snapshot only reaches
+ * pages through pages it read, so never one made after ts.
+ */
+	PageLatch *latch = page_latch(pager, page_num);
+	void *page = get_page(pager, page_num);
+
+	for(uint32_t attempt = 0; attempt < OPTIMISTIC_READ_ATTEMPTS; attempt++){
+		uint64_t version = page_version(pager, page_num);
+		if(__atomic_load_n(&latch->written, __ATOMIC_ACQUIRE) > ts){
+			mvcc_read_kept(pager, page_num, ts, copy);
+			unpin_page(pager, page_num);
+			return;
+		}
+		memcpy(copy, page, PAGE_SIZE);
+		if(page_version_unchanged(pager, page_num, version)){
+			unpin_page(pager, page_num);
+			return;
+		}
+	}
+
+	/* No writer can latch the page past us, so written holds still */
+	latch_page(pager, page_num, false);
+	if(latch->written <= ts){
+		memcpy(copy, page, PAGE_SIZE);
+	} else{
+		mvcc_read_kept(pager, page_num, ts, copy);
+	}
+	unlatch_page(pager, page_num);
+	unpin_page(pager, page_num);
+}
+
+/*----------------------Stats----------------------------------*/
+#ifdef DB_STATS
+/*
+ * A thread's Stats is made on its first count and put on stats_threads.
+ * Only that thread writes it, with plain stores made atomic so that a
+ * reader adding the list up sees whole values: the hot paths do no
+ * read-modify-write and take no lock. When the thread exits its counts
+ * move to stats_exited.
+ */
+__thread Stats *thread_stats;
+Stats *stats_threads;
+Stats stats_exited;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t stats_key;
+pthread_once_t stats_key_once = PTHREAD_ONCE_INIT;
+pthread_once_t stats_calibrate_once = PTHREAD_ONCE_INIT;
+double stats_ticks_per_ns;
+
+const char *stats_counter_names[NUM_STATS] = {
+	"page_hits", "page_misses", "page_reads", "page_writes", "bytes_flushed",
+	"checkpoint_pages", "leaf_splits", "internal_splits", "root_splits", "leaves_scanned"
+};
+const char *stats_timer_names[NUM_TIMERS] = { "find", "insert", "scan" };
+
+void stats_merge(Stats *total, Stats *stats){
+	for(uint32_t i = 0; i < NUM_STATS; i++){
+		total->counters[i] += __atomic_load_n(&stats->counters[i], __ATOMIC_RELAXED);
+	}
+	for(uint32_t i = 0; i < NUM_TIMERS; i++){
+		StatsHistogram *to = &total->timers[i], *from = &stats->timers[i];
+
+		to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+		to->ticks += __atomic_load_n(&from->ticks, __ATOMIC_RELAXED);
+		for(uint32_t bucket = 0; bucket < STATS_BUCKETS; bucket++){
+			to->buckets[bucket] += __atomic_load_n(&from->buckets[bucket], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+void stats_thread_exit(void *arg){
+	Stats *stats = (Stats *)arg;
+
+	pthread_mutex_lock(&stats_lock);
+	stats_merge(&stats_exited, stats);
+	Stats **link = &stats_threads;
+	while(*link != stats){
+		link = &(*link)->next;
+	}
+	*link = stats->next;
+	pthread_mutex_unlock(&stats_lock);
+
+	/* Another key's destructor may still count, it gets a new one */
+	thread_stats = NULL;
+	free(stats);
+}
+
+void stats_key_create(){
+	pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+Stats *stats_thread(){
+	if(thread_stats == NULL){
+		Stats *stats = (Stats *)calloc(1, sizeof(Stats));
+
+		pthread_once(&stats_key_once, stats_key_create);
+		pthread_setspecific(stats_key, stats);
+		pthread_mutex_lock(&stats_lock);
+		stats->next = stats_threads;
+		stats_threads = stats;
+		pthread_mutex_unlock(&stats_lock);
+		thread_stats = stats;
+	}
+	return thread_stats;
+}
+
+void stats_add(Stats *stats, StatCounter counter, uint64_t n){
+	__atomic_store_n(&stats->counters[counter], stats->counters[counter] + n, __ATOMIC_RELAXED);
+}
+
+uint64_t stats_ticks(){
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+uint32_t stats_bucket(uint64_t ticks){
+/*
+ * Below 4 a bucket per value, then four per power of two: the top bit
+ * picks the power and the two below it the quarter.
+ */
+	if(ticks < 4){
+		return ticks;
+	}
+	uint32_t log = 63 - __builtin_clzll(ticks);
+	return 4 * (log - 1) + ((ticks >> (log - 2)) & 3);
+}
+
+uint64_t stats_bucket_start(uint32_t bucket){
+	if(bucket < 4){
+		return bucket;
+	}
+	uint32_t log = bucket / 4 + 1;
+	return log >= 64 ? UINT64_MAX : (uint64_t)(4 + bucket % 4) << (log - 2);
+}
+
+void stats_time(Stats *stats, StatTimer timer, uint64_t ticks){
+	StatsHistogram *histogram = &stats->timers[timer];
+
+	/* The TSCs of two cores can be a little apart if the thread moved */
+	if((int64_t)ticks < 0){
+		ticks = 0;
+	}
+	uint32_t bucket = stats_bucket(ticks);
+	__atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&histogram->ticks, histogram->ticks + ticks, __ATOMIC_RELAXED);
+	__atomic_store_n(&histogram->buckets[bucket], histogram->buckets[bucket] + 1,
+			__ATOMIC_RELAXED);
+}
+
+void stats_calibrate(){
+/*
+ * Ticks per nanosecond, from the tick counter against the monotonic
+ * clock over 10 ms. Done once, the first time statistics are reported.
+ */
+	struct timespec start, end;
+	double elapsed_ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	uint64_t first = stats_ticks();
+	do{
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		elapsed_ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+	} while(elapsed_ns < 10e6);
+	stats_ticks_per_ns = (stats_ticks() - first) / elapsed_ns;
+}
+
+void stats_collect(Stats *total){
+	memset(total, 0, sizeof(*total));
+	pthread_mutex_lock(&stats_lock);
+	stats_merge(total, &stats_exited);
+	for(Stats *stats = stats_threads; stats != NULL; stats = stats->next){
+		stats_merge(total, stats);
+	}
+	pthread_mutex_unlock(&stats_lock);
+	pthread_once(&stats_calibrate_once, stats_calibrate);
+}
+
+double stats_percentile_ns(StatsHistogram *histogram, double fraction){
+/*
+ * The end of the bucket holding the given fraction of the timings, so the
+ * true value is at most this and no more than a quarter below.
+ */
+	uint64_t rank = (uint64_t)(fraction * histogram->count + 0.5), seen = 0;
+	uint32_t bucket = 0;
+
+	if(histogram->count == 0){
+		return 0;
+	}
+	if(rank == 0){
+		rank = 1;
+	}
+	while(bucket < STATS_BUCKETS - 1 && seen + histogram->buckets[bucket] < rank){
+		seen += histogram->buckets[bucket++];
+	}
+	return stats_bucket_start(bucket + 1) / stats_ticks_per_ns;
+}
+
+uint32_t table_height(Table *table){
+/*
+ * Levels from the root down the left edge, the same on every path.
+ */
+	uint64_t copy[PAGE_SIZE / sizeof(uint64_t)];
+	uint32_t height = 1;
+
+	page_read(table->pager, table->root_page_num, copy);
+	while(get_node_type(copy) == NODE_INTERNAL){
+		page_read(table->pager, *internal_node_child(copy, 0), copy);
+		height++;
+	}
+	return height;
+}
+
+void stats_print(Table *table){
+	Stats total;
+
+	stats_collect(&total);
+	for(uint32_t i = 0; i < NUM_STATS; i++){
+		printf("%s: %lu\n", stats_counter_names[i], (unsigned long)total.counters[i]);
+	}
+	printf("tree_height: %d\n", table_height(table));
+	for(uint32_t i = 0; i < NUM_TIMERS; i++){
+		StatsHistogram *histogram = &total.timers[i];
+		double mean = histogram->count ? histogram->ticks / stats_ticks_per_ns / histogram->count : 0;
+
+		printf("%s: %lu (mean %.0f ns, p50 %.0f ns, p99 %.0f ns, p99.9 %.0f ns, max %.0f ns)\n",
+				stats_timer_names[i], (unsigned long)histogram->count, mean,
+				stats_percentile_ns(histogram, 0.5), stats_percentile_ns(histogram, 0.99),
+				stats_percentile_ns(histogram, 0.999), stats_percentile_ns(histogram, 1));
+	}
+}
+
+void stats_fprint_json(FILE *out, Table *table){
+/*
+ * One line: {"time": ..., "counters": {...}, "tree_height": ...,
+ * "latency_ns": {"find": {"count": ..., "mean": ..., "p50": ...}, ...}}
+ */
+	struct timespec now;
+	Stats total;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	stats_collect(&total);
+	fprintf(out, "{\"time\": %ld.%03ld, \"counters\": {", (long)now.tv_sec, now.tv_nsec / 1000000);
+	for(uint32_t i = 0; i < NUM_STATS; i++){
+		fprintf(out, "%s\"%s\": %lu", i ? ", " : "", stats_counter_names[i],
+				(unsigned long)total.counters[i]);
+	}
+	fprintf(out, "}, \"tree_height\": %d, \"latency_ns\": {", table_height(table));
+	for(uint32_t i = 0; i < NUM_TIMERS; i++){
+		StatsHistogram *histogram = &total.timers[i];
+		double mean = histogram->count ? histogram->ticks / stats_ticks_per_ns / histogram->count : 0;
+
+		fprintf(out, "%s\"%s\": {\"count\": %lu, \"mean\": %.0f, \"p50\": %.0f, \"p90\": %.0f, "
+				"\"p99\": %.0f, \"p999\": %.0f, \"max\": %.0f}", i ? ", " : "",
+				stats_timer_names[i], (unsigned long)histogram->count, mean,
+				stats_percentile_ns(histogram, 0.5), stats_percentile_ns(histogram, 0.9),
+				stats_percentile_ns(histogram, 0.99), stats_percentile_ns(histogram, 0.999),
+				stats_percentile_ns(histogram, 1));
+	}
+	fprintf(out, "}}\n");
+}
+
+void stats_dump_write(StatsDump *dump){
+/*
+ * Written to a temporary file and renamed over the old dump, so that a
+ * reader never sees half of one.
+ */
+	char temp_filename[PATH_MAX];
+
+	snprintf(temp_filename, sizeof(temp_filename), "%s.tmp", dump->filename);
+	FILE *out = fopen(temp_filename, "w");
+	if(out == NULL){
+		printf("Unable to write statistics to '%s': %d\n", temp_filename, errno);
+		return;
+	}
+	stats_fprint_json(out, dump->table);
+	if(fclose(out) != 0 || rename(temp_filename, dump->filename) == -1){
+		printf("Unable to write statistics to '%s': %d\n", dump->filename, errno);
+	}
+}
+
+void *stats_dump_thread(void *arg){
+	StatsDump *dump = (StatsDump *)arg;
+
+	pthread_mutex_lock(&dump->lock);
+	while(!dump->stop){
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += dump->interval_ms / 1000;
+		deadline.tv_nsec += (long)(dump->interval_ms % 1000) * 1000000;
+		if(deadline.tv_nsec >= 1000000000){
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		int waited = 0;
+		while(!dump->stop && waited != ETIMEDOUT){
+			waited = pthread_cond_timedwait(&dump->cond, &dump->lock, &deadline);
+		}
+		if(dump->stop){
+			break;
+		}
+		pthread_mutex_unlock(&dump->lock);
+		stats_dump_write(dump);
+		pthread_mutex_lock(&dump->lock);
+	}
+	pthread_mutex_unlock(&dump->lock);
+
+	return NULL;
+}
+
+StatsDump *stats_dump_open(Table *table, const char *filename, uint32_t interval_ms){
+/*
+ * Write the statistics to filename as JSON every interval_ms, and once
+ * more at stats_dump_close.
+ */
+	StatsDump *dump = (StatsDump *)malloc(sizeof(*dump));
+
+	dump->table = table;
+	dump->filename = strdup(filename);
+	dump->interval_ms = interval_ms ? interval_ms : STATS_DEFAULT_INTERVAL;
+	dump->stop = false;
+	pthread_mutex_init(&dump->lock, NULL);
+	pthread_cond_init(&dump->cond, NULL);
+	pthread_create(&dump->thread, NULL, stats_dump_thread, dump);
+
+	return dump;
+}
+
+void stats_dump_close(StatsDump *dump){
+	pthread_mutex_lock(&dump->lock);
+	dump->stop = true;
+	pthread_cond_signal(&dump->cond);
+	pthread_mutex_unlock(&dump->lock);
+	pthread_join(dump->thread, NULL);
+
+	stats_dump_write(dump);
+	pthread_mutex_destroy(&dump->lock);
+	pthread_cond_destroy(&dump->cond);
+	free(dump->filename);
+	free(dump);
+}
+#endif
+
+/*----------------------Arena----------------------------------*/
+__thread Arena *thread_arena;
+pthread_key_t arena_key;
+pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+
+void arena_thread_exit(void *arg){
+	Arena *arena = (Arena *)arg;
+
+	for(ArenaBlock *block = arena->first, *next; block != NULL; block = next){
+		next = block->next;
+		free(block);
+	}
+	thread_arena = NULL;
+	free(arena);
+}
+
+void arena_key_create(){
+	pthread_key_create(&arena_key, arena_thread_exit);
+}
+
+Arena *arena_thread(){
+/*
+ * The calling thread's arena, made on first use and freed when the thread
+ * exits, so parallel scan workers clean up after themselves.
+ */
+	if(thread_arena == NULL){
+		Arena *arena = (Arena *)calloc(1, sizeof(Arena));
+
+		pthread_once(&arena_key_once, arena_key_create);
+		pthread_setspecific(arena_key, arena);
+		thread_arena = arena;
+	}
+	return thread_arena;
+}
+
+void *arena_alloc(Arena *arena, size_t size){
+/*
+ * size bytes aligned to ARENA_ALIGN. When the block is full the next one
+ * kept from before is used if it is big enough, otherwise a new one goes
+ * in after the current block.
+ */
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if(arena->block == NULL || arena->used + size > arena->block->size){
+		ArenaBlock **next = arena->block != NULL ? &arena->block->next : &arena->first;
+
+		if(*next == NULL || (*next)->size < size){
+			size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+			ArenaBlock *block = (ArenaBlock *)malloc(sizeof(ArenaBlock) + block_size);
+			if(block == NULL){
+				printf("Unable to allocate arena block\n");
+				exit(EXIT_FAILURE);
+			}
+			block->size = block_size;
+			block->next = *next;
+			*next = block;
+		}
+		arena->block = *next;
+		arena->used = 0;
+	}
+
+	void *memory = arena->block->data + arena->used;
+	arena->used += size;
+	return memory;
+}
+
+ArenaMark arena_mark(Arena *arena){
+	return (ArenaMark){ arena->block, arena->used };
+}
+
+void arena_release(Arena *arena, ArenaMark mark){
+/*
+ * Give back everything taken since mark.
+ */
+	arena->block = mark.block;
+	arena->used = mark.used;
+}
+
+void arena_reset(Arena *arena){
+	arena->block = NULL;
+	arena->used = 0;
+}
+
+/*----------------------db operation----------------------------------*/
+Table *db_open(const char *filename, DbOptions *options) {
+	Pager *pager = pager_open(filename, options);
+
+	Table *table = (Table *)malloc(sizeof(*table));
+	table->pager = pager;
+	table->root_page_num = 0;
+	table->rightmost_leaf = INVALID_PAGE_NUM;
+	memset(table->indexes, 0, sizeof(table->indexes));
+	pthread_mutex_init(&table->writer_lock, NULL);
+	table->scan_threads = options->scan_threads;
+	if(table->scan_threads == 0){
+		table->scan_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	if(pager->num_pages == 0){
+		// New database file. Initialize page 0 as leaf node
+		void *root_node = get_page(pager, 0);
+		init_leaf_node(root_node);
+		set_node_root(root_node, true);
+		mark_page_dirty(pager, 0);
+		unpin_page(pager, 0);
+
+		uint8_t *catalog = get_page(pager, CATALOG_PAGE_NUM);
+		*(uint32_t *)(catalog + CATALOG_MAGIC_OFFSET) = CATALOG_MAGIC;
+		*(uint32_t *)(catalog + CATALOG_FORMAT_VERSION_OFFSET) = CATALOG_FORMAT_VERSION;
+		mark_page_dirty(pager, CATALOG_PAGE_NUM);
+		unpin_page(pager, CATALOG_PAGE_NUM);
+	}
+
+	uint8_t *catalog = get_page(pager, CATALOG_PAGE_NUM);
+	if(*(uint32_t *)(catalog + CATALOG_MAGIC_OFFSET) != CATALOG_MAGIC){
+		printf("Db file has no catalog page, it was created by an older version.\n");
+		exit(EXIT_FAILURE);
+	}
+	if(*(uint32_t *)(catalog + CATALOG_FORMAT_VERSION_OFFSET) != CATALOG_FORMAT_VERSION){
+		printf("Db file was written with another node layout, by an older version.\n");
+		exit(EXIT_FAILURE);
+	}
+	for(uint32_t column = 0; column < NUM_COLUMNS; column++){
+		uint32_t root_page_num = *catalog_index_root(catalog, column);
+		if(root_page_num != 0){
+			table->indexes[column] = index_open(pager, root_page_num);
+		}
+	}
+	unpin_page(pager, CATALOG_PAGE_NUM);
+
+	table->stats_dump = NULL;
+	if(options->stats_file != NULL){
+#ifdef DB_STATS
+		table->stats_dump = stats_dump_open(table, options->stats_file, options->stats_interval);
+#else
+		printf("Statistics are compiled out, build with make STATS=1 to dump them.\n");
+#endif
+	}
+
+	return table;
+}
+
+void db_close(Table *table){
+	Pager *pager = table->pager;
+
+	pager_checkpoint(pager);
+#ifdef DB_STATS
+	/* The last dump counts the checkpoint */
+	if(table->stats_dump != NULL){
+		stats_dump_close(table->stats_dump);
+	}
+#endif
+	if(pager->wal != NULL){
+		wal_close(pager->wal);
+	}
+	if(pager->map != NULL){
+		munmap(pager->map, pager->map_size);
+		free(pager->dirty_pages);
+	}
+	if(pager->frame_slab != NULL){
+		munmap(pager->frame_slab, pager->frame_slab_size);
+	}
+	io_close(pager->io);
+
+	int result = close(pager->file_descriptor);
+	if(result == -1){
+		printf("Error closing db file.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	mvcc_close(pager->mvcc);
+	for(uint32_t directory_num = 0; directory_num < PAGER_LATCH_DIRECTORIES; directory_num++){
+		PageLatch **directory = pager->latches[directory_num];
+		for(uint32_t chunk = 0; directory != NULL && chunk < PAGER_LATCH_DIRECTORY_SIZE; chunk++){
+			if(directory[chunk] == NULL){
+				continue;
+			}
+			for(uint32_t i = 0; i < PAGER_LATCH_CHUNK_SIZE; i++){
+				pthread_rwlock_destroy(&directory[chunk][i].latch);
+			}
+			free(directory[chunk]);
+		}
+		free(directory);
+	}
+	pthread_mutex_destroy(&pager->lock);
+
+	free(pager->latches);
+	free(pager->frames);
+	free(pager->page_table);
+	free(pager);
+	for(uint32_t column = 0; column < NUM_COLUMNS; column++){
+		if(table->indexes[column] != NULL){
+			pthread_mutex_destroy(&table->indexes[column]->writer_lock);
+		}
+		free(table->indexes[column]);
+	}
+	pthread_mutex_destroy(&table->writer_lock);
+	free(table);
+}
+
+/*----------------------Serialize----------------------------------*/
+uint32_t serialized_row_size(Row *row){
+	return USERNAME_OFFSET + strlen(row->username) + strlen(row->email);
+}
+
+uint32_t row_size_at(void *src){
+	return USERNAME_OFFSET + *(uint8_t *)(src + USERNAME_LENGTH_OFFSET) +
+		*(uint8_t *)(src + EMAIL_LENGTH_OFFSET);
+}
+
+uint32_t row_key_at(void *src){
+/*
+ * Cells sit at any offset in a page, so the id is copied out rather than
+ * loaded through a uint32_t pointer.
+ */
+	uint32_t key;
+	memcpy(&key, src + ID_OFFSET, ID_SIZE);
+	return key;
+}
+
+void serialize_row(Row *row, void *dest){
+	uint8_t username_length = strlen(row->username);
+	uint8_t email_length = strlen(row->email);
+
+	memcpy(dest+ID_OFFSET, &row->id, ID_SIZE);
+	memcpy(dest+USERNAME_LENGTH_OFFSET, &username_length, LENGTH_SIZE);
+	memcpy(dest+EMAIL_LENGTH_OFFSET, &email_length, LENGTH_SIZE);
+	memcpy(dest+USERNAME_OFFSET, row->username, username_length);
+	memcpy(dest+USERNAME_OFFSET+username_length, row->email, email_length);
+}
+
+void deserialize_row(void *src, Row *row){
+	uint8_t username_length = *(uint8_t *)(src + USERNAME_LENGTH_OFFSET);
+	uint8_t email_length = *(uint8_t *)(src + EMAIL_LENGTH_OFFSET);
+
+	memcpy(&row->id, src+ID_OFFSET, ID_SIZE);
+	memcpy(row->username, src+USERNAME_OFFSET, username_length);
+	row->username[username_length] = '\0';
+	memcpy(row->email, src+USERNAME_OFFSET+username_length, email_length);
+	row->email[email_length] = '\0';
+}
+
+void row_view(void *cell, RowView *view){
+	view->cell = cell;
+	memcpy(&view->id, cell + ID_OFFSET, ID_SIZE);
+	view->username_length = *(uint8_t *)(cell + USERNAME_LENGTH_OFFSET);
+	view->email_length = *(uint8_t *)(cell + EMAIL_LENGTH_OFFSET);
+	view->username = cell + USERNAME_OFFSET;
+	view->email = view->username + view->username_length;
+}
+
+const char *row_view_column(RowView *view, Column column, uint32_t *length){
+	if(column == COLUMN_USERNAME){
+		*length = view->username_length;
+		return view->username;
+	}
+	*length = view->email_length;
+	return view->email;
+}
+
+/*----------------------Cursor----------------------------------*/
+Cursor *table_seek(Table *table, uint32_t key){
+/*
+ * Position the cursor at the first key >= key. table_find may leave it
+ * one past the last cell of a leaf, in which case it moves on to the
+ * start of the next leaf.
+ */
+	Cursor *cursor = table_find(table, key);
+	uint32_t page_num = cursor->page_num;
+
+	void *node = get_page(table->pager, page_num);
+	cursor->end_of_table = false;
+	if(cursor->cell_num >= *leaf_node_num_cells(node)){
+		uint32_t next_page_num = *leaf_node_next_leaf(node);
+		if(next_page_num == 0){
+			cursor->end_of_table = true;
+		} else{
+			cursor->page_num = next_page_num;
+			cursor->cell_num = 0;
+		}
+	}
+	unpin_page(table->pager, page_num);
+
+	return cursor;
+}
+
+Cursor *table_start(Table *table){
+	return table_seek(table, 0);
+}
+
+void *cursor_decode(Cursor *cursor, void *node){
+/*
+ * Decode the current row of a packed leaf into the cursor. Stepping to
+ * the next row carries on from the last one decoded, anything else
+ * starts over from the restart before the row.
+ */
+	uint32_t cell_num = cursor->cell_num;
+	uint32_t first, offset;
+
+	if(cursor->decoded_page_num == cursor->page_num && cursor->decoded_cell_num == cell_num){
+		return cursor->decoded;
+	}
+	if(cursor->decoded_page_num == cursor->page_num && cursor->decoded_cell_num + 1 == cell_num){
+		first = cell_num;
+		offset = cursor->decoded_next_offset;
+	} else{
+		first = cell_num - cell_num % LEAF_PACKED_RESTART_INTERVAL;
+		offset = *leaf_packed_restart(node, first / LEAF_PACKED_RESTART_INTERVAL);
+	}
+
+	for(uint32_t i = first; i <= cell_num; i++){
+		offset = leaf_packed_decode(node, i, offset, cursor->decoded);
+	}
+	cursor->decoded_page_num = cursor->page_num;
+	cursor->decoded_cell_num = cell_num;
+	cursor->decoded_next_offset = offset;
+
+	return cursor->decoded;
+}
+
+void *cursor_value(Cursor *cursor){
+/*
+ * The page is unpinned before returning, so the value is only valid until
+ * the next call into the pager. Rows of a packed leaf are decoded into
+ * the cursor and stay valid until it moves.
+ */
+	uint32_t page_num = cursor->page_num;
+	void *page = get_page(cursor->table->pager, page_num);
+	unpin_page(cursor->table->pager, page_num);
+
+	if(leaf_node_is_packed(page)){
+		return cursor_decode(cursor, page);
+	}
+	return leaf_node_value(page, cursor->cell_num);
+}
+
+void cursor_release(Cursor *cursor){
+	if(cursor->pinned_page_num != INVALID_PAGE_NUM){
+		unpin_page(cursor->table->pager, cursor->pinned_page_num);
+		cursor->pinned_page_num = INVALID_PAGE_NUM;
+	}
+}
+
+void cursor_view(Cursor *cursor, RowView *view){
+/*
+ * The row under the cursor, read in place. Unlike cursor_value the cursor
+ * keeps the page pinned, until it moves to another page or is closed, so
+ * the view stays valid until then. A row of a packed leaf is decoded into
+ * the cursor, which keeps it just as long.
+ */
+	if(cursor->pinned_page_num != cursor->page_num){
+		cursor_release(cursor);
+		cursor->pinned = get_page(cursor->table->pager, cursor->page_num);
+		cursor->pinned_page_num = cursor->page_num;
+	}
+
+	void *page = cursor->pinned;
+	if(leaf_node_is_packed(page)){
+		row_view(cursor_decode(cursor, page), view);
+	} else{
+		row_view(leaf_node_value(page, cursor->cell_num), view);
+	}
+}
+
+void cursor_close(Cursor *cursor){
+/*
+ * Unpin the cursor's page and give back everything taken from the
+ * thread's arena since the cursor was, so cursors close in the reverse
+ * order they were opened, like scans.
+ */
+	cursor_release(cursor);
+	arena_release(arena_thread(), cursor->mark);
+}
+
+void cursor_advance(Cursor *cursor){
+	uint32_t page_num = cursor->page_num;
+	void *node = get_page(cursor->table->pager, page_num);
+
+	cursor->cell_num += 1;
+	if(cursor->cell_num >= (*leaf_node_num_cells(node))){
+		/* Advance to next leaf node */
+		uint32_t next_page_num = *leaf_node_next_leaf(node);
+		if(next_page_num == 0){
+			/* This was rightmost leaf */
+			cursor->end_of_table = true;
+		} else{
+			cursor->page_num = next_page_num;
+			cursor->cell_num = 0;
+			STATS_ADD(STAT_LEAVES_SCANNED, 1);
+			cursor_release(cursor);
+		}
+	}
+	unpin_page(cursor->table->pager, page_num);
+}
+
+/*----------------------Scan----------------------------------*/
+uint32_t scan_filter_keys(const uint32_t *keys, uint32_t num_keys, uint32_t key_min,
+		uint32_t key_max, uint8_t *selected){
+/*
+ * Set bit i of selected when key_min <= keys[i] <= key_max, and return how
+ * many bits were set. key_min must not be above key_max. SSE2 and AVX2
+ * only compare signed integers, so both sides are biased by 2^31 first.
+ */
+	uint32_t i = 0, num_selected = 0;
+
+	memset(selected, 0, (num_keys + 7) / 8);
+#if defined(__AVX2__)
+	__m256i bias = _mm256_set1_epi32(INT32_MIN);
+	__m256i low = _mm256_set1_epi32((int32_t)(key_min ^ 0x80000000U));
+	__m256i high = _mm256_set1_epi32((int32_t)(key_max ^ 0x80000000U));
+	for(; i + 8 <= num_keys; i += 8){
+		__m256i key = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + i)), bias);
+		__m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(low, key),
+				_mm256_cmpgt_epi32(key, high));
+		uint32_t mask = ~_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xff;
+		selected[i / 8] = mask;
+		num_selected += __builtin_popcount(mask);
+	}
+#elif defined(__SSE2__)
+	__m128i bias = _mm_set1_epi32(INT32_MIN);
+	__m128i low = _mm_set1_epi32((int32_t)(key_min ^ 0x80000000U));
+	__m128i high = _mm_set1_epi32((int32_t)(key_max ^ 0x80000000U));
+	for(; i + 4 <= num_keys; i += 4){
+		__m128i key = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys + i)), bias);
+		__m128i outside = _mm_or_si128(_mm_cmplt_epi32(key, low), _mm_cmpgt_epi32(key, high));
+		uint32_t mask = ~_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xf;
+		selected[i / 8] |= mask << (i % 8);
+		num_selected += __builtin_popcount(mask);
+	}
+#endif
+	for(; i < num_keys; i++){
+		uint32_t in_range = keys[i] - key_min <= key_max - key_min;
+		selected[i / 8] |= in_range << (i % 8);
+		num_selected += in_range;
+	}
+	return num_selected;
+}
+
+Scan *scan_open_at(Table *table, uint64_t snapshot, uint32_t key_min, uint32_t key_max){
+/*
+ * Scan the table as snapshot sees it. The snapshot stays open after
+ * scan_close. The scan comes from the thread's arena, and scan_close
+ * gives back everything taken from it since, so scans close in the
+ * reverse order they were opened.
+ */
+	Arena *arena = arena_thread();
+	ArenaMark mark = arena_mark(arena);
+	Scan *scan = (Scan *)arena_alloc(arena, sizeof(Scan));
+	Pager *pager = table->pager;
+	void *node = scan->leaf;
+	uint32_t page_num = table->root_page_num;
+
+#ifdef DB_STATS
+	scan->started = stats_ticks();
+#endif
+	scan->mark = mark;
+	scan->snapshot = snapshot;
+	scan->owns_snapshot = false;
+	scan->depth = 0;
+	page_read_snapshot(pager, page_num, scan->snapshot, node);
+	while(get_node_type(node) == NODE_INTERNAL){
+		uint32_t child_num = internal_node_find_child(node, key_min);
+
+		memcpy(scan->parent, node, PAGE_SIZE);
+		scan->path[scan->depth] = page_num;
+		scan->path_child[scan->depth] = child_num;
+		scan->path_num_keys[scan->depth] = *internal_node_num_keys(node);
+		scan->depth++;
+		page_num = *internal_node_child(node, child_num);
+		page_read_snapshot(pager, page_num, scan->snapshot, node);
+	}
+	/* Finding the first leaf is what table_find does for a cursor */
+	STATS_TIME_END(TIMER_FIND, scan->started);
+
+	scan->ahead_next = 0;
+	scan->num_ahead = 0;
+	scan->max_window = READ_AHEAD_MAX_LEAVES;
+	if(pager->map == NULL && pager->num_frames / 4 < scan->max_window){
+		scan->max_window = pager->num_frames / 4;
+	}
+	scan->window = READ_AHEAD_MIN_LEAVES < scan->max_window ?
+		READ_AHEAD_MIN_LEAVES : scan->max_window;
+	if(scan->window == 0 || key_min > key_max){
+		scan->depth = 0;
+	}
+	scan->wasted = scan->depth > 0 ? pager_read_ahead_wasted(pager) : 0;
+
+	scan->table = table;
+	scan->page_num = page_num;
+	scan->end_of_table = key_min > key_max;
+	scan->key_min = key_min;
+	scan->key_max = key_max;
+	scan->num_keys = 0;
+	scan->num_selected = 0;
+	scan->decoded_valid = false;
+
+	return scan;
+}
+
+Scan *scan_open(Table *table, uint32_t key_min, uint32_t key_max){
+/*
+ * The scan sees the table as it was when it was opened, and must be
+ * closed with scan_close.
+ */
+	Scan *scan = scan_open_at(table, snapshot_open(table->pager), key_min, key_max);
+
+	scan->owns_snapshot = true;
+	return scan;
+}
+
+void scan_close(Scan *scan){
+	STATS_TIME_END(TIMER_SCAN, scan->started);
+	if(scan->owns_snapshot){
+		snapshot_close(scan->table->pager, scan->snapshot);
+	}
+	arena_release(arena_thread(), scan->mark);
+}
+
+uint32_t scan_list_leaf(Scan *scan){
+/*
+ * The leaf after the last one listed, found by climbing the path to the
+ * nearest node with a child left and going down the left edge of that
+ * child. INVALID_PAGE_NUM when there is none, or it only holds keys above
+ * key_max.
+ */
+	Pager *pager = scan->table->pager;
+	void *node = scan->parent;
+	uint32_t level = scan->depth;
+
+	while(level > 0 && scan->path_child[level - 1] >= scan->path_num_keys[level - 1]){
+		level--;
+	}
+	if(level == 0){
+		scan->depth = 0;
+		return INVALID_PAGE_NUM;
+	}
+	level--;
+	if(level != scan->depth - 1){
+		page_read_snapshot(pager, scan->path[level], scan->snapshot, node);
+	}
+
+	/* Every key under the next child is above the key before it */
+	uint32_t child_num = ++scan->path_child[level];
+	if(*internal_node_key(node, child_num - 1) >= scan->key_max){
+		scan->depth = 0;
+		return INVALID_PAGE_NUM;
+	}
+
+	uint32_t page_num = *internal_node_child(node, child_num);
+	for(level++; level < scan->depth; level++){
+		page_read_snapshot(pager, page_num, scan->snapshot, node);
+		scan->path[level] = page_num;
+		scan->path_child[level] = 0;
+		scan->path_num_keys[level] = *internal_node_num_keys(node);
+		page_num = *internal_node_child(node, 0);
+	}
+	return page_num;
+}
+
+void scan_read_ahead(Scan *scan){
+/*
+ * List the next window of leaves after those already read ahead and
+ * start reading them. Called when half of the last window is used up, so
+ * the window grows with the scan, unless leaves read ahead were evicted
+ * unused since the last one.
+ */
+	Pager *pager = scan->table->pager;
+	uint32_t left = scan->num_ahead - scan->ahead_next;
+	uint64_t wasted = pager_read_ahead_wasted(pager);
+
+	if(wasted > scan->wasted){
+		scan->window = scan->window / 2 > READ_AHEAD_MIN_LEAVES ?
+			scan->window / 2 : READ_AHEAD_MIN_LEAVES;
+	} else if(scan->num_ahead > 0){
+		scan->window = 2 * scan->window;
+	}
+	if(scan->window > scan->max_window){
+		scan->window = scan->max_window;
+	}
+	scan->wasted = wasted;
+
+	memmove(scan->ahead, scan->ahead + scan->ahead_next, left * sizeof(uint32_t));
+	scan->ahead_next = 0;
+	scan->num_ahead = left;
+	while(scan->num_ahead < scan->window){
+		uint32_t page_num = scan_list_leaf(scan);
+		if(page_num == INVALID_PAGE_NUM){
+			break;
+		}
+		scan->ahead[scan->num_ahead++] = page_num;
+	}
+	pager_read_ahead(pager, scan->ahead + left, scan->num_ahead - left);
+}
+
+bool scan_next(Scan *scan){
+/*
+ * Read the next leaf into scan. Keys are sorted, so once a leaf reaches
+ * key_max there is nothing left to read after it. Leaves are read as of
+ * the snapshot, so a writer splitting them meanwhile changes nothing the
+ * scan sees.
+ */
+	if(scan->end_of_table){
+		return false;
+	}
+
+	void *node = scan->leaf;
+
+	if(scan->ahead_next < scan->num_ahead){
+		if(scan->ahead[scan->ahead_next] == scan->page_num){
+			scan->ahead_next++;
+		} else{
+			/* Not where the parents said, so they cannot tell what comes next */
+			scan->depth = 0;
+			scan->ahead_next = scan->num_ahead;
+		}
+	}
+	if(scan->depth > 0 && 2 * (scan->num_ahead - scan->ahead_next) <= scan->window){
+		scan_read_ahead(scan);
+	}
+
+	page_read_snapshot(scan->table->pager, scan->page_num, scan->snapshot, node);
+	STATS_ADD(STAT_LEAVES_SCANNED, 1);
+	scan->decoded_valid = false;
+	scan->num_keys = leaf_node_copy_keys(node, scan->keys);
+	scan->page_num = *leaf_node_next_leaf(node);
+
+	scan->num_selected = scan_filter_keys(scan->keys, scan->num_keys,
+			scan->key_min, scan->key_max, scan->selected);
+	if(scan->page_num == 0 ||
+			(scan->num_keys > 0 && scan->keys[scan->num_keys - 1] >= scan->key_max)){
+		scan->end_of_table = true;
+	}
+	return true;
+}
+
+void *scan_value(Scan *scan, uint32_t cell_num){
+/*
+ * The serialized row at cell_num of the last leaf read. Rows of a packed
+ * leaf are decoded into the scan, carrying on from the previous row when
+ * they are read in order, as cursor_decode does.
+ */
+	void *node = scan->leaf;
+	uint32_t first, offset;
+
+	if(!leaf_node_is_packed(node)){
+		return leaf_node_value(node, cell_num);
+	}
+	if(scan->decoded_valid && scan->decoded_cell_num == cell_num){
+		return scan->decoded;
+	}
+	if(scan->decoded_valid && scan->decoded_cell_num + 1 == cell_num){
+		first = cell_num;
+		offset = scan->decoded_next_offset;
+	} else{
+		first = cell_num - cell_num % LEAF_PACKED_RESTART_INTERVAL;
+		offset = *leaf_packed_restart(node, first / LEAF_PACKED_RESTART_INTERVAL);
+	}
+
+	for(uint32_t i = first; i <= cell_num; i++){
+		offset = leaf_packed_decode(node, i, offset, scan->decoded);
+	}
+	scan->decoded_valid = true;
+	scan->decoded_cell_num = cell_num;
+	scan->decoded_next_offset = offset;
+
+	return scan->decoded;
+}
+
+/*----------------------Parallel scan----------------------------------*/
+int compare_column(Row *a, Row *b, Column column){
+	if(column == COLUMN_ID){
+		return (a->id > b->id) - (a->id < b->id);
+	}
+	return strcmp(row_column(a, column), row_column(b, column));
+}
+
+void aggregate_row(ScanResult *result, Statement *statement, Row *row){
+/*
+ * Fold row into min or max. Of equal values the first one stays, so
+ * merging ranges in key order gives what one scan would.
+ */
+	if(statement->projection != PROJECT_MIN && statement->projection != PROJECT_MAX){
+		return;
+	}
+
+	int order = result->found ? compare_column(row, &result->row, statement->aggregate) : 0;
+	if(!result->found || (statement->projection == PROJECT_MIN ? order < 0 : order > 0)){
+		result->row = *row;
+		result->found = true;
+	}
+}
+
+int compare_view_column(RowView *view, Row *row, Column column){
+	if(column == COLUMN_ID){
+		return (view->id > row->id) - (view->id < row->id);
+	}
+
+	uint32_t length;
+	const char *value = row_view_column(view, column, &length);
+	const char *other = row_column(row, column);
+	uint32_t other_length = strlen(other);
+	int order = memcmp(value, other, length < other_length ? length : other_length);
+	return order != 0 ? order : (length > other_length) - (length < other_length);
+}
+
+void aggregate_view(ScanResult *result, Statement *statement, RowView *view){
+/*
+ * aggregate_row for a row read in place, only copied out when it becomes
+ * the min or max. For min(id) and max(id) the view need only have the id.
+ */
+	if(statement->projection != PROJECT_MIN && statement->projection != PROJECT_MAX){
+		return;
+	}
+
+	int order = result->found ? compare_view_column(view, &result->row, statement->aggregate) : 0;
+	if(!result->found || (statement->projection == PROJECT_MIN ? order < 0 : order > 0)){
+		if(statement->aggregate == COLUMN_ID){
+			result->row.id = view->id;
+		} else{
+			deserialize_row(view->cell, &result->row);
+		}
+		result->found = true;
+	}
+}
+
+void scan_range(Table *table, uint64_t snapshot, Statement *statement, uint32_t key_min,
+		uint32_t key_max, ScanResult *result){
+/*
+ * Scan [key_min, key_max] as snapshot sees it into result. Rows are only
+ * read for select and for min or max of a string column, everything else
+ * runs on the keys of whole leaves. Rows are read in place in the leaf
+ * the scan copied, nothing is copied or allocated per row.
+ */
+	Scan *scan = scan_open_at(table, snapshot, key_min, key_max);
+	Projection projection = statement->projection;
+	bool needs_rows = projection == PROJECT_ROW ||
+		((projection == PROJECT_MIN || projection == PROJECT_MAX) &&
+		 statement->aggregate != COLUMN_ID);
+	RowView view;
+
+	while(scan_next(scan)){
+		result->count += scan->num_selected;
+		if(projection == PROJECT_COUNT || scan->num_selected == 0){
+			continue;
+		}
+		if(!needs_rows && projection != PROJECT_ID){
+			/* min(id), max(id): keys are sorted, so one per leaf decides */
+			uint32_t cell_num = 0;
+			while(!(scan->selected[cell_num / 8] & (1 << (cell_num % 8)))){
+				cell_num++;
+			}
+			if(projection == PROJECT_MAX){
+				cell_num += scan->num_selected - 1;
+			}
+			view.id = scan->keys[cell_num];
+			aggregate_view(result, statement, &view);
+			continue;
+		}
+		for(uint32_t byte = 0; byte < (scan->num_keys + 7) / 8; byte++){
+			uint32_t mask = scan->selected[byte];
+			while(mask){
+				uint32_t cell_num = byte * 8 + __builtin_ctz(mask);
+				mask &= mask - 1;
+
+				if(projection == PROJECT_ID){
+					write_id(result, scan->keys[cell_num]);
+					continue;
+				}
+				/* A select, or min or max of a string column */
+				row_view(scan_value(scan, cell_num), &view);
+				if(projection == PROJECT_ROW){
+					write_view(result, &view);
+				} else{
+					aggregate_view(result, statement, &view);
+				}
+			}
+		}
+	}
+	scan_close(scan);
+	write_flush(result);
+}
+
+uint32_t table_split_keys(Table *table, uint64_t snapshot, uint32_t key_min,
+		uint32_t key_max, uint32_t max_keys, uint32_t *keys){
+/*
+ * Choose up to max_keys keys in [key_min, key_max), in order, that cut
+ * the range into pieces of about the same size. An internal node key is
+ * the largest key under its child, so pieces ending at them line up with
+ * subtrees. Levels are read from the root down until enough keys are
+ * found, reading at most PARALLEL_SCAN_MAX_NODES nodes of one level.
+ */
+	Pager *pager = table->pager;
+	uint64_t node_copy[PAGE_SIZE / sizeof(uint64_t)];
+	void *node = node_copy;
+	uint32_t *level = (uint32_t *)malloc(PARALLEL_SCAN_MAX_NODES * sizeof(uint32_t));
+	uint32_t *next_level = (uint32_t *)malloc(PARALLEL_SCAN_MAX_NODES * sizeof(uint32_t));
+	uint32_t level_size = 1, num_found = 0, found_size = 0;
+	uint32_t *found = NULL;
+	bool is_last_level = false;
+
+	level[0] = table->root_page_num;
+	while(level_size > 0 && num_found < max_keys && !is_last_level){
+		uint32_t next_size = 0;
+
+		for(uint32_t i = 0; i < level_size; i++){
+			page_read_snapshot(pager, level[i], snapshot, node);
+			if(get_node_type(node) != NODE_INTERNAL){
+				next_size = 0;
+				break;
+			}
+
+			uint32_t num_keys = *internal_node_num_keys(node);
+			for(uint32_t child = 0; child <= num_keys; child++){
+				/* Child holds the keys above key child - 1 up to key child */
+				if((child < num_keys && *internal_node_key(node, child) < key_min) ||
+						(child > 0 && *internal_node_key(node, child - 1) >= key_max)){
+					continue;
+				}
+				if(child < num_keys && *internal_node_key(node, child) < key_max){
+					if(num_found == found_size){
+						found_size = found_size ? found_size * 2 : 64;
+						found = (uint32_t *)realloc(found, found_size * sizeof(uint32_t));
+					}
+					found[num_found++] = *internal_node_key(node, child);
+				}
+				if(next_size == PARALLEL_SCAN_MAX_NODES){
+					is_last_level = true;
+				} else{
+					next_level[next_size++] = *internal_node_child(node, child);
+				}
+			}
+		}
+
+		uint32_t *swap = level;
+		level = next_level;
+		next_level = swap;
+		level_size = next_size;
+	}
+
+	/* Levels were read one after another, their keys interleave */
+	uint32_t num_unique = 0;
+	if(num_found > 0){
+		qsort(found, num_found, sizeof(uint32_t), compare_uint32);
+	}
+	for(uint32_t i = 0; i < num_found; i++){
+		if(num_unique == 0 || found[i] != found[num_unique - 1]){
+			found[num_unique++] = found[i];
+		}
+	}
+
+	uint32_t num_keys = num_unique < max_keys ? num_unique : max_keys;
+	for(uint32_t i = 0; i < num_keys; i++){
+		keys[i] = found[(uint64_t)(i + 1) * num_unique / (num_keys + 1)];
+	}
+
+	free(found);
+	free(level);
+	free(next_level);
+	return num_keys;
+}
+
+void *parallel_scan_worker(void *arg){
+	ParallelScan *parallel = (ParallelScan *)arg;
+	Statement *statement = parallel->statement;
+	bool prints = statement->projection == PROJECT_ROW || statement->projection == PROJECT_ID;
+
+	while(true){
+		uint32_t range = __atomic_fetch_add(&parallel->next_range, 1, __ATOMIC_RELAXED);
+		if(range >= parallel->num_ranges){
+			break;
+		}
+
+		uint32_t key_min = range == 0 ? statement->key_min : parallel->splits[range - 1] + 1;
+		uint32_t key_max = range == parallel->num_ranges - 1 ?
+			statement->key_max : parallel->splits[range];
+		ScanResult *result = &parallel->results[range];
+
+		if(prints){
+			result->out = open_memstream(&parallel->buffers[range],
+					&parallel->buffer_sizes[range]);
+		}
+		scan_range(parallel->table, parallel->snapshot, statement, key_min, key_max, result);
+		if(prints){
+			fclose(result->out);
+		}
+
+		pthread_mutex_lock(&parallel->lock);
+		parallel->done[range] = true;
+		pthread_cond_broadcast(&parallel->cond);
+		pthread_mutex_unlock(&parallel->lock);
+	}
+	return NULL;
+}
+
+bool scan_parallel(Table *table, uint64_t snapshot, Statement *statement, ScanResult *result){
+/*
+ * Scan the statement's id range with up to table->scan_threads threads.
+ * There are PARALLEL_SCAN_RANGES_PER_THREAD ranges for every thread, so
+ * one that draws ranges with fewer keys simply takes more of them. Each
+ * range prints into its own buffer, and the calling thread copies the
+ * buffers to stdout in key order as they are finished, merging the rest
+ * of the results on the way. Returns false, having done nothing, when
+ * the range cannot be split.
+ */
+	uint32_t threads = table->scan_threads;
+	if(threads < 2 || statement->key_min > statement->key_max){
+		return false;
+	}
+
+	uint32_t max_splits = threads * PARALLEL_SCAN_RANGES_PER_THREAD - 1;
+	uint32_t *splits = (uint32_t *)malloc(max_splits * sizeof(uint32_t));
+	uint32_t num_splits = table_split_keys(table, snapshot, statement->key_min,
+			statement->key_max, max_splits, splits);
+	if(num_splits == 0){
+		free(splits);
+		return false;
+	}
+
+	ParallelScan parallel = {
+		.table = table,
+		.statement = statement,
+		.snapshot = snapshot,
+		.splits = splits,
+		.num_ranges = num_splits + 1,
+		.next_range = 0
+	};
+	parallel.results = (ScanResult *)calloc(parallel.num_ranges, sizeof(ScanResult));
+	parallel.buffers = (char **)calloc(parallel.num_ranges, sizeof(char *));
+	parallel.buffer_sizes = (size_t *)calloc(parallel.num_ranges, sizeof(size_t));
+	parallel.done = (bool *)calloc(parallel.num_ranges, sizeof(bool));
+	for(uint32_t range = 0; range < parallel.num_ranges; range++){
+		parallel.results[range].binary = result->binary;
+	}
+	pthread_mutex_init(&parallel.lock, NULL);
+	pthread_cond_init(&parallel.cond, NULL);
+
+	if(threads > parallel.num_ranges){
+		threads = parallel.num_ranges;
+	}
+	pthread_t *workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+	for(uint32_t i = 0; i < threads; i++){
+		if(pthread_create(&workers[i], NULL, parallel_scan_worker, &parallel) != 0){
+			printf("Unable to start scan thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for(uint32_t range = 0; range < parallel.num_ranges; range++){
+		pthread_mutex_lock(&parallel.lock);
+		while(!parallel.done[range]){
+			pthread_cond_wait(&parallel.cond, &parallel.lock);
+		}
+		pthread_mutex_unlock(&parallel.lock);
+
+		if(parallel.buffers[range] != NULL){
+			fwrite(parallel.buffers[range], 1, parallel.buffer_sizes[range], result->out);
+			free(parallel.buffers[range]);
+		}
+		result->count += parallel.results[range].count;
+		if(parallel.results[range].found){
+			aggregate_row(result, statement, &parallel.results[range].row);
+		}
+	}
+
+	for(uint32_t i = 0; i < threads; i++){
+		pthread_join(workers[i], NULL);
+	}
+	pthread_mutex_destroy(&parallel.lock);
+	pthread_cond_destroy(&parallel.cond);
+	free(workers);
+	free(parallel.done);
+	free(parallel.buffer_sizes);
+	free(parallel.buffers);
+	free(parallel.results);
+	free(splits);
+	return true;
+}
+
+/*----------------------Bulk load----------------------------------*/
+BulkLoader *bulk_load_begin(Table *table, uint32_t fill_percent){
+/*
+ * Only an empty table can be bulk loaded, NULL is returned otherwise.
+ * fill_percent is how full each leaf and internal node is packed.
+ */
+	void *root = get_page(table->pager, table->root_page_num);
+	bool is_empty = get_node_type(root) == NODE_LEAF && *leaf_node_num_cells(root) == 0;
+	unpin_page(table->pager, table->root_page_num);
+
+	if(!is_empty){
+		return NULL;
+	}
+	if(fill_percent == 0 || fill_percent > 100){
+		fill_percent = BULK_LOAD_DEFAULT_FILL;
+	}
+
+	BulkLoader *loader = (BulkLoader *)calloc(1, sizeof(*loader));
+	loader->table = table;
+	loader->fill_percent = fill_percent;
+	loader->run_buffer = (uint8_t *)malloc(BULK_LOAD_RUN_BYTES);
+	loader->leaf = malloc(PAGE_SIZE);
+	init_leaf_node(loader->leaf);
+	loader->next_page_num = get_unused_page_num(table->pager);
+
+	return loader;
+}
+
+int compare_bulk_load_entry(const void *a, const void *b){
+/*
+ * Equal keys keep their input order, so the first of a set of
+ * duplicates is the one that gets loaded.
+ */
+	const BulkLoadEntry *x = a, *y = b;
+
+	if(x->key != y->key){
+		return x->key < y->key ? -1 : 1;
+	}
+	return x->offset < y->offset ? -1 : (x->offset > y->offset);
+}
+
+void bulk_load_spill_run(BulkLoader *loader){
+	FILE *run = tmpfile();
+	if(run == NULL){
+		printf("Error creating bulk load run: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+
+	qsort(loader->entries, loader->num_entries, sizeof(BulkLoadEntry),
+			compare_bulk_load_entry);
+	for(uint32_t i = 0; i < loader->num_entries; i++){
+		void *row = loader->run_buffer + loader->entries[i].offset;
+		fwrite(row, row_size_at(row), 1, run);
+	}
+	if(fflush(run) != 0 || ferror(run)){
+		printf("Error writing bulk load run: %d\n", errno);
+		exit(EXIT_FAILURE);
+	}
+	rewind(run);
+
+	loader->runs = (FILE **)realloc(loader->runs, (loader->num_runs + 1) * sizeof(FILE *));
+	loader->runs[loader->num_runs++] = run;
+	loader->run_bytes = 0;
+	loader->num_entries = 0;
+}
+
+void bulk_load_add_cell(BulkLoader *loader, void *cell){
+/*
+ * Add a leaf cell that is already serialized, keyed by its first field.
+ */
+	uint32_t cell_size = row_size_at(cell);
+
+	if(loader->run_bytes + cell_size > BULK_LOAD_RUN_BYTES){
+		bulk_load_spill_run(loader);
+	}
+	if(loader->num_entries == loader->entries_capacity){
+		loader->entries_capacity = loader->entries_capacity ? loader->entries_capacity * 2 : 1024;
+		loader->entries = (BulkLoadEntry *)realloc(loader->entries,
+				loader->entries_capacity * sizeof(BulkLoadEntry));
+	}
+
+	memcpy(loader->run_buffer + loader->run_bytes, cell, cell_size);
+	loader->entries[loader->num_entries].key = row_key_at(cell);
+	loader->entries[loader->num_entries].offset = loader->run_bytes;
+	loader->num_entries++;
+	loader->run_bytes += cell_size;
+}
+
+void bulk_load_add(BulkLoader *loader, Row *row){
+	uint8_t cell[ROW_SIZE];
+
+	serialize_row(row, cell);
+	bulk_load_add_cell(loader, cell);
+}
+
+void bulk_load_write_leaf(BulkLoader *loader, bool is_last){
+/*
+ * Leaves get consecutive pages, so the next leaf is always the next page.
+ * A load that fits in one leaf writes it straight into the root page.
+ */
+	Pager *pager = loader->table->pager;
+	void *leaf = loader->leaf;
+	bool is_root = is_last && loader->num_leaves == 0;
+	uint32_t page_num = is_root ? loader->table->root_page_num : loader->next_page_num++;
+
+	if(loader->pack_leaves){
+		uint8_t *rows[LEAF_PACKED_MAX_CELLS];
+		for(uint32_t i = 0; i < loader->num_staged; i++){
+			rows[i] = loader->staged + i * ROW_SIZE;
+		}
+		leaf_node_pack(leaf, rows, loader->num_staged);
+		loader->num_staged = 0;
+		loader->staged_string_bytes = 0;
+	}
+
+	set_node_root(leaf, is_root);
+	*leaf_node_next_leaf(leaf) = is_last ? 0 : loader->next_page_num;
+
+	void *page = get_page(pager, page_num);
+	memcpy(page, leaf, PAGE_SIZE);
+	mark_page_dirty(pager, page_num);
+	unpin_page(pager, page_num);
+
+	if(loader->num_leaves == loader->leaves_capacity){
+		loader->leaves_capacity = loader->leaves_capacity ? loader->leaves_capacity * 2 : 64;
+		loader->leaves = (BulkLoadChild *)realloc(loader->leaves,
+				loader->leaves_capacity * sizeof(BulkLoadChild));
+	}
+	loader->leaves[loader->num_leaves].page_num = page_num;
+	loader->leaves[loader->num_leaves].max_key =
+		leaf_node_key_at(leaf, *leaf_node_num_cells(leaf) - 1);
+	loader->num_leaves++;
+
+	init_leaf_node(leaf);
+}
+
+void bulk_load_stage(BulkLoader *loader, void *cell){
+/*
+ * Packed leaves: hold the row back for the current leaf, writing the
+ * leaf out first if its packed size would pass fill_percent of the page.
+ */
+	uint32_t num_staged = loader->num_staged;
+
+	if(loader->staged == NULL){
+		loader->staged = (uint8_t *)malloc(LEAF_PACKED_MAX_CELLS * ROW_SIZE);
+	}
+
+	uint8_t *prev_row = (num_staged % LEAF_PACKED_RESTART_INTERVAL) ?
+		loader->staged + (num_staged - 1) * ROW_SIZE : NULL;
+	uint32_t string_bytes = loader->staged_string_bytes + leaf_packed_row_size(cell, prev_row);
+
+	if(num_staged > 0){
+		uint32_t key_range = row_key_at(cell) -
+			row_key_at(loader->staged);
+		uint32_t size = LEAF_PACKED_HEADER_SIZE +
+			leaf_packed_num_restarts(num_staged + 1) * LEAF_PACKED_RESTART_SIZE +
+			leaf_packed_key_bytes(num_staged + 1, leaf_packed_key_bits(key_range)) +
+			string_bytes;
+
+		if(size > PAGE_SIZE * loader->fill_percent / 100 || num_staged == LEAF_PACKED_MAX_CELLS){
+			bulk_load_write_leaf(loader, false);
+			num_staged = 0;
+			string_bytes = leaf_packed_row_size(cell, NULL);
+		}
+	}
+
+	memcpy(loader->staged + num_staged * ROW_SIZE, cell, row_size_at(cell));
+	loader->num_staged = num_staged + 1;
+	loader->staged_string_bytes = string_bytes;
+}
+
+void bulk_load_emit(BulkLoader *loader, void *cell){
+/*
+ * Append the next row in key order to the current leaf, starting a new
+ * leaf once this one holds fill_percent of its cell space.
+ */
+	void *leaf = loader->leaf;
+	uint32_t key = row_key_at(cell);
+	uint32_t cell_size = row_size_at(cell) + LEAF_NODE_SLOT_SIZE;
+
+	if(loader->rows_loaded > 0 && key <= loader->last_key && !loader->keep_duplicates){
+		loader->duplicates++;
+		return;
+	}
+
+	if(loader->pack_leaves){
+		bulk_load_stage(loader, cell);
+		loader->last_key = key;
+		loader->rows_loaded++;
+		return;
+	}
+
+	uint32_t free_space = leaf_node_free_space(leaf);
+	uint32_t used = LEAF_NODE_SPACE_FOR_CELLS - free_space;
+	uint32_t target = LEAF_NODE_SPACE_FOR_CELLS * loader->fill_percent / 100;
+
+	if(*leaf_node_num_cells(leaf) > 0 && (used + cell_size > target || cell_size > free_space)){
+		bulk_load_write_leaf(loader, false);
+	}
+
+	leaf_node_append_cell(leaf, cell, cell_size - LEAF_NODE_SLOT_SIZE);
+	loader->last_key = key;
+	loader->rows_loaded++;
+}
+
+void bulk_load_heap_sift(uint32_t *heap, uint32_t size, uint32_t i, uint8_t *heads){
+/*
+ * heap holds run numbers ordered by the key of each run's current row,
+ * ties broken by run number so duplicates keep their input order.
+ */
+	while(true){
+		uint32_t smallest = i;
+		for(uint32_t child = 2 * i + 1; child <= 2 * i + 2 && child < size; child++){
+			uint32_t child_key = row_key_at(heads + heap[child] * ROW_SIZE);
+			uint32_t smallest_key = row_key_at(heads + heap[smallest] * ROW_SIZE);
+			if(child_key < smallest_key ||
+					(child_key == smallest_key && heap[child] < heap[smallest])){
+				smallest = child;
+			}
+		}
+		if(smallest == i){
+			return;
+		}
+		uint32_t tmp = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = tmp;
+		i = smallest;
+	}
+}
+
+bool bulk_load_read_row(FILE *run, uint8_t *row){
+	if(fread(row, USERNAME_OFFSET, 1, run) != 1){
+		return false;
+	}
+	uint32_t rest = row_size_at(row) - USERNAME_OFFSET;
+	if(rest > 0 && fread(row + USERNAME_OFFSET, rest, 1, run) != 1){
+		printf("Error reading bulk load run.\n");
+		exit(EXIT_FAILURE);
+	}
+	return true;
+}
+
+void bulk_load_merge_runs(BulkLoader *loader){
+	uint32_t num_runs = loader->num_runs;
+	uint8_t *heads = (uint8_t *)malloc(num_runs * ROW_SIZE);
+	uint32_t *heap = (uint32_t *)malloc(num_runs * sizeof(uint32_t));
+	uint32_t heap_size = 0;
+
+	for(uint32_t i = 0; i < num_runs; i++){
+		if(bulk_load_read_row(loader->runs[i], heads + i * ROW_SIZE)){
+			heap[heap_size++] = i;
+		}
+	}
+	for(uint32_t i = heap_size / 2; i-- > 0; ){
+		bulk_load_heap_sift(heap, heap_size, i, heads);
+	}
+
+	while(heap_size > 0){
+		uint32_t run = heap[0];
+		bulk_load_emit(loader, heads + run * ROW_SIZE);
+		if(!bulk_load_read_row(loader->runs[run], heads + run * ROW_SIZE)){
+			heap[0] = heap[--heap_size];
+		}
+		bulk_load_heap_sift(heap, heap_size, 0, heads);
+	}
+
+	for(uint32_t i = 0; i < num_runs; i++){
+		fclose(loader->runs[i]);
+	}
+	free(heap);
+	free(heads);
+}
+
+void bulk_load_build_levels(BulkLoader *loader){
+/*
+ * Each pass groups the nodes of one level under new internal nodes,
+ * spread evenly so that none is left with a single child. The level
+ * that fits in one node goes into the root page.
+ */
+	Pager *pager = loader->table->pager;
+	BulkLoadChild *children = loader->leaves;
+	uint32_t num_children = loader->num_leaves;
+	uint32_t per_node = (INTERNAL_NODE_MAX_CELLS + 1) * loader->fill_percent / 100;
+	bool is_root = false;
+
+	if(per_node < 3){
+		per_node = 3;
+	}
+
+	while(!is_root){
+		is_root = num_children <= INTERNAL_NODE_MAX_CELLS + 1;
+		uint32_t num_nodes = is_root ? 1 : (num_children + per_node - 1) / per_node;
+		BulkLoadChild *parents = (BulkLoadChild *)malloc(num_nodes * sizeof(BulkLoadChild));
+		uint32_t first = 0;
+
+		for(uint32_t n = 0; n < num_nodes; n++){
+			uint32_t count = num_children / num_nodes + (n < num_children % num_nodes);
+			uint32_t page_num = is_root ? loader->table->root_page_num : get_unused_page_num(pager);
+			void *node = get_page(pager, page_num);
+
+			init_internal_node(node);
+			set_node_root(node, is_root);
+			*internal_node_num_keys(node) = count - 1;
+			for(uint32_t i = 0; i < count - 1; i++){
+				*internal_node_child(node, i) = children[first + i].page_num;
+				*internal_node_key(node, i) = children[first + i].max_key;
+			}
+			*internal_node_right_child(node) = children[first + count - 1].page_num;
+			mark_page_dirty(pager, page_num);
+			unpin_page(pager, page_num);
+
+			for(uint32_t i = 0; i < count; i++){
+				uint32_t child_page_num = children[first + i].page_num;
+				*node_parent(get_page(pager, child_page_num)) = page_num;
+				mark_page_dirty(pager, child_page_num);
+				unpin_page(pager, child_page_num);
+			}
+
+			parents[n].page_num = page_num;
+			parents[n].max_key = children[first + count - 1].max_key;
+			first += count;
+		}
+
+		if(children != loader->leaves){
+			free(children);
+		}
+		children = parents;
+		num_children = num_nodes;
+	}
+	free(children);
+}
+
+uint32_t bulk_load_finish(BulkLoader *loader, uint32_t *duplicates){
+/*
+ * Sort what is left, build the tree and any indexes on it, and checkpoint.
+ * Returns the number of rows loaded. Rows repeating an earlier key are
+ * skipped and counted in duplicates.
+ */
+	if(loader->num_runs == 0){
+		/* entries is still NULL if no row was added */
+		if(loader->num_entries > 0){
+			qsort(loader->entries, loader->num_entries, sizeof(BulkLoadEntry),
+					compare_bulk_load_entry);
+		}
+		for(uint32_t i = 0; i < loader->num_entries; i++){
+			bulk_load_emit(loader, loader->run_buffer + loader->entries[i].offset);
+		}
+	} else{
+		if(loader->num_entries > 0){
+			bulk_load_spill_run(loader);
+		}
+		bulk_load_merge_runs(loader);
+	}
+
+	if(*leaf_node_num_cells(loader->leaf) > 0 || loader->num_staged > 0){
+		bulk_load_write_leaf(loader, true);
+	}
+	if(loader->num_leaves > 1){
+		bulk_load_build_levels(loader);
+	}
+	for(uint32_t column = 0; column < NUM_COLUMNS; column++){
+		if(loader->table->indexes[column] != NULL){
+			index_build(loader->table, column);
+		}
+	}
+	pager_checkpoint(loader->table->pager);
+
+	uint32_t rows_loaded = loader->rows_loaded;
+	if(duplicates != NULL){
+		*duplicates = loader->duplicates;
+	}
+	free(loader->run_buffer);
+	free(loader->entries);
+	free(loader->runs);
+	free(loader->leaf);
+	free(loader->leaves);
+	free(loader->staged);
+	free(loader);
+
+	return rows_loaded;
+}
+
+/*----------------------Index----------------------------------*/
+uint32_t *catalog_index_root(void *catalog, Column column){
+	return (uint32_t *)((uint8_t *)catalog + CATALOG_INDEX_ROOTS_OFFSET + column * sizeof(uint32_t));
+}
+
+Table *index_open(Pager *pager, uint32_t root_page_num){
+	Table *index = (Table *)malloc(sizeof(*index));
+	index->pager = pager;
+	index->root_page_num = root_page_num;
+	index->rightmost_leaf = INVALID_PAGE_NUM;
+	memset(index->indexes, 0, sizeof(index->indexes));
+	pthread_mutex_init(&index->writer_lock, NULL);
+	index->scan_threads = 1;
+
+	return index;
+}
+
+char *row_column(Row *row, Column column){
+	return column == COLUMN_USERNAME ? row->username : row->email;
+}
+
+uint32_t index_hash(const char *value){
+	uint32_t hash = 2166136261u;
+
+	for(const char *p = value; *p != '\0'; p++){
+		hash = (hash ^ (uint8_t)*p) * 16777619u;
+	}
+	return hash % INDEX_HASH_LIMIT;
+}
+
+uint32_t index_cell(uint8_t *cell, uint32_t key, const char *value, uint32_t row_id){
+	uint8_t value_length = strlen(value);
+	uint8_t row_id_length = INDEX_ROW_ID_SIZE;
+
+	memcpy(cell + ID_OFFSET, &key, ID_SIZE);
+	memcpy(cell + USERNAME_LENGTH_OFFSET, &value_length, LENGTH_SIZE);
+	memcpy(cell + EMAIL_LENGTH_OFFSET, &row_id_length, LENGTH_SIZE);
+	memcpy(cell + USERNAME_OFFSET, value, value_length);
+	memcpy(cell + USERNAME_OFFSET + value_length, &row_id, INDEX_ROW_ID_SIZE);
+
+	return USERNAME_OFFSET + value_length + INDEX_ROW_ID_SIZE;
+}
+
+bool index_cell_matches(uint8_t *cell, const char *value, uint32_t value_length){
+	return cell[USERNAME_LENGTH_OFFSET] == value_length &&
+		!memcmp(cell + USERNAME_OFFSET, value, value_length);
+}
+
+uint32_t index_cell_row_id(uint8_t *cell){
+	uint32_t row_id;
+	memcpy(&row_id, cell + USERNAME_OFFSET + cell[USERNAME_LENGTH_OFFSET], INDEX_ROW_ID_SIZE);
+	return row_id;
+}
+
+void index_insert(Table *index, const char *value, uint32_t row_id){
+/*
+ * The entry goes in front of any others with the same hash, where
+ * table_find lands, so inserting costs the same however many rows
+ * share the value.
+ */
+	uint32_t key = index_hash(value);
+	uint8_t cell[ROW_SIZE];
+	uint32_t cell_size = index_cell(cell, key, value, row_id);
+	Cursor *cursor = table_find(index, key);
+
+	leaf_node_insert(cursor, cell, cell_size);
+	cursor_close(cursor);
+}
+
+void index_insert_row(Table *table, Row *row){
+	for(uint32_t column = 0; column < NUM_COLUMNS; column++){
+		if(table->indexes[column] != NULL){
+			index_insert(table->indexes[column], row_column(row, column), row->id);
+		}
+	}
+}
+
+int compare_uint32(const void *a, const void *b){
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : (x > y);
+}
+
+uint32_t index_lookup(Table *index, const char *value, uint32_t **row_ids){
+/*
+ * Collect the ids of the rows whose column equals value, in index order.
+ * Returns how many were found, *row_ids must be freed by the caller.
+ */
+	uint32_t key = index_hash(value);
+	uint32_t value_length = strlen(value);
+	uint32_t num_ids = 0, capacity = 8;
+	Cursor *cursor = table_seek(index, key);
+
+	*row_ids = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+	while(!cursor->end_of_table){
+		void *cell = cursor_value(cursor);
+		if(row_key_at(cell) != key){
+			break;
+		}
+		if(index_cell_matches(cell, value, value_length)){
+			if(num_ids == capacity){
+				capacity *= 2;
+				*row_ids = (uint32_t *)realloc(*row_ids, capacity * sizeof(uint32_t));
+			}
+			(*row_ids)[num_ids++] = index_cell_row_id(cell);
+		}
+		cursor_advance(cursor);
+	}
+	cursor_close(cursor);
+
+	return num_ids;
+}
+
+void index_build(Table *table, Column column){
+/*
+ * Fill an empty index from a scan of the table. The entries are sorted
+ * by hash with the bulk loader, which keeps every entry of a hash.
+ */
+	Table *index = table->indexes[column];
+	BulkLoader *loader = bulk_load_begin(index, BULK_LOAD_DEFAULT_FILL);
+	Cursor *cursor = table_start(table);
+	uint8_t cell[ROW_SIZE];
+	Row row;
+
+	loader->keep_duplicates = true;
+	while(!cursor->end_of_table){
+		deserialize_row(cursor_value(cursor), &row);
+		char *value = row_column(&row, column);
+		index_cell(cell, index_hash(value), value, row.id);
+		bulk_load_add_cell(loader, cell);
+		cursor_advance(cursor);
+	}
+	cursor_close(cursor);
+
+	bulk_load_finish(loader, NULL);
+}
+
+ExecuteResult index_create(Table *table, Column column){
+/*
+ * Give the column an index: a new root page, recorded in the catalog,
+ * then filled from the rows already in the table.
+ */
+	Pager *pager = table->pager;
+
+	if(table->indexes[column] != NULL){
+		return EXECUTE_INDEX_EXISTS;
+	}
+
+	uint32_t root_page_num = get_unused_page_num(pager);
+	void *root = get_page(pager, root_page_num);
+	init_leaf_node(root);
+	set_node_root(root, true);
+	mark_page_dirty(pager, root_page_num);
+	unpin_page(pager, root_page_num);
+
+	void *catalog = get_page(pager, CATALOG_PAGE_NUM);
+	*catalog_index_root(catalog, column) = root_page_num;
+	mark_page_dirty(pager, CATALOG_PAGE_NUM);
+	unpin_page(pager, CATALOG_PAGE_NUM);
+
+	table->indexes[column] = index_open(pager, root_page_num);
+	index_build(table, column);
+
+	return EXECUTE_SUCCESS;
+}
+
+/*----------------------Print----------------------------------*/
+void print_constants(){
+	printf("ROW_SIZE: %ld\n", ROW_SIZE);
+	printf("COMMON_NODE_HEADER_SIZE: %ld\n", COMMON_NODE_HEADER_SIZE);
+	printf("LEAF_NODE_HEADER_SIZE: %ld\n", LEAF_NODE_HEADER_SIZE);
+	printf("LEAF_NODE_SPACE_FOR_CELLS: %ld\n", LEAF_NODE_SPACE_FOR_CELLS);
+	printf("LEAF_NODE_MAX_CELL_SIZE: %ld\n", LEAF_NODE_MAX_CELL_SIZE);
+}
+
+void scan_result_init(ScanResult *result, FILE *out, bool binary){
+	/* Not an initializer: that would clear the whole batch every select */
+	result->out = out;
+	result->binary = binary;
+	result->count = 0;
+	result->found = false;
+	result->batch_length = 0;
+}
+
+void write_flush(ScanResult *result){
+	if(result->batch_length > 0){
+		fwrite(result->batch, 1, result->batch_length, result->out);
+		result->batch_length = 0;
+	}
+}
+
+char *write_reserve(ScanResult *result, uint32_t length){
+/*
+ * Room for length more bytes at the end of the batch, which is sent first
+ * if they would not fit. The caller adds what it used to batch_length.
+ */
+	if(result->batch_length + length > SCAN_BATCH_SIZE){
+		write_flush(result);
+	}
+	return result->batch + result->batch_length;
+}
+
+char *format_int32(char *text, int32_t value){
+/*
+ * value in decimal as %d prints it, returning the end of it.
+ */
+	uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+	char digits[10];
+	uint32_t num_digits = 0;
+
+	if(value < 0){
+		*text++ = '-';
+	}
+	do{
+		digits[num_digits++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while(magnitude > 0);
+	while(num_digits > 0){
+		*text++ = digits[--num_digits];
+	}
+	return text;
+}
+
+void write_view(ScanResult *result, RowView *view){
+/*
+ * A row read in place to the batch, with no copy in between: as text, or
+ * in binary as it is stored, the id, the two lengths and then the strings.
+ */
+	if(result->binary){
+		uint32_t length = USERNAME_OFFSET + view->username_length + view->email_length;
+		memcpy(write_reserve(result, length), view->cell, length);
+		result->batch_length += length;
+		return;
+	}
+
+	char *start = write_reserve(result, ROW_TEXT_SIZE);
+	char *text = start;
+	*text++ = '(';
+	text = format_int32(text, view->id);
+	memcpy(text, ", ", 2);
+	text += 2;
+	memcpy(text, view->username, view->username_length);
+	text += view->username_length;
+	memcpy(text, ", ", 2);
+	text += 2;
+	memcpy(text, view->email, view->email_length);
+	text += view->email_length;
+	memcpy(text, ")\n", 2);
+	result->batch_length += text + 2 - start;
+}
+
+void write_id(ScanResult *result, uint32_t id){
+	char *start = write_reserve(result, 16);
+	char *text = start;
+
+	if(result->binary){
+		memcpy(text, &id, sizeof(id));
+		text += sizeof(id);
+	} else{
+		*text++ = '(';
+		text = format_int32(text, id);
+		*text++ = ')';
+		*text++ = '\n';
+	}
+	result->batch_length += text - start;
+}
+
+void write_projection(ScanResult *result, RowView *view, Projection projection){
+/*
+ * count(*), min and max write nothing per row, only the result at the end.
+ */
+	if(projection == PROJECT_ROW){
+		write_view(result, view);
+	} else if(projection == PROJECT_ID){
+		write_id(result, view->id);
+	}
+}
+
+void write_aggregate(ScanResult *result, Statement *statement){
+/*
+ * Every select ends here, so the batch is sent before writing to out and
+ * after write_id. count(*) is always written, in binary as a uint64_t.
+ * min and max write nothing when no row matched, in binary an id is a
+ * uint32_t and a string has a length byte in front.
+ */
+	write_flush(result);
+	if(statement->projection == PROJECT_COUNT){
+		if(result->binary){
+			fwrite(&result->count, sizeof(result->count), 1, result->out);
+		} else{
+			fprintf(result->out, "(%lu)\n", (unsigned long)result->count);
+		}
+	} else if(result->found && statement->aggregate == COLUMN_ID){
+		write_id(result, result->row.id);
+		write_flush(result);
+	} else if(result->found){
+		char *value = row_column(&result->row, statement->aggregate);
+		uint8_t length = strlen(value);
+
+		if(result->binary){
+			fwrite(&length, 1, 1, result->out);
+			fwrite(value, 1, length, result->out);
+		} else{
+			fprintf(result->out, "(%s)\n", value);
+		}
+	}
+}
+
+void indent(uint32_t level){
+	for(uint32_t i = 0; i < level; i++){
+		printf("  ");
+	}
+}
+
+void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level){
+	void *node = get_page(pager, page_num);
+	uint32_t num_keys, child;
+
+	switch(get_node_type(node)){
+		case NODE_INTERNAL:
+			num_keys = *internal_node_num_keys(node);
+			indent(indentation_level);
+			printf("- internal (size %d)\n", num_keys);
+			for(uint32_t i = 0; i < num_keys; i++){
+				child = *internal_node_child(node, i);
+				print_tree(pager, child, indentation_level + 1);
+
+				indent(indentation_level + 1);
+				printf("- key %d\n", *internal_node_key(node, i));
+			}
+			print_tree(pager, *internal_node_right_child(node), indentation_level + 1);
+			break;
+		case NODE_LEAF:
+			num_keys = *leaf_node_num_cells(node);
+			indent(indentation_level);
+			if(leaf_node_is_packed(node)){
+				printf("- packed leaf (size %d)\n", num_keys);
+			} else{
+				printf("- leaf (size %d, free %d)\n", num_keys, leaf_node_free_space(node));
+			}
+			for(uint32_t i = 0; i < num_keys; i++){
+				indent(indentation_level + 1);
+				printf("- %d\n", leaf_node_key_at(node, i));
+			}
+			break;
+	}
+	unpin_page(pager, page_num);
+}
+
+void print_pool_stats(Pager *pager){
+	uint32_t used = 0, pinned = 0, dirty = 0;
+	uint64_t hits = pager->hits;
+
+	if(pager->map != NULL){
+		for(uint32_t i = 0; i < pager->dirty_pages_size; i++){
+			dirty += pager->dirty_pages[i];
+		}
+		printf("mmap: %d pages (dirty %d)\n", pager->num_pages, dirty);
+	}
+
+	for(uint32_t i = 0; pager->map == NULL && i < pager->num_frames; i++){
+		Frame *frame = &pager->frames[i];
+		if(frame->page_num == INVALID_PAGE_NUM){
+			continue;
+		}
+		used++;
+		hits += __atomic_load_n(&frame->hits, __ATOMIC_RELAXED);
+		if(__atomic_load_n(&frame->pin_count, __ATOMIC_RELAXED) > 0){
+			pinned++;
+		}
+		if(frame->dirty){
+			dirty++;
+		}
+	}
+
+	if(pager->map == NULL){
+		printf("frames: %d (used %d, pinned %d, dirty %d)%s\n",
+				pager->num_frames, used, pinned, dirty,
+				pager->frame_slab_huge ? " in huge pages" : "");
+		/* Mapped pages are handed out without the lock, so are not counted */
+		printf("hits: %lu\n", (unsigned long)hits);
+		printf("read-ahead: %lu pages (used %lu, evicted unused %lu)\n",
+				(unsigned long)pager->read_ahead, (unsigned long)pager->read_ahead_hits,
+				(unsigned long)pager->read_ahead_wasted);
+	}
+	printf("misses: %lu\n", (unsigned long)pager->misses);
+	if(pager->map == NULL){
+		printf("reads: %lu\n", (unsigned long)pager->reads);
+	}
+	printf("evictions: %lu\n", (unsigned long)pager->evictions);
+	printf("writebacks: %lu\n", (unsigned long)pager->writebacks);
+	printf("io: %s%s (%lu requests in %lu batches)\n", io_backend_name(pager->io->backend),
+			pager->direct ? ", O_DIRECT" : "", (unsigned long)pager->io->requests,
+			(unsigned long)pager->io->batches);
+	if(pager->wal != NULL){
+		printf("wal frames: %d\n", pager->wal->frames);
+		printf("wal commits: %lu\n", (unsigned long)pager->wal->commits);
+		printf("wal checkpoints: %lu\n", (unsigned long)pager->wal->checkpoints);
+	}
+	pthread_mutex_lock(&pager->mvcc->lock);
+	printf("versions kept: %d (collected %lu)\n", pager->mvcc->kept,
+			(unsigned long)pager->mvcc->collected);
+	pthread_mutex_unlock(&pager->mvcc->lock);
+}
+
+void print_help(){
+	printf(".exit | .constants | .btree | .pool | .stats | .flush | .load <file> [fill%%] [packed] | .help\n");
+}
+
+void load_file(Table *table, char *filename, uint32_t fill_percent, bool pack_leaves){
+/*
+ * Each line of the file is one row, "id username email", optionally
+ * preceded by the insert keyword. Bad lines are reported and skipped.
+ */
+	FILE *file = fopen(filename, "r");
+	if(file == NULL){
+		printf("Unable to open '%s'.\n", filename);
+		return;
+	}
+
+	BulkLoader *loader = bulk_load_begin(table, fill_percent);
+	if(loader == NULL){
+		printf("Error: Table must be empty to bulk load.\n");
+		fclose(file);
+		return;
+	}
+	loader->pack_leaves = pack_leaves;
+
+	char *line = NULL;
+	size_t line_size = 0;
+	uint32_t line_num = 0;
+	Row row;
+
+	while(getline(&line, &line_size, file) != -1){
+		line_num++;
+		char *id_string = strtok(line, " \t\r\n");
+		if(id_string != NULL && !strcmp(id_string, "insert")){
+			id_string = strtok(NULL, " \t\r\n");
+		}
+		char *username = strtok(NULL, " \t\r\n");
+		char *email = strtok(NULL, " \t\r\n");
+
+		if(id_string == NULL){
+			continue;
+		}
+		if(parse_row(id_string, username, email, &row) != PREPARE_SUCCESS){
+			printf("Skipping line %d: could not parse row.\n", line_num);
+			continue;
+		}
+		bulk_load_add(loader, &row);
+	}
+	free(line);
+	fclose(file);
+
+	uint32_t duplicates;
+	uint32_t rows_loaded = bulk_load_finish(loader, &duplicates);
+	printf("Loaded %d rows.\n", rows_loaded);
+	if(duplicates > 0){
+		printf("Skipped %d duplicate keys.\n", duplicates);
+	}
+}
+
+MetaCommandResult do_meta_command(Table *table, InputBuffer *input_buffer){
+	if(!strcmp(input_buffer->buf, ".exit")){
+		db_close(table);
+		close_input_buffer(&input_buffer);
+		exit(EXIT_SUCCESS);
+	} else if(!strcmp(input_buffer->buf, ".constants")){
+		printf("Constants:\n");
+		print_constants();
+		return META_COMMAND_SUCCESS;
+	} else if(!strcmp(input_buffer->buf, ".btree")){
+		printf("Tree:\n");
+		print_tree(table->pager, table->root_page_num, 0);
+		return META_COMMAND_SUCCESS;
+	} else if(!strcmp(input_buffer->buf, ".pool")){
+		printf("Buffer pool:\n");
+		print_pool_stats(table->pager);
+		return META_COMMAND_SUCCESS;
+	} else if(!strcmp(input_buffer->buf, ".stats")){
+#ifdef DB_STATS
+		printf("Statistics:\n");
+		stats_print(table);
+#else
+		printf("Statistics are compiled out, build with make STATS=1.\n");
+#endif
+		return META_COMMAND_SUCCESS;
+	} else if(!strcmp(input_buffer->buf, ".flush")){
+		uint32_t pages_written = pager_checkpoint(table->pager);
+		printf("Flushed %d pages.\n", pages_written);
+		return META_COMMAND_SUCCESS;
+	} else if(!strncmp(input_buffer->buf, ".load ", 6)){
+		strtok(input_buffer->buf, " ");
+		char *filename = strtok(NULL, " ");
+		char *fill_string = strtok(NULL, " ");
+		char *packed = strtok(NULL, " ");
+
+		if(filename == NULL || (packed != NULL && strcmp(packed, "packed"))){
+			return META_COMMAND_UNRECOGNIZED_COMMAND;
+		}
+		load_file(table, filename, fill_string ? atoi(fill_string) : BULK_LOAD_DEFAULT_FILL,
+				packed != NULL);
+		return META_COMMAND_SUCCESS;
+	} else if(!strcmp(input_buffer->buf, ".help")){
+		print_help();
+		return META_COMMAND_SUCCESS;
+	} else {
+		return META_COMMAND_UNRECOGNIZED_COMMAND;
+	}
+}
+
+
+/*----------------------prepare----------------------------------*/
+PrepareResult parse_row(char *id_string, char *username, char *email, Row *row){
+	if(id_string == NULL || username == NULL || email == NULL){
+		return PREPARE_SYNTAX_ERROR;
+	}
+
+	int id = atoi(id_string);
+	if(id < 0){
+		return PREPARE_NEGATIVE_ID;
+	}
+	if(strlen(username) > COLUMN_USERNAME_SIZE){
+		return PREPARE_STRING_TOO_LONG; 
+	}
+	if(strlen(email) > COLUMN_EMAIL_SIZE){
+		return PREPARE_STRING_TOO_LONG;
+	}
+
+	row->id = id;
+	strcpy(row->username, username);
+	strcpy(row->email, email);
+
+	return PREPARE_SUCCESS;
+}
+
+char *trim(char *string){
+	while(isspace((unsigned char)*string)){
+		string++;
+	}
+	char *end = string + strlen(string);
+	while(end > string && isspace((unsigned char)end[-1])){
+		*--end = '\0';
+	}
+	return string;
+}
+
+PrepareResult prepare_insert_batch(char *values, Statement *statement){
+/*
+ * insert (id, username, email), (id, username, email), ...
+ * The rows are taken from the thread's arena and live as long as the
+ * statement does.
+ */
+	Arena *arena = arena_thread();
+	uint32_t capacity = 16;
+	Row *rows = (Row *)arena_alloc(arena, capacity * sizeof(Row));
+	uint32_t num_rows = 0;
+	char *p = values;
+
+	while(true){
+		char *open = p + strspn(p, " ");
+		char *close = strchr(open, ')');
+		if(*open != '(' || close == NULL){
+			return PREPARE_SYNTAX_ERROR;
+		}
+		*close = '\0';
+
+		char *id_string = open + 1;
+		char *username = strchr(id_string, ',');
+		char *email = username ? strchr(username + 1, ',') : NULL;
+		if(email == NULL || strchr(email + 1, ',') != NULL){
+			return PREPARE_SYNTAX_ERROR;
+		}
+		*username++ = '\0';
+		*email++ = '\0';
+
+		if(num_rows == capacity){
+			/* The rows outgrown stay behind until the arena is reset */
+			Row *grown = (Row *)arena_alloc(arena, 2 * capacity * sizeof(Row));
+			memcpy(grown, rows, num_rows * sizeof(Row));
+			rows = grown;
+			capacity *= 2;
+		}
+		PrepareResult result = parse_row(trim(id_string), trim(username), trim(email),
+				&rows[num_rows++]);
+		if(result != PREPARE_SUCCESS){
+			return result;
+		}
+
+		p = close + 1 + strspn(close + 1, " ");
+		if(*p == '\0'){
+			break;
+		}
+		if(*p++ != ','){
+			return PREPARE_SYNTAX_ERROR;
+		}
+	}
+
+	statement->rows = rows;
+	statement->num_rows = num_rows;
+	return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement){
+	statement->type = STATEMENT_INSERT;
+	statement->rows = &statement->row_to_insert;
+	statement->num_rows = 1;
+
+	char *values = input_buffer->buf + strlen("insert");
+	if(values[strspn(values, " ")] == '('){
+		return prepare_insert_batch(values, statement);
+	}
 	
-	Pager *pager = (Pager *)malloc(sizeof(*pager));
-	pager->file_descriptor = fd;
-	pager->file_length = file_length;
-	pager->num_pages = (file_length / PAGE_SIZE);
+	strtok(input_buffer->buf, " ");
+	char *id_string = strtok(NULL, " ");
+	char *username = strtok(NULL, " ");
+	char *email = strtok(NULL, " ");
+
+	if(statement_placeholder(statement, id_string, PARAM_ID)){
+		id_string = "0";
+	}
+	if(statement_placeholder(statement, username, PARAM_USERNAME)){
+		username = "";
+	}
+	if(statement_placeholder(statement, email, PARAM_EMAIL)){
+		email = "";
+	}
+	return parse_row(id_string, username, email, &statement->row_to_insert);
+}
+
+bool statement_placeholder(Statement *statement, char *string, StatementParam param){
+/*
+ * If string is a ?, and the statement is a template with room for one
+ * more, note what it stands for.
+ */
+	if(string == NULL || strcmp(string, "?") || statement->num_params == statement->max_params){
+		return false;
+	}
+	statement->params[statement->num_params++] = param;
+	return true;
+}
+
+PrepareResult parse_key(char *string, uint32_t *key){
+	if(string == NULL){
+		return PREPARE_SYNTAX_ERROR;
+	}
+
+	char *end;
+	errno = 0;
+	long long value = strtoll(string, &end, 10);
+	if(end == string || *end != '\0' || errno == ERANGE || value > UINT32_MAX){
+		return PREPARE_SYNTAX_ERROR;
+	}
+	if(value < 0){
+		return PREPARE_NEGATIVE_ID;
+	}
+
+	*key = value;
+	return PREPARE_SUCCESS;
+}
+
+PrepareResult parse_column(char *name, Column *column){
+	if(name != NULL && !strcmp(name, "username")){
+		*column = COLUMN_USERNAME;
+	} else if(name != NULL && !strcmp(name, "email")){
+		*column = COLUMN_EMAIL;
+	} else{
+		return PREPARE_SYNTAX_ERROR;
+	}
+	return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_column_predicate(char *column, char *op, Statement *statement){
+/*
+ * Only equality on username or email, the value may be in single quotes.
+ */
+	char *value = strtok(NULL, " ");
+
+	if(parse_column(column, &statement->column) != PREPARE_SUCCESS ||
+			strcmp(op, "=") || value == NULL || strtok(NULL, " ") != NULL){
+		return PREPARE_SYNTAX_ERROR;
+	}
+
+	size_t length = strlen(value);
+	if(length >= 2 && value[0] == '\'' && value[length - 1] == '\''){
+		value[length - 1] = '\0';
+		value++;
+	}
+	if(statement_placeholder(statement, value, PARAM_VALUE)){
+		value = "";
+	}
+	if(strlen(value) > COLUMN_EMAIL_SIZE){
+		return PREPARE_STRING_TOO_LONG;
+	}
+	strcpy(statement->value, value);
+
+	return PREPARE_SUCCESS;
+}
+
+PrepareResult prepare_create_index(InputBuffer *input_buffer, Statement *statement){
+/*
+ * create index on username | email
+ */
+	statement->type = STATEMENT_CREATE_INDEX;
+
+	strtok(input_buffer->buf, " ");
+	char *index = strtok(NULL, " ");
+	char *on = strtok(NULL, " ");
+	char *column = strtok(NULL, " ");
+
+	if(index == NULL || strcmp(index, "index") || on == NULL || strcmp(on, "on") ||
+			strtok(NULL, " ") != NULL){
+		return PREPARE_SYNTAX_ERROR;
+	}
+	return parse_column(column, &statement->column);
+}
+
+PrepareResult prepare_select(InputBuffer *input_buffer, Statement *statement){
+/*
+ * select [id | count(*) | min(column) | max(column)]
+ * select ... where id = N | > N | < N | >= N | <= N | between A and B
+ * select ... where username = 'value' | email = 'value'
+ */
+	statement->type = STATEMENT_SELECT;
+	statement->key_min = 0;
+	statement->key_max = UINT32_MAX;
+	statement->column = COLUMN_ID;
+	statement->projection = PROJECT_ROW;
+
+	strtok(input_buffer->buf, " ");
+	char *where = strtok(NULL, " ");
+	if(where != NULL && !strcmp(where, "id")){
+		statement->projection = PROJECT_ID;
+		where = strtok(NULL, " ");
+	} else if(where != NULL && !strcmp(where, "count(*)")){
+		statement->projection = PROJECT_COUNT;
+		where = strtok(NULL, " ");
+	} else if(where != NULL && (!strncmp(where, "min(", 4) || !strncmp(where, "max(", 4))){
+		size_t length = strlen(where);
+		if(where[length - 1] != ')'){
+			return PREPARE_SYNTAX_ERROR;
+		}
+		where[length - 1] = '\0';
+		statement->projection = where[1] == 'i' ? PROJECT_MIN : PROJECT_MAX;
+		statement->aggregate = COLUMN_ID;
+		if(strcmp(where + 4, "id") && parse_column(where + 4, &statement->aggregate) != PREPARE_SUCCESS){
+			return PREPARE_SYNTAX_ERROR;
+		}
+		where = strtok(NULL, " ");
+	}
+	if(where == NULL){
+		return PREPARE_SUCCESS;
+	}
+
+	char *column = strtok(NULL, " ");
+	char *op = strtok(NULL, " ");
+	if(strcmp(where, "where") || column == NULL || op == NULL){
+		return PREPARE_SYNTAX_ERROR;
+	}
+	if(strcmp(column, "id")){
+		return prepare_column_predicate(column, op, statement);
+	}
+
+	if(!strcmp(op, "=")){
+		statement->key_predicate = KEY_EQUAL;
+	} else if(!strcmp(op, ">=")){
+		statement->key_predicate = KEY_AT_LEAST;
+	} else if(!strcmp(op, "<=")){
+		statement->key_predicate = KEY_AT_MOST;
+	} else if(!strcmp(op, ">")){
+		statement->key_predicate = KEY_ABOVE;
+	} else if(!strcmp(op, "<")){
+		statement->key_predicate = KEY_BELOW;
+	} else if(!strcmp(op, "between")){
+		statement->key_predicate = KEY_BETWEEN;
+	} else{
+		return PREPARE_SYNTAX_ERROR;
+	}
+
+	uint32_t key = 0;
+	char *key_string = strtok(NULL, " ");
+	PrepareResult result = PREPARE_SUCCESS;
+	if(!statement_placeholder(statement, key_string, PARAM_KEY)){
+		result = parse_key(key_string, &key);
+	}
+	if(result != PREPARE_SUCCESS){
+		return result;
+	}
+	statement_set_key(statement, key);
+
+	if(statement->key_predicate == KEY_BETWEEN){
+		char *and = strtok(NULL, " ");
+		if(and == NULL || strcmp(and, "and")){
+			return PREPARE_SYNTAX_ERROR;
+		}
+		key_string = strtok(NULL, " ");
+		statement->key_max = 0;
+		if(!statement_placeholder(statement, key_string, PARAM_KEY_MAX)){
+			result = parse_key(key_string, &statement->key_max);
+		}
+		if(result != PREPARE_SUCCESS){
+			return result;
+		}
+	}
+
+	if(strtok(NULL, " ") != NULL){
+		return PREPARE_SYNTAX_ERROR;
+	}
+	return PREPARE_SUCCESS;
+}
+
+void statement_set_key(Statement *statement, uint32_t key){
+/*
+ * Narrow [key_min, key_max] to the keys key_predicate allows, from the
+ * full range. A range with nothing in it has key_min above key_max.
+ */
+	switch(statement->key_predicate){
+		case KEY_EQUAL:
+			statement->key_min = key;
+			statement->key_max = key;
+			break;
+		case KEY_AT_LEAST:
+		case KEY_BETWEEN:
+			statement->key_min = key;
+			break;
+		case KEY_AT_MOST:
+			statement->key_max = key;
+			break;
+		case KEY_ABOVE:
+			if(key == UINT32_MAX){
+				statement->key_min = 1;
+				statement->key_max = 0;
+			} else{
+				statement->key_min = key + 1;
+			}
+			break;
+		case KEY_BELOW:
+			if(key == 0){
+				statement->key_min = 1;
+				statement->key_max = 0;
+			} else{
+				statement->key_max = key - 1;
+			}
+			break;
+	}
+}
+
+PrepareResult prepare_any(InputBuffer *input_buffer, Statement *statement){
+	if(!strncmp(input_buffer->buf, "insert", 6)){
+		return prepare_insert(input_buffer, statement);
+	} 
+	if(!strncmp(input_buffer->buf, "select", 6)){
+		return prepare_select(input_buffer, statement);
+	}
+	if(!strncmp(input_buffer->buf, "create", 6)){
+		return prepare_create_index(input_buffer, statement);
+	}
+
+	return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement){
+	statement->num_params = 0;
+	statement->max_params = 0;
+	return prepare_any(input_buffer, statement);
+}
+
+PrepareResult prepare_template(InputBuffer *input_buffer, Statement *statement){
+/*
+ * Like prepare_statement, but a ? in place of the id, username or email
+ * of a single row insert, of a key after where id, or of the value after
+ * where username or where email is a parameter. They are bound in order
+ * with statement_bind_key and statement_bind_text before each execute,
+ * on a copy of the statement. A template outlives the arena, so the rows
+ * of a batch insert are moved to the heap: free statement->rows when it
+ * is not &statement->row_to_insert.
+ */
+	statement->num_params = 0;
+	statement->max_params = STATEMENT_MAX_PARAMS;
+
+	PrepareResult result = prepare_any(input_buffer, statement);
+	if(result == PREPARE_SUCCESS && statement->type == STATEMENT_INSERT &&
+			statement->rows != &statement->row_to_insert){
+		Row *rows = (Row *)malloc(statement->num_rows * sizeof(Row));
+		memcpy(rows, statement->rows, statement->num_rows * sizeof(Row));
+		statement->rows = rows;
+	}
+	return result;
+}
+
+bool statement_param_is_key(StatementParam param){
+	return param == PARAM_ID || param == PARAM_KEY || param == PARAM_KEY_MAX;
+}
+
+PrepareResult statement_bind_key(Statement *statement, uint32_t param_num, uint32_t key){
+	if(param_num >= statement->num_params || !statement_param_is_key(statement->params[param_num])){
+		return PREPARE_SYNTAX_ERROR;
+	}
+	StatementParam param = statement->params[param_num];
+
+	if(param == PARAM_ID){
+		/* Ids are ints, as parse_row reads them */
+		if(key > INT32_MAX){
+			return PREPARE_NEGATIVE_ID;
+		}
+		statement->row_to_insert.id = key;
+	} else if(param == PARAM_KEY){
+		/* From the full range again, not the one prepare or the last bind left */
+		statement->key_min = 0;
+		if(statement->key_predicate != KEY_BETWEEN){
+			statement->key_max = UINT32_MAX;
+		}
+		statement_set_key(statement, key);
+	} else{
+		statement->key_max = key;
+	}
+	return PREPARE_SUCCESS;
+}
+
+PrepareResult statement_bind_text(Statement *statement, uint32_t param_num, const char *text,
+		uint32_t length){
+/*
+ * text need not end in a NUL, but must not hold one.
+ */
+	char *value;
+	uint32_t max_length;
+
+	if(param_num >= statement->num_params || statement_param_is_key(statement->params[param_num]) ||
+			memchr(text, '\0', length) != NULL){
+		return PREPARE_SYNTAX_ERROR;
+	}
+	StatementParam param = statement->params[param_num];
+	if(param == PARAM_USERNAME){
+		value = statement->row_to_insert.username;
+		max_length = COLUMN_USERNAME_SIZE;
+	} else if(param == PARAM_EMAIL){
+		value = statement->row_to_insert.email;
+		max_length = COLUMN_EMAIL_SIZE;
+	} else{
+		value = statement->value;
+		max_length = COLUMN_EMAIL_SIZE;
+	}
+	if(length > max_length){
+		return PREPARE_STRING_TOO_LONG;
+	}
+	memcpy(value, text, length);
+	value[length] = '\0';
+	return PREPARE_SUCCESS;
+}
+
+/*----------------------Execute----------------------------------*/
+ExecuteResult execute_insert_batch(Table *table, Statement *statement, FILE *out, bool binary){
+/*
+ * Duplicate keys are reported per row, the rest of the batch still goes in.
+ * In binary each is reported as the uint32_t index of the row.
+ */
+	ExecuteResult *results = (ExecuteResult *)arena_alloc(arena_thread(),
+			statement->num_rows * sizeof(ExecuteResult));
+
+	table_insert_rows(table, statement->rows, statement->num_rows, results);
+	for(uint32_t i = 0; i < statement->num_rows; i++){
+		if(results[i] != EXECUTE_DUPLICATE_KEY){
+			continue;
+		}
+		if(binary){
+			fwrite(&i, sizeof(i), 1, out);
+		} else{
+			fprintf(out, "Error: Duplicate key %d in row %d.\n", statement->rows[i].id, i + 1);
+		}
+	}
+	pager_end_statement(table->pager);
+
+	return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_insert_to(Table *table, Statement *statement, FILE *out, bool binary){
+	if(statement->rows != &statement->row_to_insert){
+		return execute_insert_batch(table, statement, out, binary);
+	}
+
+	return table_insert(table, &statement->row_to_insert);
+}
+
+ExecuteResult execute_insert(Table *table, Statement *statement){
+	return execute_insert_to(table, statement, stdout, false);
+}
+
+ExecuteResult execute_select_column(Table *table, Statement *statement, FILE *out, bool binary){
+/*
+ * With an index only the matching rows are read, otherwise every row is
+ * compared. Rows come out in id order either way.
+ */
+	Table *index = table->indexes[statement->column];
+	uint32_t value_length = strlen(statement->value);
+	ScanResult result;
+	RowView view;
+
+	scan_result_init(&result, out, binary);
+	if(index == NULL){
+		Scan *scan = scan_open(table, 0, UINT32_MAX);
+		while(scan_next(scan)){
+			for(uint32_t i = 0; i < scan->num_keys; i++){
+				uint32_t length;
+				row_view(scan_value(scan, i), &view);
+				const char *value = row_view_column(&view, statement->column, &length);
+				if(length == value_length && !memcmp(value, statement->value, length)){
+					write_projection(&result, &view, statement->projection);
+					aggregate_view(&result, statement, &view);
+					result.count++;
+				}
+			}
+		}
+		scan_close(scan);
+	} else{
+		uint32_t *row_ids;
+		uint32_t num_ids = index_lookup(index, statement->value, &row_ids);
+		Projection projection = statement->projection;
+		/* The index holds the ids, the rows are only read when needed */
+		bool needs_rows = projection == PROJECT_ROW ||
+			((projection == PROJECT_MIN || projection == PROJECT_MAX) &&
+			 statement->aggregate != COLUMN_ID);
+
+		qsort(row_ids, num_ids, sizeof(uint32_t), compare_uint32);
+		Arena *arena = arena_thread();
+		for(uint32_t i = 0; i < num_ids && projection != PROJECT_COUNT; i++){
+			ArenaMark mark = arena_mark(arena);
+			Cursor *cursor = NULL;
+
+			view.id = row_ids[i];
+			if(needs_rows){
+				cursor = table_find(table, row_ids[i]);
+				cursor_view(cursor, &view);
+			}
+			write_projection(&result, &view, projection);
+			aggregate_view(&result, statement, &view);
+			if(cursor != NULL){
+				cursor_close(cursor);
+			}
+			arena_release(arena, mark);
+		}
+		free(row_ids);
+		result.count = num_ids;
+	}
+
+	write_aggregate(&result, statement);
+	return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_select(Table *table, Statement *statement, FILE *out, bool binary){
+/*
+ * Start at the leaf for key_min and stop at the first key past key_max,
+ * so a point or short range query only reads the leaves it needs. The
+ * rows come from a snapshot, so inserts go on while a long select runs,
+ * and a range big enough to split is scanned by several threads.
+ */
+	if(statement->column != COLUMN_ID){
+		return execute_select_column(table, statement, out, binary);
+	}
+
+	uint64_t snapshot = snapshot_open(table->pager);
+	ScanResult result;
+
+	scan_result_init(&result, out, binary);
+	if(!scan_parallel(table, snapshot, statement, &result)){
+		scan_range(table, snapshot, statement, statement->key_min, statement->key_max, &result);
+	}
+	snapshot_close(table->pager, snapshot);
+
+	write_aggregate(&result, statement);
+	return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_statement_to(Table *table, Statement *statement, FILE *out, bool binary){
+/*
+ * Results go to out, as text or, for the server, in binary.
+ */
+	switch(statement->type){
+		case STATEMENT_INSERT:
+			return execute_insert_to(table, statement, out, binary);
+		case STATEMENT_SELECT:
+			return execute_select(table, statement, out, binary);
+		case STATEMENT_CREATE_INDEX:
+			break;
+	}
+	return index_create(table, statement->column);
+}
+
+ExecuteResult execute_statement(Table *table, Statement *statement){
+	return execute_statement_to(table, statement, stdout, false);
+}
+
+/*----------------------Server----------------------------------*/
+/*
+ * One thread runs the event loop and every statement, in the order the
+ * requests are read, so clients see each other's writes as the REPL
+ * would; a select that scans with several threads still does. Each read
+ * from a connection may carry many requests, their responses go back in
+ * one send. A connection whose responses are not all sent is not read
+ * from until they are. Responses given while a write is not yet committed
+ * are held until the end of the round of events, which commits the log
+ * once for all of them.
+ */
+bool server_address(const char *address, struct sockaddr_storage *addr, socklen_t *length){
+/*
+ * unix:PATH is a Unix socket, anything else [HOST:]PORT over TCP, on every
+ * interface when there is no host.
+ */
+	memset(addr, 0, sizeof(*addr));
+	if(!strncmp(address, "unix:", 5)){
+		struct sockaddr_un *unix_addr = (struct sockaddr_un *)addr;
+		if(strlen(address + 5) >= sizeof(unix_addr->sun_path)){
+			return false;
+		}
+		unix_addr->sun_family = AF_UNIX;
+		strcpy(unix_addr->sun_path, address + 5);
+		*length = sizeof(*unix_addr);
+		return true;
+	}
 
-	if(file_length % PAGE_SIZE != 0){
-		printf("Db file is not a whole number of pages. Corrupt file.\n");
-		exit(EXIT_FAILURE);
+	char host[256] = "";
+	const char *port = strrchr(address, ':');
+	if(port != NULL){
+		if(port - address >= (long)sizeof(host)){
+			return false;
+		}
+		memcpy(host, address, port - address);
+		host[port - address] = '\0';
+		port++;
+	} else{
+		port = address;
 	}
 
-	for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++){
-		pager->pages[i] = NULL;
+	struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE };
+	struct addrinfo *info;
+	if(getaddrinfo(host[0] ? host : NULL, port, &hints, &info) != 0){
+		return false;
 	}
+	memcpy(addr, info->ai_addr, info->ai_addrlen);
+	*length = info->ai_addrlen;
+	freeaddrinfo(info);
+	return true;
+}
 
-	return pager;
+int server_connect(const char *address){
+/*
+ * A blocking connection to a server, for clients. -1 with errno set if it
+ * could not be made.
+ */
+	struct sockaddr_storage addr;
+	socklen_t length;
+
+	if(!server_address(address, &addr, &length)){
+		errno = EINVAL;
+		return -1;
+	}
+	int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd == -1 || connect(fd, (struct sockaddr *)&addr, length) == -1){
+		int error = errno;
+		if(fd != -1){
+			close(fd);
+		}
+		errno = error;
+		return -1;
+	}
+	if(addr.ss_family != AF_UNIX){
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	return fd;
 }
 
-void pager_flush(Pager *pager, uint32_t page_num){
-	if(pager->pages[page_num] == NULL){
-		printf("Tried to flush null page\n");
+int server_listen(const char *address){
+	struct sockaddr_storage addr;
+	socklen_t length;
+
+	if(!server_address(address, &addr, &length)){
+		printf("Bad server address '%s', expected unix:PATH or [HOST:]PORT.\n", address);
 		exit(EXIT_FAILURE);
 	}
+	if(addr.ss_family == AF_UNIX){
+		/* Left over from a server that did not get to remove it */
+		unlink(((struct sockaddr_un *)&addr)->sun_path);
+	}
 
-	off_t offset = lseek(pager->file_descriptor, page_num * PAGE_SIZE, SEEK_SET);
-
-	if(offset == -1){
-		printf("Error seeking: %d\n", errno);
+	int fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	int on = 1;
+	if(fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+			bind(fd, (struct sockaddr *)&addr, length) == -1 || listen(fd, SERVER_BACKLOG) == -1){
+		printf("Unable to listen on '%s': %d\n", address, errno);
 		exit(EXIT_FAILURE);
 	}
+	return fd;
+}
 
-	ssize_t bytes_written = 
-		write(pager->file_descriptor, pager->pages[page_num], PAGE_SIZE);
+void server_watch(Server *server, Connection *connection, uint32_t events){
+	struct epoll_event event = { .events = events, .data.ptr = connection };
 
-	if(bytes_written == -1){
-		printf("Error writing: %d\n", errno);
+	if(epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) == -1){
+		printf("Error watching connection: %d\n", errno);
 		exit(EXIT_FAILURE);
 	}
 }
 
-/*----------------------db operation----------------------------------*/
-Table *db_open(const char *filename) {
-	Pager *pager = pager_open(filename);
-
-	Table *table = (Table *)malloc(sizeof(*table));
-	table->pager = pager;
-	table->root_page_num = 0;
+void server_accept(Server *server){
+	while(true){
+		int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd == -1){
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR){
+				printf("Error accepting connection: %d\n", errno);
+			}
+			return;
+		}
+		int on = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+		Connection *connection = (Connection *)calloc(1, sizeof(*connection));
+		connection->fd = fd;
+		connection->next = server->connections;
+		if(server->connections != NULL){
+			server->connections->prev = connection;
+		}
+		server->connections = connection;
 
-	if(pager->num_pages == 0){
-		// New database file. Initialize page 0 as leaf node
-		void *root_node = get_page(pager, 0);
-		init_leaf_node(root_node);
-		set_node_root(root_node, true);
+		struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+		if(epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
+			printf("Error watching connection: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
 	}
-
-	return table;
 }
 
-void db_close(Table *table){
-	Pager *pager = table->pager;
+void server_close_connection(Server *server, Connection *connection){
+/*
+ * Close now, free at the end of the round of events, which may still
+ * name the connection.
+ */
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+	close(connection->fd);
+	connection->fd = -1;
 
-	for(uint32_t i = 0; i < pager->num_pages; i++){
-		if(pager->pages[i] == NULL){
-			continue;
-		}
-		pager_flush(pager, i);
-		free(pager->pages[i]);
-		pager->pages[i] = NULL;
+	if(connection->prev != NULL){
+		connection->prev->next = connection->next;
+	} else{
+		server->connections = connection->next;
+	}
+	if(connection->next != NULL){
+		connection->next->prev = connection->prev;
 	}
+	connection->prev = NULL;
+	connection->next = server->closed;
+	server->closed = connection;
+}
 
-	int result = close(pager->file_descriptor);
-	if(result == -1){
-		printf("Error closing db file.\n");
-		exit(EXIT_FAILURE);
+void server_free_statement(Statement *statement){
+	if(statement->type == STATEMENT_INSERT && statement->rows != &statement->row_to_insert){
+		free(statement->rows);
 	}
+	free(statement);
+}
 
-	for(uint32_t i = 0; i < TABLE_MAX_PAGES; i++){
-		void *page = pager->pages[i];
-		if(page){
-			free(page);
-			pager->pages[i] = NULL;
+void server_free_closed(Server *server){
+	while(server->closed != NULL){
+		Connection *connection = server->closed;
+		server->closed = connection->next;
+
+		for(uint32_t i = 0; i < connection->num_prepared; i++){
+			if(connection->prepared[i] != NULL){
+				server_free_statement(connection->prepared[i]);
+			}
 		}
+		free(connection->prepared);
+		free(connection->in);
+		free(connection->out);
+		free(connection);
 	}
+}
 
-	free(pager);
-	free(table);
+ServerResponse server_prepare_response(PrepareResult result){
+	switch(result){
+		case PREPARE_SUCCESS:
+			return RESPONSE_OK;
+		case PREPARE_NEGATIVE_ID:
+			return RESPONSE_NEGATIVE_ID;
+		case PREPARE_STRING_TOO_LONG:
+			return RESPONSE_STRING_TOO_LONG;
+		case PREPARE_SYNTAX_ERROR:
+			return RESPONSE_SYNTAX_ERROR;
+		case PREPARE_UNRECOGNIZED_STATEMENT:
+			return RESPONSE_UNRECOGNIZED_STATEMENT;
+	}
+	return RESPONSE_BAD_REQUEST;
 }
 
-/*----------------------Serialize----------------------------------*/
-void serialize_row(Row *row, void *dest){
-	memcpy(dest+ID_OFFSET, &row->id, ID_SIZE);
-	memcpy(dest+USERNAME_OFFSET, &row->username, USERNAME_SIZE);
-	memcpy(dest+EMAIL_OFFSET, &row->email, EMAIL_SIZE);
+ServerResponse server_execute_response(ExecuteResult result){
+	switch(result){
+		case EXECUTE_SUCCESS:
+			return RESPONSE_OK;
+		case EXECUTE_DUPLICATE_KEY:
+			return RESPONSE_DUPLICATE_KEY;
+		case EXECUTE_TABLE_FULL:
+			return RESPONSE_TABLE_FULL;
+		case EXECUTE_INDEX_EXISTS:
+			return RESPONSE_INDEX_EXISTS;
+	}
+	return RESPONSE_BAD_REQUEST;
 }
 
-void deserialize_row(void *src, Row *row){
-	memcpy(&row->id, src+ID_OFFSET, ID_SIZE);
-	memcpy(&row->username, src+USERNAME_OFFSET, USERNAME_SIZE);
-	memcpy(&row->email, src+EMAIL_OFFSET, EMAIL_SIZE);
+Statement *server_prepared(Connection *connection, uint8_t *body, uint32_t length){
+/*
+ * The statement whose handle starts body, NULL if there is none.
+ */
+	uint32_t handle;
+
+	if(length < sizeof(handle)){
+		return NULL;
+	}
+	memcpy(&handle, body, sizeof(handle));
+	return handle < connection->num_prepared ? connection->prepared[handle] : NULL;
 }
 
-/*----------------------Cursor----------------------------------*/
-Cursor *table_start(Table *table){
-	Cursor *cursor = table_find(table, 0);
+ServerResponse server_query(Server *server, uint8_t *body, uint32_t length, FILE *out){
+	char *text = (char *)arena_alloc(arena_thread(), length + 1);
+	memcpy(text, body, length);
+	text[length] = '\0';
+	InputBuffer input_buffer = { .buf = text, .buf_len = length, .input_len = length };
+	Statement statement;
 
-	void *node = get_page(table->pager, cursor->page_num);
-	uint32_t num_cells = *leaf_node_num_cells(node);
-	cursor->end_of_table = (num_cells == 0);
+	PrepareResult prepared = prepare_statement(&input_buffer, &statement);
+	if(prepared != PREPARE_SUCCESS){
+		return server_prepare_response(prepared);
+	}
 
-	return cursor;
+	ExecuteResult result = execute_statement_to(server->table, &statement, out, true);
+	return server_execute_response(result);
 }
 
-void *cursor_value(Cursor *cursor){
-	uint32_t page_num = cursor->page_num;
-	void *page = get_page(cursor->table->pager, page_num);
+ServerResponse server_prepare(Connection *connection, uint8_t *body, uint32_t length, FILE *out){
+/*
+ * The handle is the first free slot, so a client that closes what it
+ * prepares keeps reusing a few.
+ */
+	char *text = (char *)arena_alloc(arena_thread(), length + 1);
+	memcpy(text, body, length);
+	text[length] = '\0';
+	InputBuffer input_buffer = { .buf = text, .buf_len = length, .input_len = length };
+	Statement *statement = (Statement *)malloc(sizeof(*statement));
+
+	PrepareResult prepared = prepare_template(&input_buffer, statement);
+	if(prepared != PREPARE_SUCCESS){
+		free(statement);
+		return server_prepare_response(prepared);
+	}
 
-	return leaf_node_value(page, cursor->cell_num);
+	uint32_t handle = 0;
+	while(handle < connection->num_prepared && connection->prepared[handle] != NULL){
+		handle++;
+	}
+	if(handle == connection->num_prepared){
+		connection->num_prepared++;
+		connection->prepared = (Statement **)realloc(connection->prepared,
+				connection->num_prepared * sizeof(Statement *));
+	}
+	connection->prepared[handle] = statement;
+
+	uint8_t num_params = statement->num_params;
+	fwrite(&handle, sizeof(handle), 1, out);
+	fwrite(&num_params, 1, 1, out);
+	for(uint32_t i = 0; i < num_params; i++){
+		uint8_t is_key = statement_param_is_key(statement->params[i]);
+		fwrite(&is_key, 1, 1, out);
+	}
+	return RESPONSE_OK;
 }
 
-void cursor_advance(Cursor *cursor){
-	uint32_t page_num = cursor->page_num;
-	void *node = get_page(cursor->table->pager, page_num);
+ServerResponse server_execute(Server *server, Connection *connection, uint8_t *body,
+		uint32_t length, FILE *out){
+/*
+ * Parameters are bound into a copy, the prepared statement is left as it
+ * was parsed.
+ */
+	Statement *prepared = server_prepared(connection, body, length);
+	if(prepared == NULL){
+		return RESPONSE_BAD_REQUEST;
+	}
+	Statement statement = *prepared;
+	if(prepared->rows == &prepared->row_to_insert){
+		statement.rows = &statement.row_to_insert;
+	}
 
-	cursor->cell_num += 1;
-	if(cursor->cell_num >= (*leaf_node_num_cells(node))){
-		/* Advance to next leaf node */
-		uint32_t next_page_num = *leaf_node_next_leaf(node);
-		if(next_page_num == 0){
-			/* This was rightmost leaf */
-			cursor->end_of_table = true;
+	uint32_t offset = sizeof(uint32_t);
+	for(uint32_t i = 0; i < statement.num_params; i++){
+		PrepareResult result;
+
+		if(statement_param_is_key(statement.params[i])){
+			uint32_t key;
+			if(length - offset < sizeof(key)){
+				return RESPONSE_BAD_REQUEST;
+			}
+			memcpy(&key, body + offset, sizeof(key));
+			offset += sizeof(key);
+			result = statement_bind_key(&statement, i, key);
 		} else{
-			cursor->page_num = next_page_num;
-			cursor->cell_num = 0;
+			uint16_t text_length;
+			if(length - offset < sizeof(text_length)){
+				return RESPONSE_BAD_REQUEST;
+			}
+			memcpy(&text_length, body + offset, sizeof(text_length));
+			offset += sizeof(text_length);
+			if(length - offset < text_length){
+				return RESPONSE_BAD_REQUEST;
+			}
+			result = statement_bind_text(&statement, i, (char *)body + offset, text_length);
+			offset += text_length;
+		}
+		if(result != PREPARE_SUCCESS){
+			return server_prepare_response(result);
 		}
 	}
-}
+	if(offset != length){
+		return RESPONSE_BAD_REQUEST;
+	}
 
-/*----------------------Print----------------------------------*/
-void print_constants(){
-	printf("ROW_SIZE: %d\n", ROW_SIZE);
-	printf("COMMON_NODE_HEADER_SIZE: %ld\n", COMMON_NODE_HEADER_SIZE);
-	printf("LEAF_NODE_HEADER_SIZE: %ld\n", LEAF_NODE_HEADER_SIZE);
-	printf("LEAF_NODE_SPACE_FOR_CELLS: %ld\n", LEAF_NODE_SPACE_FOR_CELLS);
-	printf("LEAF_NODE_MAX_CELLS: %ld\n", LEAF_NODE_MAX_CELLS);
-	printf("LEAF_NODE_VALUE_SIZE: %d\n", LEAF_NODE_VALUE_SIZE);
+	return server_execute_response(execute_statement_to(server->table, &statement, out, true));
 }
 
-void print_row(Row *row){
-	printf("(%d, %s, %s)\n", row->id, row->username, row->email);
-}
+ServerResponse server_close_prepared(Connection *connection, uint8_t *body, uint32_t length){
+	Statement *statement = server_prepared(connection, body, length);
+	uint32_t handle;
 
-void indent(uint32_t level){
-	for(uint32_t i = 0; i < level; i++){
-		printf("  ");
+	if(statement == NULL || length != sizeof(handle)){
+		return RESPONSE_BAD_REQUEST;
 	}
+	memcpy(&handle, body, sizeof(handle));
+	server_free_statement(statement);
+	connection->prepared[handle] = NULL;
+	return RESPONSE_OK;
 }
 
-void print_tree(Pager *pager, uint32_t page_num, uint32_t indentation_level){
-	void *node = get_page(pager, page_num);
-	uint32_t num_keys, child;
-
-	switch(get_node_type(node)){
-		case NODE_INTERNAL:
-			num_keys = *internal_node_num_keys(node);
-			indent(indentation_level);
-			printf("- internal (size %d)\n", num_keys);
-			for(uint32_t i = 0; i < num_keys; i++){
-				child = *internal_node_child(node, i);
-				print_tree(pager, child, indentation_level + 1);
-
-				indent(indentation_level + 1);
-				printf("- key %d\n", *internal_node_key(node, i));
-			}
-			print_tree(pager, *internal_node_right_child(node), indentation_level + 1);
+void server_respond(Server *server, Connection *connection, uint8_t type, uint8_t *body,
+		uint32_t length, FILE *out, char **responses){
+/*
+ * Append the response to out, a memory stream over *responses. The length
+ * is filled in once the statement has written its results after the
+ * header; a memory stream ends wherever it was last written, so that is
+ * done in the flushed buffer rather than by seeking back.
+ */
+	uint8_t header[SERVER_HEADER_SIZE] = {0};
+	long start = ftell(out);
+	ServerResponse response;
+
+	fwrite(header, 1, sizeof(header), out);
+	switch(type){
+		case REQUEST_QUERY:
+			response = server_query(server, body, length, out);
 			break;
-		case NODE_LEAF:
-			num_keys = *leaf_node_num_cells(node);
-			indent(indentation_level);
-			printf("- leaf (size %d)\n", num_keys);
-			for(uint32_t i = 0; i < num_keys; i++){
-				indent(indentation_level + 1);
-				printf("- %d\n", *leaf_node_key(node, i));
-			}
+		case REQUEST_PREPARE:
+			response = server_prepare(connection, body, length, out);
 			break;
+		case REQUEST_EXECUTE:
+			response = server_execute(server, connection, body, length, out);
+			break;
+		case REQUEST_CLOSE:
+			response = server_close_prepared(connection, body, length);
+			break;
+		default:
+			response = RESPONSE_BAD_REQUEST;
 	}
-}
 
-void print_help(){
-	printf(".exit | .constants | .btree | .help\n");
-}
+	arena_reset(arena_thread());
 
-MetaCommandResult do_meta_command(Table *table, InputBuffer *input_buffer){
-	if(!strcmp(input_buffer->buf, ".exit")){
-		db_close(table);
-		close_input_buffer(&input_buffer);
-		exit(EXIT_SUCCESS);
-	} else if(!strcmp(input_buffer->buf, ".constants")){
-		printf("Constants:\n");
-		print_constants();
-		return META_COMMAND_SUCCESS;
-	} else if(!strcmp(input_buffer->buf, ".btree")){
-		printf("Tree:\n");
-		print_tree(table->pager, table->root_page_num, 0);
-		return META_COMMAND_SUCCESS;
-	} else if(!strcmp(input_buffer->buf, ".help")){
-		print_help();
-		return META_COMMAND_SUCCESS;
-	} else {
-		return META_COMMAND_UNRECOGNIZED_COMMAND;
-	}
+	fflush(out);
+	uint32_t message_length = ftell(out) - start - SERVER_LENGTH_SIZE;
+	memcpy(*responses + start, &message_length, SERVER_LENGTH_SIZE);
+	(*responses)[start + SERVER_LENGTH_SIZE] = response;
 }
 
+bool server_send(Server *server, Connection *connection){
+/*
+ * Send what the socket takes. Returns false if the connection failed.
+ */
+	while(connection->out_sent < connection->out_length){
+		ssize_t sent = send(connection->fd, connection->out + connection->out_sent,
+				connection->out_length - connection->out_sent, MSG_NOSIGNAL);
+		if(sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+			if(!connection->sending){
+				server_watch(server, connection, EPOLLOUT);
+				connection->sending = true;
+			}
+			return true;
+		}
+		if(sent == -1 && errno != EINTR){
+			return false;
+		}
+		if(sent > 0){
+			connection->out_sent += sent;
+		}
+	}
 
-/*----------------------prepare----------------------------------*/
-PrepareResult prepare_insert(InputBuffer *input_buffer, Statement *statement){
-	statement->type = STATEMENT_INSERT;
-	
-	char *keyword = strtok(input_buffer->buf, " ");
-	char *id_string = strtok(NULL, " ");
-	char *username = strtok(NULL, " ");
-	char *email = strtok(NULL, " ");
-
-	if(id_string == NULL || username == NULL || email == NULL){
-		return PREPARE_SYNTAX_ERROR;
+	free(connection->out);
+	connection->out = NULL;
+	connection->out_length = 0;
+	connection->out_sent = 0;
+	if(connection->sending){
+		server_watch(server, connection, EPOLLIN);
+		connection->sending = false;
 	}
+	return true;
+}
 
-	int id = atoi(id_string);
-	if(id < 0){
-		return PREPARE_NEGATIVE_ID;
+bool server_receive(Server *server, Connection *connection){
+/*
+ * Read once and answer every whole request that is in. Returns false if
+ * the connection was closed or sent something too long to be a request.
+ */
+	if(connection->in_size - connection->in_length < SERVER_READ_SIZE){
+		connection->in_size = connection->in_length + SERVER_READ_SIZE;
+		connection->in = (uint8_t *)realloc(connection->in, connection->in_size);
 	}
-	if(strlen(username) > COLUMN_USERNAME_SIZE){
-		return PREPARE_STRING_TOO_LONG; 
+	ssize_t bytes_read = read(connection->fd, connection->in + connection->in_length,
+			connection->in_size - connection->in_length);
+	if(bytes_read == -1){
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
 	}
-	if(strlen(email) > COLUMN_EMAIL_SIZE){
-		return PREPARE_STRING_TOO_LONG;
+	if(bytes_read == 0){
+		return false;
 	}
+	connection->in_length += bytes_read;
+
+	char *responses = NULL;
+	size_t responses_length = 0;
+	FILE *out = NULL;
+	uint32_t offset = 0;
+
+	while(connection->in_length - offset >= SERVER_LENGTH_SIZE){
+		uint32_t length;
+		memcpy(&length, connection->in + offset, SERVER_LENGTH_SIZE);
+		if(length == 0 || length > SERVER_MAX_MESSAGE){
+			if(out != NULL){
+				fclose(out);
+				free(responses);
+			}
+			return false;
+		}
+		if(connection->in_length - offset - SERVER_LENGTH_SIZE < length){
+			break;
+		}
+		if(out == NULL){
+			out = open_memstream(&responses, &responses_length);
+		}
+		server_respond(server, connection, connection->in[offset + SERVER_LENGTH_SIZE],
+				connection->in + offset + SERVER_HEADER_SIZE, length - 1, out, &responses);
+		offset += SERVER_LENGTH_SIZE + length;
+	}
+	memmove(connection->in, connection->in + offset, connection->in_length - offset);
+	connection->in_length -= offset;
 
-	statement->row_to_insert.id = id;
-	strcpy(statement->row_to_insert.username, username);
-	strcpy(statement->row_to_insert.email, email);
-
-	return PREPARE_SUCCESS;
+	if(out == NULL){
+		return true;
+	}
+	fclose(out);
+	connection->out = responses;
+	connection->out_length = responses_length;
+	connection->out_sent = 0;
+
+	Wal *wal = server->table->pager->wal;
+	if(wal != NULL && wal->pending_statements > 0){
+		connection->held_next = server->held;
+		server->held = connection;
+		return true;
+	}
+	return server_send(server, connection);
 }
 
-PrepareResult prepare_statement(InputBuffer *input_buffer, Statement *statement){
-	if(!strncmp(input_buffer->buf, "insert", 6)){
-		return prepare_insert(input_buffer, statement);
-	} 
-	if(!strncmp(input_buffer->buf, "select", 6)){
-		statement->type = STATEMENT_SELECT;
-		return PREPARE_SUCCESS;
+void server_commit(Server *server){
+/*
+ * Commit the writes of this round of events and only then send the
+ * responses held for them, so no client is told of a write a crash can
+ * still lose.
+ */
+	if(server->held == NULL){
+		return;
 	}
+	pager_flush_all(server->table->pager);
 
-	return PREPARE_UNRECOGNIZED_STATEMENT;
+	while(server->held != NULL){
+		Connection *connection = server->held;
+		server->held = connection->held_next;
+		if(connection->fd != -1 && !server_send(server, connection)){
+			server_close_connection(server, connection);
+		}
+	}
 }
 
-/*----------------------Execute----------------------------------*/
-ExecuteResult execute_insert(Table *table, Statement *statement){
-	void *node = get_page(table->pager, table->root_page_num);
-	uint32_t num_cells = *leaf_node_num_cells(node);
+void server_run(Table *table, const char *address){
+/*
+ * Serve clients on address until SIGINT or SIGTERM, which the caller
+ * blocks in every thread before starting any.
+ */
+	Server server = { .table = table };
+	sigset_t signals;
+	struct epoll_event events[SERVER_MAX_EVENTS];
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	server.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	server.listen_fd = server_listen(address);
+	server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = &server.listen_fd };
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &event);
+	event.data.ptr = &server.signal_fd;
+	epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.signal_fd, &event);
+	printf("Listening on %s.\n", address);
+	fflush(stdout);
+
+	bool running = true;
+	while(running){
+		int num_events = epoll_wait(server.epoll_fd, events, SERVER_MAX_EVENTS, -1);
+		if(num_events == -1 && errno != EINTR){
+			printf("Error waiting for events: %d\n", errno);
+			exit(EXIT_FAILURE);
+		}
 
-	Row *row_to_insert = &statement->row_to_insert;
-	uint32_t key_to_insert = row_to_insert->id;
-	Cursor *cursor = table_find(table, key_to_insert);
+		for(int i = 0; i < num_events; i++){
+			void *source = events[i].data.ptr;
+			if(source == &server.signal_fd){
+				running = false;
+				continue;
+			}
+			if(source == &server.listen_fd){
+				server_accept(&server);
+				continue;
+			}
 
-	if(cursor->cell_num < num_cells){
-		uint32_t key_at_index = *leaf_node_key(node, cursor->cell_num);
-		if(key_at_index == key_to_insert){
-			return EXECUTE_DUPLICATE_KEY;
+			Connection *connection = (Connection *)source;
+			if(connection->fd == -1){
+				continue;
+			}
+			bool open = true;
+			if(connection->sending){
+				open = !(events[i].events & (EPOLLERR | EPOLLHUP)) && server_send(&server, connection);
+			} else{
+				open = server_receive(&server, connection);
+			}
+			if(!open){
+				server_close_connection(&server, connection);
+			}
 		}
+		server_commit(&server);
+		server_free_closed(&server);
 	}
 
-	leaf_node_insert(cursor, row_to_insert->id, row_to_insert);
-	free(cursor);
-
-	return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_select(Table *table, Statement *statement){
-	Cursor *cursor = table_start(table);
-	Row row;
-	
-	while(!cursor->end_of_table){
-		deserialize_row(cursor_value(cursor), &row);
-		print_row(&row);
-		cursor_advance(cursor);
+	while(server.connections != NULL){
+		server_close_connection(&server, server.connections);
 	}
-
-	free(cursor);
-	return EXECUTE_SUCCESS;
-}
-
-ExecuteResult execute_statement(Table *table, Statement *statement){
-	switch(statement->type){
-		case STATEMENT_INSERT:
-			return execute_insert(table, statement);
-		case STATEMENT_SELECT:
-			return execute_select(table, statement);
+	server_free_closed(&server);
+	close(server.epoll_fd);
+	close(server.listen_fd);
+	close(server.signal_fd);
+	if(!strncmp(address, "unix:", 5)){
+		unlink(address + 5);
 	}
 }
 
+#ifndef DB_LIBRARY
 int main(int argc, char *argv[]) {
-	if(argc < 2){
+	DbOptions options = {
+		.pool_frames = PAGER_DEFAULT_FRAMES,
+		.use_mmap = false,
+		.use_wal = true,
+		.group_commit = WAL_DEFAULT_GROUP_COMMIT,
+		.scan_threads = 0,
+		.io_backend = IO_DEFAULT,
+		.use_direct = false,
+		.stats_file = NULL,
+		.stats_interval = STATS_DEFAULT_INTERVAL
+	};
+	char *filename = NULL;
+	char *server_address = NULL;
+
+	for(int i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "--frames") && i + 1 < argc){
+			options.pool_frames = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--group-commit") && i + 1 < argc){
+			options.group_commit = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--threads") && i + 1 < argc){
+			options.scan_threads = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--mmap")){
+			options.use_mmap = true;
+		} else if(!strcmp(argv[i], "--no-wal")){
+			options.use_wal = false;
+		} else if(!strcmp(argv[i], "--direct")){
+			options.use_direct = true;
+		} else if(!strcmp(argv[i], "--stats-file") && i + 1 < argc){
+			options.stats_file = argv[++i];
+		} else if(!strcmp(argv[i], "--stats-interval") && i + 1 < argc){
+			options.stats_interval = atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "--server") && i + 1 < argc){
+			server_address = argv[++i];
+		} else if(!strcmp(argv[i], "--io") && i + 1 < argc){
+			i++;
+			if(!strcmp(argv[i], "uring")){
+				options.io_backend = IO_URING;
+			} else if(!strcmp(argv[i], "threads")){
+				options.io_backend = IO_THREADS;
+			} else if(!strcmp(argv[i], "sync")){
+				options.io_backend = IO_SYNC;
+			} else{
+				printf("Unknown I/O backend '%s', expected uring, threads or sync.\n", argv[i]);
+				exit(EXIT_FAILURE);
+			}
+		} else{
+			filename = argv[i];
+		}
+	}
+
+	if(filename == NULL){
 		printf("Must supply a database filename.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	char *filename = argv[1];
-	Table *table = db_open(filename);
+	if(server_address != NULL){
+		/* Blocked before db_open starts threads, so the server's signalfd gets them */
+		sigset_t signals;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+		Table *table = db_open(filename, &options);
+		server_run(table, server_address);
+		db_close(table);
+		return 0;
+	}
+
+	Table *table = db_open(filename, &options);
 	InputBuffer *input_buffer = new_input_buffer();
 
 	while(1) {
+		/* What the last statement took from the arena */
+		arena_reset(arena_thread());
 		print_prompt();
 		read_input(input_buffer);
 
@@ -911,7 +6867,11 @@ int main(int argc, char *argv[]) {
 			case EXECUTE_TABLE_FULL:
 				printf("Error: Table full.\n");
 				break;
+			case EXECUTE_INDEX_EXISTS:
+				printf("Error: Index already exists.\n");
+				break;
 		}
 	}
 
 }
+#endif